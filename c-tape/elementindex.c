@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "elementindex.h"
+#include "logutil.h"
+
+/** Slots allocated by the first append. */
+#define ElementIndex_INITIAL_CAPACITY 64
+
+// see description in elementindex.h.
+void ElementIndex_init(ElementIndex* index, const QueueFile_Allocator* allocator,
+                       uint32_t maxCount) {
+  memset(index, 0, sizeof(ElementIndex));
+  index->allocator = allocator;
+  index->maxCount = maxCount;
+}
+
+// see description in elementindex.h.
+void ElementIndex_free(ElementIndex* index) {
+  if (index->positions != NULL) {
+    index->allocator->free(index->allocator->context, index->positions);
+  }
+  if (index->lengths != NULL) {
+    index->allocator->free(index->allocator->context, index->lengths);
+  }
+  index->positions = NULL;
+  index->lengths = NULL;
+  index->head = index->count = index->capacity = 0;
+}
+
+/** Doubles the capacity, unwrapping the ring into the new arrays. */
+static bool ElementIndex_grow(ElementIndex* index) {
+  if (index->capacity >= 0x80000000) return false;
+  uint32_t capacity = index->capacity == 0 ? ElementIndex_INITIAL_CAPACITY :
+                      index->capacity << 1;
+  uint64_t* positions = index->allocator->alloc(
+      index->allocator->context, (size_t) capacity * sizeof(uint64_t));
+  uint32_t* lengths = index->allocator->alloc(
+      index->allocator->context, (size_t) capacity * sizeof(uint32_t));
+  if (CHECKOOM(positions) || CHECKOOM(lengths)) {
+    if (positions != NULL) {
+      index->allocator->free(index->allocator->context, positions);
+    }
+    if (lengths != NULL) {
+      index->allocator->free(index->allocator->context, lengths);
+    }
+    return false;
+  }
+  uint32_t i;
+  for (i = 0; i < index->count; i++) {
+    positions[i] = ElementIndex_position(index, i);
+    lengths[i] = ElementIndex_length(index, i);
+  }
+  uint32_t count = index->count;
+  ElementIndex_free(index);
+  index->positions = positions;
+  index->lengths = lengths;
+  index->capacity = capacity;
+  index->count = count;
+  return true;
+}
+
+// see description in elementindex.h.
+bool ElementIndex_append(ElementIndex* index, uint64_t position,
+                         uint32_t length) {
+  if (index->count >= index->maxCount) return false;
+  if (index->count == index->capacity && !ElementIndex_grow(index)) {
+    return false;
+  }
+  uint32_t slot = (index->head + index->count) & (index->capacity - 1);
+  index->positions[slot] = position;
+  index->lengths[slot] = length;
+  index->count++;
+  return true;
+}
+
+// see description in elementindex.h.
+void ElementIndex_removeFirst(ElementIndex* index, uint32_t n) {
+  if (n >= index->count) {
+    ElementIndex_clear(index);
+    return;
+  }
+  index->head = (index->head + n) & (index->capacity - 1);
+  index->count -= n;
+}
+
+// see description in elementindex.h.
+void ElementIndex_clear(ElementIndex* index) {
+  index->head = 0;
+  index->count = 0;
+}
+
+// see description in elementindex.h.
+uint64_t ElementIndex_position(const ElementIndex* index, uint32_t i) {
+  return index->positions[(index->head + i) & (index->capacity - 1)];
+}
+
+// see description in elementindex.h.
+uint32_t ElementIndex_length(const ElementIndex* index, uint32_t i) {
+  return index->lengths[(index->head + i) & (index->capacity - 1)];
+}
+
+// see description in elementindex.h.
+void ElementIndex_relocate(ElementIndex* index, uint64_t from, uint64_t length,
+                           uint64_t to) {
+  uint32_t i;
+  for (i = 0; i < index->count; i++) {
+    uint32_t slot = (index->head + i) & (index->capacity - 1);
+    uint64_t position = index->positions[slot];
+    if (position >= from && position < from + length) {
+      index->positions[slot] = position - from + to;
+    }
+  }
+}
+
+// see description in elementindex.h.
+uint64_t ElementIndex_memory(const ElementIndex* index) {
+  return (uint64_t) index->capacity * (sizeof(uint64_t) + sizeof(uint32_t));
+}
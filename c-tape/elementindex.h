@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ELEMENTINDEX_H_
+#define ELEMENTINDEX_H_
+
+#include"types.h"
+#include"queuefile.h"
+
+/**
+ * Positions and lengths of the eldest elements of a queue, kept in memory so
+ * that lookups don't read element headers from the file. Internal to
+ * QueueFile, see QueueFile_Options.indexed.
+ *
+ * The entries are a ring of two parallel arrays which grows by doubling up to
+ * maxCount entries. Only a prefix of the queue is indexed once it holds more
+ * elements than that.
+ */
+typedef struct {
+  uint64_t* positions;
+  uint32_t* lengths;
+  /** Slot of the eldest entry. */
+  uint32_t head;
+  /** Number of entries. */
+  uint32_t count;
+  /** Number of slots allocated, 0 or a power of 2. */
+  uint32_t capacity;
+  /** Upper bound for count. */
+  uint32_t maxCount;
+  const QueueFile_Allocator* allocator;
+} ElementIndex;
+
+/** Sets up an empty index, allocating nothing yet. */
+void ElementIndex_init(ElementIndex* index, const QueueFile_Allocator* allocator,
+                       uint32_t maxCount);
+
+/** Frees the arrays. */
+void ElementIndex_free(ElementIndex* index);
+
+/**
+ * Appends the entry for a newer element.
+ * @return false if the index is full or out of memory, the entry is dropped.
+ */
+bool ElementIndex_append(ElementIndex* index, uint64_t position,
+                         uint32_t length);
+
+/** Drops the n eldest entries, or all of them if there are fewer. */
+void ElementIndex_removeFirst(ElementIndex* index, uint32_t n);
+
+/** Drops all entries. */
+void ElementIndex_clear(ElementIndex* index);
+
+/** @return position of the i-th eldest entry, i must be < count. */
+uint64_t ElementIndex_position(const ElementIndex* index, uint32_t i);
+
+/** @return length of the i-th eldest entry, i must be < count. */
+uint32_t ElementIndex_length(const ElementIndex* index, uint32_t i);
+
+/** Moves the entries positioned in [from, from + length) to start at to. */
+void ElementIndex_relocate(ElementIndex* index, uint64_t from, uint64_t length,
+                           uint64_t to);
+
+/** @return bytes allocated for the arrays. */
+uint64_t ElementIndex_memory(const ElementIndex* index);
+
+#endif //elementindex_h
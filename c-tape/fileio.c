@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -33,8 +36,8 @@
 // copy buffer is on stack, use a variable s.t. we can override value in tests.
 static uint32_t copyBufferSize = 4096;
 
-// sanity limit of 2GB
-#define FILE_HARD_SANITY_LIMIT ((uint32_t)(1<<31))
+// sanity limit of 2^48 bytes (256TB) for positions and file lengths.
+#define FILE_HARD_SANITY_LIMIT ((uint64_t) 1 << 48)
 
 static bool for_testing_failAllWrites = false;
 
@@ -42,16 +45,16 @@ static bool for_testing_failAllWrites = false;
  * File utility primitives somewhat patterned on RandomAccessFile.
  */
 
-bool FileIo_seek(FILE* file, uint32_t position) {
+bool FileIo_seek(FILE* file, uint64_t position) {
   if (position > FILE_HARD_SANITY_LIMIT) {
-    LOG(LFATAL, "Requested seek (%d) exceeds sanity hard limit %d", position,
-        FILE_HARD_SANITY_LIMIT);
+    LOG(LFATAL, "Requested seek (%" PRIu64 ") exceeds sanity hard limit %"
+        PRIu64, position, FILE_HARD_SANITY_LIMIT);
     return false;
   }
 
-  if (fseek(file, (long)position, SEEK_SET) < 0) {
-    LOG(LWARN, "Error setting file position to %d. fhandle %d", position,
-        fileno(file));
+  if (fseeko(file, (off_t) position, SEEK_SET) < 0) {
+    LOG(LWARN, "Error setting file position to %" PRIu64 ". fhandle %d",
+        position, fileno(file));
     return false;
   }
   return true;
@@ -63,11 +66,6 @@ bool FileIo_write(FILE* file, const byte* buffer, uint32_t buffer_offset,
     LOG(LDEBUG, "Failing write as requested. see for_testing_failAllWrites");
     return false;
   }
-  if (length > FILE_HARD_SANITY_LIMIT || buffer_offset > FILE_HARD_SANITY_LIMIT) {
-    LOG(LFATAL, "Requested file write %d or offset %d exceeds sanity hard limit %d",
-        length, buffer_offset, FILE_HARD_SANITY_LIMIT);
-    return false;
-  }
   if (fwrite(buffer + buffer_offset, (size_t) 1, (size_t) length, file) != length) {
     LOG(LWARN, "Error writing data, fhandle %d", fileno(file));
     return false;
@@ -81,11 +79,6 @@ bool FileIo_write(FILE* file, const byte* buffer, uint32_t buffer_offset,
 
 bool FileIo_read(FILE* file, void* buffer, uint32_t buffer_offset,
                  uint32_t length) {
-  if (length > FILE_HARD_SANITY_LIMIT) {
-    LOG(LFATAL, "Requested seek (%d) exceeds sanity hard limit %d", length,
-        FILE_HARD_SANITY_LIMIT);
-    return false;
-  }
   if (fread(buffer + buffer_offset, (size_t) 1, (size_t) length, file) != length) {
     LOG(LWARN, "Error reading element from fhandle %d", fileno(file));
     return false;
@@ -93,13 +86,13 @@ bool FileIo_read(FILE* file, void* buffer, uint32_t buffer_offset,
   return true;
 }
 
-off_t FileIo_getLength(FILE* file) {
+int64_t FileIo_getLength(FILE* file) {
   struct stat filestat;
   if (fstat(fileno(file), &filestat) != 0) {
     LOG(LWARN, "Error getting file stat. fhandle %d", fileno(file));
     return -1;
   }
-  return filestat.st_size;
+  return (int64_t) filestat.st_size;
 }
 
 bool FileIo_writeZeros(FILE* file, uint32_t length) {
@@ -130,7 +123,7 @@ bool FileIo_writeZeros(FILE* file, uint32_t length) {
   return true;
 }
 
-bool FileIo_setLength(FILE* file, uint32_t length) {
+bool FileIo_setLength(FILE* file, uint64_t length) {
   // Some systems allow the file length to be adjusted using truncate, as
   // some JVMs do.
   
@@ -140,21 +133,38 @@ bool FileIo_setLength(FILE* file, uint32_t length) {
   }
 
   if (length > FILE_HARD_SANITY_LIMIT) {
-    LOG(LFATAL, "Requested file size (%d) exceeds sanity hard limit %d", length,
-        FILE_HARD_SANITY_LIMIT);
+    LOG(LFATAL, "Requested file size (%" PRIu64 ") exceeds sanity hard limit %"
+        PRIu64, length, FILE_HARD_SANITY_LIMIT);
     return false;
   }
   if (ftruncate(fileno(file), (off_t)length) != 0 || fsync(fileno(file)) != 0) {
-    LOG(LWARN, "Error setting file length to %d, fhandle %d", length,
+    LOG(LWARN, "Error setting file length to %" PRIu64 ", fhandle %d", length,
         fileno(file));
     return false;
   }
   return true;
 }
 
+bool FileIo_preallocate(FILE* file, uint64_t offset, uint64_t length) {
+  if (offset + length > FILE_HARD_SANITY_LIMIT) {
+    LOG(LFATAL, "Requested file size (%" PRIu64 ") exceeds sanity hard limit %"
+        PRIu64, offset + length, FILE_HARD_SANITY_LIMIT);
+    return false;
+  }
+  int error = posix_fallocate(fileno(file), (off_t) offset, (off_t) length);
+  if (error == EINVAL || error == EOPNOTSUPP) {
+    LOG(LDEBUG, "Preallocation not supported, fhandle %d", fileno(file));
+  } else if (error != 0 || fsync(fileno(file)) != 0) {
+    LOG(LWARN, "Error preallocating %" PRIu64 " bytes at %" PRIu64
+        ", fhandle %d", length, offset, fileno(file));
+    return false;
+  }
+  return true;
+}
+
 
-bool FileIo_transferTo(FILE* file, uint32_t source, uint32_t destination,
-                       uint32_t length) {
+bool FileIo_transferTo(FILE* file, uint64_t source, uint64_t destination,
+                       uint64_t length) {
   // TODO(jochen): if needed, overlap handling to be more accommodating.
   // TODO(jochen): investigate whether fread and fwrite make efficient use of
   //               buffering in the FILE handling code.
@@ -169,8 +179,9 @@ bool FileIo_transferTo(FILE* file, uint32_t source, uint32_t destination,
   if (!FileIo_seek(file, source)) return false;
   ssize_t wrote = sendfile(fileno(file), fileno(file), NULL, (size_t) length);
   if (wrote == -1 || wrote != (size_t) length) {
-    LOG(LWARN, "Error in sendfile. src=%d dest=%d len=%d (%d), fhandle %d",
-        source, destination, length, read, fileno(file));
+    LOG(LWARN, "Error in sendfile. src=%" PRIu64 " dest=%" PRIu64 " len=%"
+        PRIu64 " (%zd), fhandle %d", source, destination, length, wrote,
+        fileno(file));
     return false;
   }
 
@@ -179,7 +190,7 @@ bool FileIo_transferTo(FILE* file, uint32_t source, uint32_t destination,
   if ((destination > source && source + length > destination) ||
       (destination < source && destination + length > source)){
     LOG(LWARN, "Can't transfer between overlapping parts of file. "
-        "src=%d dest=%d len=%d, fhandle %d",
+        "src=%" PRIu64 " dest=%" PRIu64 " len=%" PRIu64 ", fhandle %d",
         source, destination, length, fileno(file));
     return false;
   }
@@ -188,18 +199,21 @@ bool FileIo_transferTo(FILE* file, uint32_t source, uint32_t destination,
   while (length > 0) {
     if (!FileIo_seek(file, source)) return false;
 
-    uint32_t copylen = length < copyBufferSize ? length : copyBufferSize;
+    uint32_t copylen = length < copyBufferSize ?
+                       (uint32_t) length : copyBufferSize;
     size_t read = fread(buffer, (size_t) 1, (size_t) copylen, file);
     if (read < copylen) {
-      LOG(LWARN, "Error reading file, src=%d dest=%d len=%d (%d), fhandle %d",
-          source, destination, length, copylen, fileno(file));
+      LOG(LWARN, "Error reading file, src=%" PRIu64 " dest=%" PRIu64 " len=%"
+          PRIu64 " (%u), fhandle %d", source, destination, length, copylen,
+          fileno(file));
       return false;
     }
     if (!FileIo_seek(file, destination)) return false;
     size_t wrote = fwrite(buffer, (size_t) 1, read, file);
     if (wrote < read) {
-      LOG(LWARN, "Error writing file, src=%d dest=%d len=%d (%d), fhandle %d",
-          source, destination, length, read, fileno(file));
+      LOG(LWARN, "Error writing file, src=%" PRIu64 " dest=%" PRIu64 " len=%"
+          PRIu64 " (%zu), fhandle %d", source, destination, length, read,
+          fileno(file));
       return false;
     }
     length -= wrote;
@@ -20,11 +20,13 @@
 #include"types.h"
 
 /**
- * File utility primitives somewhat patterned on RandomAccessFile.
+ * File utility primitives somewhat patterned on RandomAccessFile. File
+ * positions and lengths are 64-bit, single reads and writes are limited to
+ * 4GB.
  */
 
 /** Moves the file pointer to given position */
-bool FileIo_seek(FILE* file, uint32_t position);
+bool FileIo_seek(FILE* file, uint64_t position);
 
 /** Writes buffer to file, flushes to media. */
 bool FileIo_write(FILE* file, const byte* buffer, uint32_t buffer_offset,
@@ -34,7 +36,7 @@ bool FileIo_read(FILE* file, void* buffer, uint32_t buffer_offset,
                  uint32_t length);
 
 /** @return file length or -1 on error */
-off_t FileIo_getLength(FILE* file);
+int64_t FileIo_getLength(FILE* file);
 
 /**
   * Writes length 0s to file, flushes to media. Starts at current file position.
@@ -48,7 +50,16 @@ bool FileIo_writeZeros(FILE* file, uint32_t length);
  * some JVMs do for RandomAccessFile.setLength.
  * TODO(jochen): test this for iOS and Android).
  */
-bool FileIo_setLength(FILE* file, uint32_t length);
+bool FileIo_setLength(FILE* file, uint64_t length);
+
+/**
+ * Allocates the disk blocks of length bytes at offset, so that writing there
+ * later doesn't wait for the file system to find space, and syncs them. The
+ * file grows if the bytes lie beyond its end. File systems which can't
+ * preallocate are left alone.
+ * @return false if an error occurred.
+ */
+bool FileIo_preallocate(FILE* file, uint64_t offset, uint64_t length);
 
 /**
  * Copies part of a file to another offset, the caller is responsible for
@@ -57,8 +68,8 @@ bool FileIo_setLength(FILE* file, uint32_t length);
  * TODO: investigate whether fread and fwrite make efficient use of the
  *       FILE's read cache.
  */
-bool FileIo_transferTo(FILE* file, uint32_t source, uint32_t destination,
-                       uint32_t length);
+bool FileIo_transferTo(FILE* file, uint64_t source, uint64_t destination,
+                       uint64_t length);
 
 /**
  * For testing only, enable or disable writes, for some reason the _Bool
@@ -48,6 +48,11 @@
 /** Used for debug builds, will fail program with stack trace */
 #define LOG_SETDEBUGFAILLEVEL_FATAL _log_debug_failatlevel(_LOGLEVEL_FATAL)
 
+/** Logs and evaluates to 1 if P is NULL. Macro to maintain line number. */
+#define NULLARG(P) ((P) == NULL ? LOG(LWARN, "Null argument passed") || 1 : 0)
+/** Logs and evaluates to 1 if P is NULL. Macro to maintain line number. */
+#define CHECKOOM(P) ((P) == NULL ? LOG(LWARN, "Out of memory") || 1 : 0)
+
 enum loglevel {
   _LOGLEVEL_DEBUG = 0, _LOGLEVEL_INFO, _LOGLEVEL_WARN, _LOGLEVEL_FATAL
 };
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "lzcodec.h"
+
+/** Shortest match worth a sequence, also the number of bytes hashed. */
+#define LzCodec_MIN_MATCH 4
+
+/** Farthest a match may lie back, offsets are stored in 2 bytes. */
+#define LzCodec_MAX_OFFSET 65535
+
+/** Number of bits of the hash of 4 bytes, the table takes 16KB of stack. */
+#define LzCodec_HASH_BITS 12
+
+/** Value of a token nibble which is continued by length bytes. */
+#define LzCodec_NIBBLE_MAX 15
+
+static uint32_t LzCodec_read32(const byte* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static uint32_t LzCodec_hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - LzCodec_HASH_BITS);
+}
+
+/** Appends the bytes continuing a nibble of value length. */
+static bool LzCodec_putLength(byte* out, uint32_t capacity, uint32_t* o,
+                              uint32_t length) {
+  if (length < LzCodec_NIBBLE_MAX) return true;
+  length -= LzCodec_NIBBLE_MAX;
+  while (length >= 255) {
+    if (*o == capacity) return false;
+    out[(*o)++] = 255;
+    length -= 255;
+  }
+  if (*o == capacity) return false;
+  out[(*o)++] = (byte) length;
+  return true;
+}
+
+/**
+ * Appends a sequence of literals followed by a match, or the last sequence if
+ * matchLength is 0.
+ */
+static bool LzCodec_putSequence(byte* out, uint32_t capacity, uint32_t* o,
+                                const byte* literals, uint32_t literalLength,
+                                uint32_t offset, uint32_t matchLength) {
+  uint32_t literalNibble = literalLength < LzCodec_NIBBLE_MAX ?
+                           literalLength : LzCodec_NIBBLE_MAX;
+  uint32_t matchNibble = 0;
+  if (matchLength > 0) {
+    matchLength -= LzCodec_MIN_MATCH;
+    matchNibble = matchLength < LzCodec_NIBBLE_MAX ?
+                  matchLength : LzCodec_NIBBLE_MAX;
+  }
+  if (*o == capacity) return false;
+  out[(*o)++] = (byte) (literalNibble << 4 | matchNibble);
+  if (!LzCodec_putLength(out, capacity, o, literalLength) ||
+      capacity - *o < literalLength) {
+    return false;
+  }
+  memcpy(out + *o, literals, (size_t) literalLength);
+  *o += literalLength;
+  if (offset == 0) return true;
+  if (capacity - *o < 2) return false;
+  out[(*o)++] = (byte) offset;
+  out[(*o)++] = (byte) (offset >> 8);
+  return LzCodec_putLength(out, capacity, o, matchLength);
+}
+
+// see description in lzcodec.h.
+uint32_t LzCodec_compress(const byte* data, uint32_t length, byte* out,
+                          uint32_t capacity) {
+  // Positions of the last 4 bytes seen with each hash, checked before use.
+  uint32_t table[1 << LzCodec_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  uint32_t o = 0;
+  uint32_t anchor = 0;
+  uint32_t i = 0;
+  while (length >= LzCodec_MIN_MATCH && i <= length - LzCodec_MIN_MATCH) {
+    uint32_t value = LzCodec_read32(data + i);
+    uint32_t hash = LzCodec_hash(value);
+    uint32_t candidate = table[hash];
+    table[hash] = i;
+    if (candidate >= i || i - candidate > LzCodec_MAX_OFFSET ||
+        LzCodec_read32(data + candidate) != value) {
+      i++;
+      continue;
+    }
+    uint32_t match = LzCodec_MIN_MATCH;
+    while (i + match < length && data[candidate + match] == data[i + match]) {
+      match++;
+    }
+    if (!LzCodec_putSequence(out, capacity, &o, data + anchor, i - anchor,
+                             i - candidate, match)) {
+      return 0;
+    }
+    i += match;
+    anchor = i;
+  }
+  // Data ending with a match needs no last sequence, unless it is empty.
+  if ((anchor < length || o == 0) &&
+      !LzCodec_putSequence(out, capacity, &o, data + anchor, length - anchor,
+                           0, 0)) {
+    return 0;
+  }
+  return o;
+}
+
+/** Reads the bytes continuing a nibble into *length. */
+static bool LzCodec_getLength(const byte* data, uint32_t length, uint32_t* i,
+                              uint32_t* value) {
+  if (*value < LzCodec_NIBBLE_MAX) return true;
+  byte next;
+  do {
+    if (*i == length) return false;
+    next = data[(*i)++];
+    *value += next;
+    // Longer than any element, the data is corrupt.
+    if (*value > UINT32_MAX - 255) return false;
+  } while (next == 255);
+  return true;
+}
+
+// see description in lzcodec.h.
+bool LzCodec_decompress(const byte* data, uint32_t length, byte* out,
+                        uint32_t outLength) {
+  uint32_t i = 0;
+  uint32_t o = 0;
+  while (i < length) {
+    byte token = data[i++];
+    uint32_t literalLength = (uint32_t) token >> 4;
+    if (!LzCodec_getLength(data, length, &i, &literalLength) ||
+        literalLength > length - i || literalLength > outLength - o) {
+      return false;
+    }
+    memcpy(out + o, data + i, (size_t) literalLength);
+    i += literalLength;
+    o += literalLength;
+    if (i == length) break;
+
+    if (length - i < 2) return false;
+    uint32_t offset = (uint32_t) data[i] | (uint32_t) data[i + 1] << 8;
+    i += 2;
+    uint32_t matchLength = (uint32_t) token & LzCodec_NIBBLE_MAX;
+    if (!LzCodec_getLength(data, length, &i, &matchLength)) return false;
+    matchLength += LzCodec_MIN_MATCH;
+    if (offset == 0 || offset > o || matchLength > outLength - o) {
+      return false;
+    }
+    const byte* from = out + o - offset;
+    if (offset >= matchLength) {
+      memcpy(out + o, from, (size_t) matchLength);
+    } else {
+      // Byte by byte, the match overlaps the bytes it produces.
+      uint32_t k;
+      for (k = 0; k < matchLength; k++) out[o + k] = from[k];
+    }
+    o += matchLength;
+  }
+  return o == outLength;
+}
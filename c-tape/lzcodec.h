@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LZCODEC_H_
+#define LZCODEC_H_
+
+#include"types.h"
+
+/**
+ * A small LZ77 compressor in the style of LZ4, the codec behind
+ * QueueFile_CODEC_LZ. Internal to QueueFile.
+ *
+ * The compressed data is a list of sequences. Each starts with a token whose
+ * high nibble is the number of literals and low nibble the match length
+ * minus 4; a nibble of 15 is followed by bytes adding up to the rest of the
+ * value, ended by a byte below 255. Then come the literals, a 2 byte little
+ * endian offset back into the output and the rest of the match length. The
+ * last sequence has literals only and ends with the data.
+ */
+
+/**
+ * Compresses length bytes of data into out.
+ * @return the compressed length, 0 if it doesn't fit into capacity bytes.
+ */
+uint32_t LzCodec_compress(const byte* data, uint32_t length, byte* out,
+                          uint32_t capacity);
+
+/**
+ * Decompresses length bytes of data into exactly outLength bytes.
+ * @return false if the data is corrupt.
+ */
+bool LzCodec_decompress(const byte* data, uint32_t length, byte* out,
+                        uint32_t outLength);
+
+#endif //lzcodec_h
@@ -14,35 +14,41 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "elementindex.h"
 #include "fileio.h"
 #include "logutil.h"
+#include "lzcodec.h"
 #include "queuefile.h"
+#include "segmentlog.h"
 
 /*
  * Port of Tape project from Java. https://github.com/square/tape
  *
- * Integers are forced to be 32-bit, maximum file size supported is 2^32 (4GB).
+ * File positions and lengths are 64-bit (format version 2), elements and
+ * element counts are limited to 32 bits. Version 1 files, which had 32-bit
+ * positions, are converted when opened.
  *
  * See description in queuefile.h.
  */
 
-/** frees if oldPointer is not NULL, assigns newPointer. */
-#define freeAndAssign(OLD, NEW) _freeAndAssign((void**)(OLD), (void*)(NEW))
-static bool _freeAndAssign(void** oldPointer, void* newPointer);
-
-/** frees and assigns oldPointer IFF newPointer is not NULL. */
-#define freeAndAssignNonNull(OLD, NEW) _freeAndAssignNonNull((void**)(OLD), (void*)(NEW))
-static bool _freeAndAssignNonNull(void** oldPointer, void* newPointer);
-
-// Use macro to maintain line number
-#define NULLARG(P) ((P) == NULL ? LOG(LWARN, "Null argument passed") || 1 : 0)
-#define CHECKOOM(P) ((P) == NULL ? LOG(LWARN, "Out of memory") || 1 : 0)
-
 // For sanity tests
 #define MAX_FILENAME_LEN 4096
 
@@ -51,42 +57,239 @@ static bool _freeAndAssignNonNull(void** oldPointer, void* newPointer);
 
 #define Element_HEADER_LENGTH 4
 
+/**
+ * Bit of the length in the element header set if the data is compressed, see
+ * QueueFile_Options.codec. Only used once QueueFile_FLAG_COMPRESSED is set.
+ */
+#define Element_COMPRESSED 0x80000000u
+
+/** Longest element of a queue holding compressed elements. */
+#define Element_MAX_FLAGGED_LENGTH 0x7fffffffu
+
+/**
+ * Compressed data starts with the id of the codec (1 byte) and the length of
+ * the decompressed data (4 bytes).
+ */
+#define Element_ENCODING_LENGTH 5
+
 /** A pointer to an element. */
 typedef struct {
   /** Position in file. */
-  uint32_t position;
+  uint64_t position;
   /** The length of the data. */
   uint32_t length;
 } Element;
 
-/**
- * Constructs a new element.
- *
- * @param position within file
- * @param length   of data
- */
-static Element* Element_new(uint32_t position, uint32_t length) {
-  Element* e = malloc(sizeof(Element));
-  if (CHECKOOM(e)) return NULL;
-  e->position = position;
-  e->length = length;
-  return e;
-}
-
 static void Element_fprintf(Element* e, FILE* fout) {
-  fprintf(fout, "Element:[position = %d, length = %d]",
+  fprintf(fout, "Element:[position = %" PRIu64 ", length = %u]",
           e->position, e->length);
 }
 
+/**
+ * Points *element at storage holding position and length, or sets it to NULL
+ * if position is 0. Never allocates.
+ */
+static void Element_assign(Element** element, Element* storage,
+                           uint64_t position, uint32_t length) {
+  if (position == 0) {
+    *element = NULL;
+    return;
+  }
+  storage->position = position;
+  storage->length = length;
+  *element = storage;
+}
+
 
 // ------------------------------ QueueFile -----------------------------------
 
 
-/** Initial file size in bytes. */
+/** Default initial file size in bytes, see QueueFile_Options.initialLength. */
 #define QueueFile_INITIAL_LENGTH 4096 // one file system block
 
+/** File lengths grown by growthPercent or growthIncrement are rounded to. */
+#define QueueFile_BLOCK_LENGTH 4096
+
 /** Length of header in bytes. */
-#define QueueFile_HEADER_LENGTH 16 // May not be shorter than 16 bytes.
+#define QueueFile_HEADER_LENGTH 64
+
+/** First 4 bytes of a version 2 file ("QFv2"), never a valid v1 length. */
+#define QueueFile_MAGIC 0x51467632
+
+/** Length of the header of version 1 files. */
+#define QueueFile_V1_HEADER_LENGTH 16
+
+/** Header flag of segmented queues, see QueueFile_Options.segmentLength. */
+#define QueueFile_FLAG_SEGMENTED 1
+
+/**
+ * Header flag set while the front of the ring is being copied behind the old
+ * end of the file, see QueueFile_Options.expansionStepBytes.
+ */
+#define QueueFile_FLAG_RELOCATING 2
+
+/**
+ * Header flag set once a compressed element was added, until the queue is
+ * cleared. Element lengths may carry Element_COMPRESSED then.
+ */
+#define QueueFile_FLAG_COMPRESSED 4
+
+/**
+ * Header flag set when a clean close saved the sparse index. Every later
+ * header write clears it, so it tells that the saved index still matches.
+ */
+#define QueueFile_FLAG_SPARSE_SAVED 8
+
+/**
+ * File length of segmented queues. Their ring doesn't wrap, positions go on
+ * growing and are mapped to segments.
+ */
+#define QueueFile_UNBOUNDED_LENGTH UINT64_MAX
+
+/** Default of QueueFile_Options.indexMaxElements, 8MB of index. */
+#define QueueFile_DEFAULT_INDEX_MAX_ELEMENTS (1 << 20)
+
+/** Number of bytes element streams read ahead. */
+#define QueueFile_STREAM_BUFFER_LENGTH 4096
+
+/** Most bytes one shrink step copies, see QueueFile_Options.shrinkPercent. */
+#define QueueFile_SHRINK_COPY_LIMIT (1 << 20)
+
+/**
+ * Bytes the I/O thread copies per step when it expands ahead of adds and
+ * expansionStepBytes is 0, see QueueFile_Options.expandAtPercent.
+ */
+#define QueueFile_EXPAND_AHEAD_STEP_BYTES (1 << 16)
+
+/** Number of bytes QueueFile_forEach reads at once. */
+#define QueueFile_SCAN_WINDOW_LENGTH (64 << 10)
+
+/** Default of QueueFile_Options.compressMinBytes. */
+#define QueueFile_DEFAULT_COMPRESS_MIN_BYTES 64
+
+/** Suffix of the file the sparse index is saved to. */
+#define QueueFile_SPARSE_SUFFIX ".idx"
+
+/** First 4 bytes of a saved sparse index ("QFi1"). */
+#define QueueFile_SPARSE_MAGIC 0x51466931
+
+/**
+ * A saved sparse index is a header of magic, interval, the file length,
+ * element count, first and last position of the queue it was saved for,
+ * sparseOffset and the number of entries, followed by the entries, each a
+ * position and a length.
+ */
+#define QueueFile_SPARSE_HEADER_LENGTH 48
+#define QueueFile_SPARSE_ENTRY_LENGTH 12
+
+struct _QueueFile_ElementStream {
+  QueueFile* qf;
+  /** Position of the next byte not buffered yet. */
+  uint64_t position;
+  /** Number of bytes left to read, including the buffered ones. */
+  uint32_t remaining;
+  /** Next buffered byte, and the number of buffered bytes from there on. */
+  const byte* next;
+  uint32_t buffered;
+  /** Read-ahead buffer, filled by QueueFile_readElementStream. */
+  byte buffer[QueueFile_STREAM_BUFFER_LENGTH];
+};
+
+struct _QueueFile_Snapshot {
+  QueueFile* qf;
+  /** Position of the element being read, or of the next one to read. */
+  uint64_t position;
+  /**
+   * Number of elements left, including the one being read. The snapshot pins
+   * the ring from position onwards as long as this is > 0.
+   */
+  uint32_t remaining;
+  /** Stream handed to the reader, valid while streamActive. */
+  QueueFile_ElementStream stream;
+  bool streamActive;
+  /** Next open snapshot of the same queuefile. */
+  QueueFile_Snapshot* next;
+};
+
+/** Upper bound of bytes the I/O thread combines into one write. */
+#define QueueFile_ASYNC_MAX_BATCH_BYTES (4 << 20)
+
+/** An element queued by QueueFile_addAsync. */
+typedef struct _QueueFile_PendingAdd {
+  /** Copy of the data, as it is stored. */
+  byte* data;
+  uint32_t count;
+  /** True if data was compressed, see QueueFile_compress. */
+  bool compressed;
+  QueueFile_AddCallback callback;
+  void* context;
+  struct _QueueFile_PendingAdd* next;
+} QueueFile_PendingAdd;
+
+/** A memory mapping of the file, see QueueFile_peekView. */
+typedef struct _QueueFile_Mapping {
+  byte* address;
+  uint64_t length;
+  struct _QueueFile_Mapping* next;
+} QueueFile_Mapping;
+
+/**
+ * Copy of the bytes most recently written to the ring, up to the tail, see
+ * QueueFile_Options.tailCacheBytes. The byte d bytes before the tail in ring
+ * order is at data[(next - d) mod capacity] if d <= valid.
+ */
+typedef struct {
+  byte* data;
+  uint32_t capacity;
+  /** Slot the next added byte goes to. */
+  uint32_t next;
+  /** Number of bytes before next which mirror the file. */
+  uint32_t valid;
+  uint64_t hits;
+  uint64_t misses;
+} QueueFile_TailCache;
+
+/**
+ * Front of a wrapped ring that an incremental expansion still copies, see
+ * QueueFile_Options.expansionStepBytes. The length bytes at
+ * QueueFile_HEADER_LENGTH go to the old end of the file, to, and the first
+ * done of them are there already. Positions already refer to the new
+ * location. length is 0 if nothing is pending.
+ */
+typedef struct {
+  uint64_t length;
+  uint64_t done;
+  uint64_t to;
+} QueueFile_Relocation;
+
+/**
+ * Marks an initialized QueueFile_SharedState ("QFS2"). Changed with the
+ * layout, so that control files of older versions are rebuilt.
+ */
+#define QueueFile_SHARED_MAGIC 0x51465332
+
+/** Suffix of the control file used in shared mode. */
+#define QueueFile_SHARED_SUFFIX ".shm"
+
+/**
+ * State shared between processes in shared mode, memory mapped from the
+ * control file. The queue file header stays the authoritative commit record;
+ * this mirrors it so processes see each other's commits without re-reading
+ * the header, and is rebuilt from the header when a process dies mid-update.
+ */
+typedef struct {
+  uint32_t magic;
+  /** Process-shared robust mutex serializing all processes. */
+  pthread_mutex_t mutex;
+  /** Bumped on every published change, waiters sleep on it (futex). */
+  uint32_t generation;
+  uint32_t elementCount;
+  uint64_t fileLength;
+  uint64_t firstPosition;
+  uint64_t lastPosition;
+  uint32_t firstLength;
+  uint32_t lastLength;
+} QueueFile_SharedState;
 
 struct _QueueFile {
   
@@ -100,64 +303,448 @@ struct _QueueFile {
    * data can be copied).
    *
    *   Format:
-   *     Header              (16 bytes)
-   *     Element Ring Buffer (File Length - 16 bytes)
+   *     Header              (64 bytes)
+   *     Element Ring Buffer (File Length - 64 bytes)
    *
-   *   Header:
-   *     File Length            (4 bytes)
-   *     Element Count          (4 bytes)
-   *     First Element Position (4 bytes, =0 if null)
-   *     Last Element Position  (4 bytes, =0 if null)
+   *   Header (version 2):
+   *     Magic                  (4 bytes, "QFv2")
+   *     Flags                  (4 bytes, QueueFile_FLAG_*)
+   *     File Length            (8 bytes)
+   *     Element Count          (8 bytes)
+   *     First Element Position (8 bytes, =0 if null)
+   *     Last Element Position  (8 bytes, =0 if null)
+   *     Segment Length         (4 bytes, =0 unless segmented)
+   *     Relocation Length      (8 bytes, =0 unless relocating)
+   *     Relocated Bytes        (8 bytes, =0 unless relocating)
+   *     Relocation Target      (4 bytes, old file length in 4096 byte
+   *                             blocks, =0 if half the file length)
+   *
+   * Segmented queues keep just the header in this file, their manifest. The
+   * ring is a SegmentLog where position p is stored at offset p - 64.
    *
    *   Element:
-   *     Length (4 bytes)
+   *     Length (4 bytes, top bit set if compressed)
    *     Data   (Length bytes)
+   *
+   * The data of compressed elements starts with the codec id (1 byte) and the
+   * decompressed length (4 bytes), see QueueFile_Options.codec.
+   *
+   * Version 1 files had a 16 byte header of 4 byte file length, element count,
+   * first and last position. They are converted when opened, see
+   * QueueFile_migrate.
    */
   FILE* file;
   
-  /** Cached file length. Always a power of 2. */
-  uint32_t fileLength;
+  /**
+   * Cached file length. A power of 2 unless options.initialLength or the
+   * growth options say otherwise.
+   */
+  uint64_t fileLength;
   
-  /** Number of elements. */
+  /**
+   * Number of elements. The header has room for 64 bits, but the API counts
+   * elements in 32 bits.
+   */
   uint32_t elementCount;
   
-  /** Pointer to first (or eldest) element. */
+  /** Pointer to first (or eldest) element, NULL or &firstStorage. */
   Element* first;
   
-  /** Pointer to last (or newest) element. */
+  /**
+   * Pointer to last (or newest) element. When the queue is drained while a
+   * snapshot still pins data this stays set, so the next add is placed after
+   * the pinned data rather than at the start of the ring.
+   */
   Element* last;
+
+  /**
+   * Storage first and last point to. Kept inline so that adds and removes
+   * don't allocate.
+   */
+  Element firstStorage;
+  Element lastStorage;
+
+  /** Open snapshots, see QueueFile_snapshot. */
+  QueueFile_Snapshot* snapshots;
+
+  /** Read-only mapping of the file views point into, or NULL. */
+  QueueFile_Mapping* mapping;
+
+  /**
+   * Mappings replaced after the file grew. Views of the first element may
+   * still point into them, so they're unmapped once it is removed.
+   */
+  QueueFile_Mapping* retiredMappings;
+
+  /** True while a view of the first element is out, see QueueFile_peekView. */
+  bool viewActive;
+
+  /**
+   * Positions and lengths of the eldest elements, from the first one on. Has
+   * no room for entries unless the queue is indexed. Complete when it holds
+   * elementCount entries, only then are added elements indexed right away;
+   * otherwise entries are added as element headers are read.
+   */
+  ElementIndex index;
+
+  /**
+   * Positions and lengths of every sparseIndexInterval-th element, the first
+   * entry is for the sparseOffset-th eldest element. Complete when it reaches
+   * past the last element, kept complete by adds and removals then.
+   */
+  ElementIndex sparse;
+  uint32_t sparseOffset;
+
+  /** File the sparse index is saved to on close, NULL without one. */
+  char* sparseName;
+
+  /** True if header writes are to set QueueFile_FLAG_SPARSE_SAVED. */
+  bool sparseSaved;
+
+  /** Recently added bytes, capacity 0 unless enabled. */
+  QueueFile_TailCache cache;
+
+  /** Storage of the ring if segmented, else segmentLength is 0. */
+  SegmentLog segments;
+
+  /** Copy left over from the last expansion, if it was incremental. */
+  QueueFile_Relocation relocation;
+
+  /** Elements adds dropped to make room, see QueueFile_FULL_DROP_OLDEST. */
+  QueueFile_DropStats dropped;
+
+  /** True if the header has QueueFile_FLAG_COMPRESSED set. */
+  bool compressed;
+
+  /**
+   * Window of the ring QueueFile_forEach reads into, allocated by the first
+   * call. In use while scanning, nested calls do without.
+   */
+  byte* scanWindow;
+  bool scanning;
   
   /** In-memory buffer. Big enough to hold the header. */
   byte buffer[QueueFile_HEADER_LENGTH];
 
   /** mutex to synchronize method access */
   pthread_mutex_t mutex;
+
+  /** Options the queue was opened with. */
+  QueueFile_Options options;
+
+  /** Shared state when opened in shared mode, else NULL. */
+  QueueFile_SharedState* shared;
+
+  /** Control file, holds a shared flock for as long as the queue is open. */
+  int sharedFd;
+
+  /** Generation of the shared state the fields above reflect. */
+  uint32_t sharedGeneration;
+
+  /**
+   * Nesting depth of QueueFile_lock. In shared mode the shared mutex is held
+   * while > 0.
+   */
+  uint32_t lockDepth;
+
+  /**
+   * Bumped on every add and removal when not shared. QueueFile_await and adds
+   * waiting for room sleep on it.
+   */
+  uint32_t localGeneration;
+
+  /** Number of elements added through this handle, see QueueFile_addAsync. */
+  uint64_t addSequence;
+
+  /** Guards the pending adds and the I/O thread state below. */
+  pthread_mutex_t asyncMutex;
+
+  /**
+   * Signals the I/O thread that adds are pending, the file should be expanded
+   * or it should stop.
+   */
+  pthread_cond_t asyncCondition;
+
+  /** FIFO of adds waiting for the I/O thread. */
+  QueueFile_PendingAdd* pendingHead;
+  QueueFile_PendingAdd* pendingTail;
+
+  /** I/O thread, started by the first QueueFile_addAsync or expansion. */
+  pthread_t asyncThread;
+  bool asyncStarted;
+  bool asyncStopping;
+
+  /** Set until the I/O thread expanded the file, see expandAtPercent. */
+  bool expansionRequested;
 };
 
-static bool initialize(char* filename);
+static void QueueFile_setFirst(QueueFile* qf, uint64_t position,
+                               uint32_t length) {
+  Element_assign(&qf->first, &qf->firstStorage, position, length);
+}
+
+static void QueueFile_setLast(QueueFile* qf, uint64_t position,
+                              uint32_t length) {
+  Element_assign(&qf->last, &qf->lastStorage, position, length);
+}
+
+char* makeTempFilename(const QueueFile_Allocator* allocator,
+                       const char* name, int maxLen);
+static char* makeFilenameWithSuffix(const QueueFile_Allocator* allocator,
+                                    const char* filename, const char* suffix,
+                                    int maxLen);
+
+static bool initialize(QueueFile* qf, char* filename);
+static bool QueueFile_migrate(QueueFile* qf, char* filename);
 static bool QueueFile_readHeader(QueueFile* qf);
+static bool QueueFile_finishRelocation(QueueFile* qf);
+static bool QueueFile_trimSegments(QueueFile* qf, bool recover);
+static bool QueueFile_buildIndex(QueueFile* qf);
+static bool QueueFile_loadSparseIndex(QueueFile* qf);
+static bool QueueFile_buildSparseIndex(QueueFile* qf);
+static void QueueFile_saveSparseIndex(QueueFile* qf);
+static bool QueueFile_openShared(QueueFile* qf, const char* filename,
+                                 bool* firstUser);
+static bool QueueFile_attachShared(QueueFile* qf, bool firstUser);
+static void QueueFile_lock(QueueFile* qf);
+static void QueueFile_unlock(QueueFile* qf);
+static void QueueFile_futexWait(uint32_t* word, uint32_t expected,
+                                uint32_t timeoutMillis, bool shared);
+static void QueueFile_futexWake(uint32_t* word, bool shared);
+static uint64_t QueueFile_nowMillis();
+
+// see description in queuefile.h.
+void QueueFile_initOptions(QueueFile_Options* options) {
+  if (NULLARG(options)) return;
+  memset(options, 0, sizeof(QueueFile_Options));
+}
+
+static void* QueueFile_defaultAlloc(void* context, size_t size) {
+  (void) context;
+  return malloc(size);
+}
+
+static void QueueFile_defaultFree(void* context, void* pointer) {
+  (void) context;
+  free(pointer);
+}
+
+/** Allocates through the allocator of the queue, see QueueFile_Allocator. */
+static void* QueueFile_allocate(QueueFile* qf, size_t size) {
+  return qf->options.allocator.alloc(qf->options.allocator.context, size);
+}
+
+/** Frees memory from QueueFile_allocate, pointer may be NULL. */
+static void QueueFile_deallocate(QueueFile* qf, void* pointer) {
+  if (pointer != NULL) {
+    qf->options.allocator.free(qf->options.allocator.context, pointer);
+  }
+}
+
+/** Frees the QueueFile struct itself. */
+static void QueueFile_deallocateSelf(QueueFile* qf) {
+  QueueFile_Allocator allocator = qf->options.allocator;
+  allocator.free(allocator.context, qf);
+}
 
 // see description in queuefile.h.
 QueueFile* QueueFile_new(char* filename) {
+  return QueueFile_newWithOptions(filename, NULL);
+}
+
+/** Undoes a partially successful QueueFile_newWithOptions. */
+static QueueFile* QueueFile_abortNew(QueueFile* qf) {
+  if (qf->file != NULL) fclose(qf->file);
+  SegmentLog_free(&qf->segments);
+  ElementIndex_free(&qf->index);
+  ElementIndex_free(&qf->sparse);
+  QueueFile_deallocate(qf, qf->sparseName);
+  QueueFile_deallocate(qf, qf->cache.data);
+  QueueFile_deallocate(qf, qf->scanWindow);
+  if (qf->shared != NULL) munmap(qf->shared, sizeof(QueueFile_SharedState));
+  if (qf->sharedFd >= 0) close(qf->sharedFd); // also releases the flock.
+  QueueFile_deallocateSelf(qf);
+  return NULL;
+}
+
+// see description in queuefile.h.
+QueueFile* QueueFile_newWithOptions(char* filename,
+                                    const QueueFile_Options* options) {
   if (NULLARG(filename)) return NULL;
-  QueueFile* qf = malloc(sizeof(QueueFile));
+  QueueFile_Allocator allocator = {
+    QueueFile_defaultAlloc, QueueFile_defaultFree, NULL
+  };
+  if (options != NULL && options->allocator.alloc != NULL) {
+    if (options->allocator.free == NULL) {
+      LOG(LWARN, "Allocator needs both alloc and free");
+      return NULL;
+    }
+    allocator = options->allocator;
+  }
+  QueueFile* qf = allocator.alloc(allocator.context, sizeof(QueueFile));
   if (CHECKOOM(qf)) return NULL;
   memset(qf, 0, sizeof(QueueFile)); // making sure pointers & counters are null!
-  
-  qf->file = fopen(filename, "r+");
-  if (qf->file == NULL) {
-    if (initialize(filename)) {
-      qf->file = fopen(filename, "r+");
+  qf->sharedFd = -1;
+  if (options != NULL) {
+    qf->options = *options;
+  } else {
+    QueueFile_initOptions(&qf->options);
+  }
+  qf->options.allocator = allocator;
+  if (qf->options.shared &&
+      (qf->options.indexed || qf->options.tailCacheBytes > 0)) {
+    // Other processes move and add elements without this one noticing.
+    LOG(LWARN, "Queues in shared mode can't be indexed or cached");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.shared && qf->options.segmentLength > 0) {
+    LOG(LWARN, "Queues in shared mode can't be segmented");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.shared && qf->options.expansionStepBytes > 0) {
+    // Other processes would read the front before it is copied.
+    LOG(LWARN, "Queues in shared mode can't expand incrementally");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.shared && qf->options.expandAtPercent > 0) {
+    LOG(LWARN, "Queues in shared mode can't expand in the background");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.expandAtPercent >= 100 ||
+      (qf->options.expandAtPercent > 0 &&
+       qf->options.expandAtPercent <= 2 * qf->options.shrinkPercent)) {
+    // Doubling halves the usage, which must not make the file shrink again.
+    LOG(LWARN, "expandAtPercent must be below 100 and above twice "
+        "shrinkPercent: %u", qf->options.expandAtPercent);
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.codec != NULL &&
+      (qf->options.codec->id == 0 || qf->options.codec->compress == NULL ||
+       qf->options.codec->decompress == NULL)) {
+    LOG(LWARN, "Codecs need an id and both functions");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.shared && qf->options.sparseIndexInterval > 0) {
+    LOG(LWARN, "Queues in shared mode can't have a sparse index");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.shared && qf->options.codec != NULL) {
+    // Other processes wouldn't know the queue holds compressed elements.
+    LOG(LWARN, "Queues in shared mode can't be compressed");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.compressMinBytes == 0) {
+    qf->options.compressMinBytes = QueueFile_DEFAULT_COMPRESS_MIN_BYTES;
+  }
+  if (qf->options.shrinkPercent >= 50) {
+    // Halving would leave the file (nearly) full and expanding again.
+    LOG(LWARN, "shrinkPercent must be below 50: %u", qf->options.shrinkPercent);
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.initialLength == 0) {
+    qf->options.initialLength = QueueFile_INITIAL_LENGTH;
+  }
+  if (qf->options.initialLength <= QueueFile_HEADER_LENGTH ||
+      (qf->options.maxFileLength > 0 &&
+       qf->options.maxFileLength < qf->options.initialLength)) {
+    LOG(LWARN, "initialLength must exceed the header and not maxFileLength");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.growthPercent > 0 && qf->options.growthIncrement > 0) {
+    LOG(LWARN, "Set either growthPercent or growthIncrement");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.segmentLength > 0 && qf->options.maxFileLength > 0) {
+    // Segmented queues have no file length to bound.
+    LOG(LWARN, "Segmented queues can't have a maxFileLength");
+    QueueFile_deallocateSelf(qf);
+    return NULL;
+  }
+  if (qf->options.indexed && qf->options.indexMaxElements == 0) {
+    qf->options.indexMaxElements = QueueFile_DEFAULT_INDEX_MAX_ELEMENTS;
+  }
+  ElementIndex_init(&qf->index, &qf->options.allocator,
+                    qf->options.indexed ? qf->options.indexMaxElements : 0);
+  ElementIndex_init(&qf->sparse, &qf->options.allocator,
+                    qf->options.sparseIndexInterval > 0 ? UINT32_MAX : 0);
+  if (qf->options.tailCacheBytes > 0) {
+    qf->cache.data = QueueFile_allocate(qf,
+                                        (size_t) qf->options.tailCacheBytes);
+    if (CHECKOOM(qf->cache.data)) return QueueFile_abortNew(qf);
+    qf->cache.capacity = qf->options.tailCacheBytes;
+  }
+
+  // In shared mode only the first process to open the queue may create it.
+  bool mayCreate = true;
+  if (qf->options.shared &&
+      !QueueFile_openShared(qf, filename, &mayCreate)) {
+    return QueueFile_abortNew(qf);
+  }
+
+  // A segmented queue is a directory, its header is kept in the manifest.
+  char* headerName = filename;
+  if (qf->options.segmentLength > 0) {
+    if (mkdir(filename, 0755) != 0 && errno != EEXIST) {
+      LOG(LWARN, "Error creating queue directory %s", filename);
+      return QueueFile_abortNew(qf);
     }
-    if (qf->file == NULL) {
-      free(qf);
-      return NULL;
+    if (!SegmentLog_init(&qf->segments, &qf->options.allocator, filename,
+                         qf->options.segmentLength)) {
+      return QueueFile_abortNew(qf);
     }
+    headerName = makeFilenameWithSuffix(&qf->options.allocator, filename,
+                                        "/manifest", MAX_FILENAME_LEN);
+    if (CHECKOOM(headerName)) return QueueFile_abortNew(qf);
   }
-  if (!QueueFile_readHeader(qf)) {
-    fclose(qf->file);
-    free(qf);
-    return NULL;
+
+  if (qf->options.sparseIndexInterval > 0) {
+    qf->sparseName = makeFilenameWithSuffix(&qf->options.allocator,
+                                            headerName,
+                                            QueueFile_SPARSE_SUFFIX,
+                                            MAX_FILENAME_LEN);
+    if (qf->sparseName == NULL) {
+      if (headerName != filename) QueueFile_deallocate(qf, headerName);
+      LOG(LWARN, "Filename too long or out of memory: %s", filename);
+      return QueueFile_abortNew(qf);
+    }
+  }
+
+  qf->file = fopen(headerName, "r+");
+  if (qf->file == NULL && mayCreate && initialize(qf, headerName)) {
+    qf->file = fopen(headerName, "r+");
+  }
+  // Only the first process to open a shared queue may rewrite the file.
+  bool opened = qf->file != NULL &&
+                ((qf->options.shared && !mayCreate) ||
+                 QueueFile_migrate(qf, headerName));
+  if (headerName != filename) QueueFile_deallocate(qf, headerName);
+  if (!opened) {
+    return QueueFile_abortNew(qf);
+  }
+  // Other processes write to the file, stdio must not serve stale buffers.
+  if (qf->options.shared && setvbuf(qf->file, NULL, _IONBF, 0) != 0) {
+    return QueueFile_abortNew(qf);
+  }
+  // In shared mode the header is read under the shared lock, see below.
+  if (!qf->options.shared &&
+      (!QueueFile_readHeader(qf) || !QueueFile_trimSegments(qf, true) ||
+       !QueueFile_loadSparseIndex(qf) || !QueueFile_buildIndex(qf) ||
+       !QueueFile_buildSparseIndex(qf) ||
+       // Left over from a crash, queues opened to expand at once finish it.
+       (qf->options.expansionStepBytes == 0 &&
+        !QueueFile_finishRelocation(qf)))) {
+    return QueueFile_abortNew(qf);
   }
 
   // TODO(jochen): consider NP mutex options, audit code for re-entrancy and
@@ -168,27 +755,57 @@ QueueFile* QueueFile_new(char* filename) {
   pthread_mutexattr_init(&mta);
   pthread_mutexattr_settype(&mta, PTHREAD_MUTEX_RECURSIVE);
   pthread_mutex_init(&qf->mutex, &mta);
+  pthread_mutex_init(&qf->asyncMutex, NULL);
+  pthread_cond_init(&qf->asyncCondition, NULL);
+
+  if (qf->options.shared && !QueueFile_attachShared(qf, mayCreate)) {
+    pthread_mutex_destroy(&qf->mutex);
+    pthread_mutex_destroy(&qf->asyncMutex);
+    pthread_cond_destroy(&qf->asyncCondition);
+    return QueueFile_abortNew(qf);
+  }
 
   return qf;
 }
 
+static void QueueFile_stopAsync(QueueFile* qf);
+static void QueueFile_endView(QueueFile* qf);
+
 // see description in queuefile.h.
 bool QueueFile_closeAndFree(QueueFile* qf) {
+  // Completes all pending adds.
+  QueueFile_stopAsync(qf);
+
   pthread_mutex_lock(&qf->mutex);
+  QueueFile_saveSparseIndex(qf);
   bool success = !fclose(qf->file);
   if (success) {
     if (qf != NULL) {
-      if (qf->first != NULL) {
-        free(qf->first);
-      }
-      if (qf->last != NULL && qf->last != qf->first) free(qf->last);
       qf->first = qf->last = NULL;
+      QueueFile_endView(qf);
+      if (qf->mapping != NULL) {
+        munmap(qf->mapping->address, qf->mapping->length);
+        QueueFile_deallocate(qf, qf->mapping);
+      }
+      ElementIndex_free(&qf->index);
+      ElementIndex_free(&qf->sparse);
+      QueueFile_deallocate(qf, qf->sparseName);
+      SegmentLog_free(&qf->segments);
+      QueueFile_deallocate(qf, qf->cache.data);
+      QueueFile_deallocate(qf, qf->scanWindow);
+      if (qf->shared != NULL) {
+        munmap(qf->shared, sizeof(QueueFile_SharedState));
+        close(qf->sharedFd);
+      }
     }
   }
   pthread_mutex_unlock(&qf->mutex);
 
-  if (success)
-    free(qf);
+  if (success) {
+    pthread_mutex_destroy(&qf->asyncMutex);
+    pthread_cond_destroy(&qf->asyncCondition);
+    QueueFile_deallocateSelf(qf);
+  }
 
   return success;
 }
@@ -203,49 +820,136 @@ static void writeInt(byte* buffer, uint32_t offset, uint32_t value) {
   buffer[offset + 3] = (byte) value;
 }
 
+/** Stores unsigned long in buffer (big endian). */
+static void writeLong(byte* buffer, uint32_t offset, uint64_t value) {
+  writeInt(buffer, offset, (uint32_t) (value >> 32));
+  writeInt(buffer, offset + 4, (uint32_t) value);
+}
+
 /**
- * Stores unsigned ints into a buffer, in the order of parameters passed.
+ * Stores a version 2 header into a buffer of QueueFile_HEADER_LENGTH bytes.
+ * @param segmentLength 0 unless the queue is segmented.
  */
-static void writeInts(byte* buffer, uint32_t v1, uint32_t v2, uint32_t v3,
-                      uint32_t v4) {
-  writeInt(buffer, 0, v1);
-  writeInt(buffer, 4, v2);
-  writeInt(buffer, 8, v3);
-  writeInt(buffer, 12, v4);
+static void writeHeaderFields(byte* buffer, uint64_t fileLength,
+                              uint64_t elementCount, uint64_t firstPosition,
+                              uint64_t lastPosition, uint32_t segmentLength) {
+  memset(buffer, 0, QueueFile_HEADER_LENGTH);
+  writeInt(buffer, 0, QueueFile_MAGIC);
+  writeInt(buffer, 4, segmentLength > 0 ? QueueFile_FLAG_SEGMENTED : 0);
+  writeLong(buffer, 8, fileLength);
+  writeLong(buffer, 16, elementCount);
+  writeLong(buffer, 24, firstPosition);
+  writeLong(buffer, 32, lastPosition);
+  writeInt(buffer, 40, segmentLength);
 }
 
 /** Reads an unsigned int from a buffer (assumes big endian). */
 static uint32_t readInt(byte* buffer, uint32_t offset) {
-  return ((buffer[offset] & 0xff) << 24)
-         + ((buffer[offset + 1] & 0xff) << 16)
-         + ((buffer[offset + 2] & 0xff) << 8)
-         + (buffer[offset + 3] & 0xff);
+  return ((uint32_t) (buffer[offset] & 0xff) << 24)
+         + ((uint32_t) (buffer[offset + 1] & 0xff) << 16)
+         + ((uint32_t) (buffer[offset + 2] & 0xff) << 8)
+         + (uint32_t) (buffer[offset + 3] & 0xff);
+}
+
+/** Reads an unsigned long from a buffer (assumes big endian). */
+static uint64_t readLong(byte* buffer, uint32_t offset) {
+  return ((uint64_t) readInt(buffer, offset) << 32) |
+         readInt(buffer, offset + 4);
 }
 
 
 
-static Element* QueueFile_readElement(QueueFile* qf, uint32_t position);
+static bool QueueFile_readElement(QueueFile* qf, uint64_t position,
+                                  Element* element);
+static bool QueueFile_ringRead(QueueFile* qf, uint64_t position, byte* buffer,
+                               uint32_t offset, uint32_t count);
+
+/**
+ * Returns the number of bytes an element takes in the ring, given the length
+ * in its header.
+ */
+static uint32_t QueueFile_storedLength(const QueueFile* qf, uint32_t length) {
+  return qf->compressed ? length & ~Element_COMPRESSED : length;
+}
 
 /** Reads the header. */
 static bool QueueFile_readHeader(QueueFile* qf) {
   if (!FileIo_seek(qf->file, 0) ||
-      !FileIo_read(qf->file, qf->buffer, 0, (uint32_t) sizeof(qf->buffer))) {
+      !FileIo_read(qf->file, qf->buffer, 0, QueueFile_HEADER_LENGTH)) {
+    return false;
+  }
+  if (readInt(qf->buffer, 0) != QueueFile_MAGIC) {
+    LOG(LWARN, "Not a version 2 queue file");
+    return false;
+  }
+
+  uint32_t flags = readInt(qf->buffer, 4);
+  bool segmented = (flags & QueueFile_FLAG_SEGMENTED) != 0;
+  if (segmented != (qf->options.segmentLength > 0)) {
+    LOG(LWARN, segmented ? "Queue is segmented, open it with a segmentLength" :
+                           "Queue is a ring file, not segmented");
     return false;
   }
 
-  qf->fileLength = readInt(qf->buffer, 0);
-  uint32_t actualLength = (uint32_t) FileIo_getLength(qf->file);
-  if (qf->fileLength > actualLength) {
-    LOG(LWARN, "File is truncated. Expected length: %d, Actual length: %d",
-        qf->fileLength,  actualLength);
+  qf->fileLength = readLong(qf->buffer, 8);
+  int64_t actualLength = FileIo_getLength(qf->file);
+  if (segmented) {
+    qf->segments.segmentLength = readInt(qf->buffer, 40);
+    if (qf->segments.segmentLength == 0 ||
+        qf->fileLength != QueueFile_UNBOUNDED_LENGTH) {
+      LOG(LWARN, "Corrupt manifest of segmented queue");
+      return false;
+    }
+  } else if (actualLength < 0 || qf->fileLength > (uint64_t) actualLength) {
+    LOG(LWARN, "File is truncated. Expected length: %" PRIu64
+        ", Actual length: %" PRId64, qf->fileLength, actualLength);
+    return false;
+  }
+
+  // Elements are read from where the copy stands, so this comes first.
+  memset(&qf->relocation, 0, sizeof(QueueFile_Relocation));
+  if ((flags & QueueFile_FLAG_RELOCATING) != 0) {
+    if (qf->options.shared) {
+      LOG(LWARN, "Queue is being expanded, open it without shared first");
+      return false;
+    }
+    qf->relocation.length = readLong(qf->buffer, 44);
+    qf->relocation.done = readLong(qf->buffer, 52);
+    uint32_t target = readInt(qf->buffer, 60);
+    qf->relocation.to = target == 0 ? qf->fileLength >> 1 :
+                        (uint64_t) target * QueueFile_BLOCK_LENGTH;
+    if (segmented || qf->relocation.done >= qf->relocation.length ||
+        QueueFile_HEADER_LENGTH + qf->relocation.length > qf->relocation.to ||
+        qf->relocation.to + qf->relocation.length > qf->fileLength) {
+      LOG(LWARN, "Corrupt relocation in header");
+      memset(&qf->relocation, 0, sizeof(QueueFile_Relocation));
+      return false;
+    }
+  }
+
+  qf->sparseSaved = (flags & QueueFile_FLAG_SPARSE_SAVED) != 0;
+  qf->compressed = (flags & QueueFile_FLAG_COMPRESSED) != 0;
+  if (qf->compressed && qf->options.shared) {
+    LOG(LWARN, "Queue holds compressed elements, open it without shared");
     return false;
   }
 
-  qf->elementCount = readInt(qf->buffer, 4);
-  uint32_t firstOffset = readInt(qf->buffer, 8);
-  uint32_t lastOffset = readInt(qf->buffer, 12);
-  return freeAndAssign(&qf->first, QueueFile_readElement(qf, firstOffset)) &&
-         freeAndAssign(&qf->last, QueueFile_readElement(qf, lastOffset));
+  uint64_t elementCount = readLong(qf->buffer, 16);
+  if (elementCount > UINT32_MAX) {
+    LOG(LWARN, "Too many elements: %" PRIu64, elementCount);
+    return false;
+  }
+  qf->elementCount = (uint32_t) elementCount;
+  uint64_t firstOffset = readLong(qf->buffer, 24);
+  uint64_t lastOffset = readLong(qf->buffer, 32);
+  Element first, last;
+  if (!QueueFile_readElement(qf, firstOffset, &first) ||
+      !QueueFile_readElement(qf, lastOffset, &last)) {
+    return false;
+  }
+  QueueFile_setFirst(qf, first.position, first.length);
+  QueueFile_setLast(qf, last.position, last.length);
+  return true;
 }
 
 /**
@@ -253,41 +957,58 @@ static bool QueueFile_readHeader(QueueFile* qf) {
  * class member fields should not have changed yet. This only updates the
  * state in the file. It's up to the caller to update the class member
  * variables *after* this call succeeds. Assumes segment writes are atomic in
- * the underlying file system.
+ * the underlying file system. The progress of a relocation is taken from
+ * qf->relocation, the other flags from qf->compressed and qf->sparseSaved.
  */
-static bool QueueFile_writeHeader(QueueFile* qf, uint32_t fileLength,
-                                  uint32_t elementCount, uint32_t firstPosition,
-                                  uint32_t lastPosition) {
-  writeInts(qf->buffer, fileLength, elementCount, firstPosition, lastPosition);
+static bool QueueFile_writeHeader(QueueFile* qf, uint64_t fileLength,
+                                  uint32_t elementCount, uint64_t firstPosition,
+                                  uint64_t lastPosition) {
+  writeHeaderFields(qf->buffer, fileLength, elementCount, firstPosition,
+                    lastPosition, qf->segments.segmentLength);
+  if (qf->relocation.length > 0) {
+    writeInt(qf->buffer, 4, readInt(qf->buffer, 4) | QueueFile_FLAG_RELOCATING);
+    writeLong(qf->buffer, 44, qf->relocation.length);
+    writeLong(qf->buffer, 52, qf->relocation.done);
+    if (qf->relocation.to != fileLength >> 1) {
+      writeInt(qf->buffer, 60, (uint32_t) (qf->relocation.to /
+                                           QueueFile_BLOCK_LENGTH));
+    }
+  }
+  if (qf->compressed) {
+    writeInt(qf->buffer, 4, readInt(qf->buffer, 4) | QueueFile_FLAG_COMPRESSED);
+  }
+  if (qf->sparseSaved) {
+    writeInt(qf->buffer, 4,
+             readInt(qf->buffer, 4) | QueueFile_FLAG_SPARSE_SAVED);
+  }
   return FileIo_seek(qf->file, 0) &&
          FileIo_write(qf->file, qf->buffer, 0, QueueFile_HEADER_LENGTH);
 }
 
 
 /** 
- * Returns the Element for the given offset. CALLER MUST FREE MEMORY.
+ * Reads the Element at the given offset into *element. Position 0 yields an
+ * element with position and length 0.
+ * @return false if an error occurred.
  */
-static Element* QueueFile_readElement(QueueFile* qf, uint32_t position) {
-  if (position == 0 ||
-      !FileIo_seek(qf->file, position) ||
-      !FileIo_read(qf->file, qf->buffer, 0, (uint32_t) sizeof(uint32_t))) {
-    return NULL;
+static bool QueueFile_readElement(QueueFile* qf, uint64_t position,
+                                  Element* element) {
+  element->position = position;
+  element->length = 0;
+  if (position == 0) return true;
+  // The length may straddle the end of the ring.
+  if (!QueueFile_ringRead(qf, position, qf->buffer, 0, Element_HEADER_LENGTH)) {
+    return false;
   }
-  uint32_t length = readInt(qf->buffer, 0);
-  return Element_new(position, length);
+  element->length = QueueFile_storedLength(qf, readInt(qf->buffer, 0));
+  return true;
 }
 
 
-char* makeTempFilename(const char* name, int maxLen);
-
 /** Atomically initializes a new file. */
-static bool initialize(char* filename) {
-  if (QueueFile_HEADER_LENGTH < 16) {
-    LOG(LFATAL, "Configuration error, header length must be >= 16 bytes");
-    return false;
-  }
-
-  char* tempname = makeTempFilename(filename, MAX_FILENAME_LEN);
+static bool initialize(QueueFile* qf, char* filename) {
+  char* tempname = makeTempFilename(&qf->options.allocator, filename,
+                                    MAX_FILENAME_LEN);
   if (tempname == NULL) {
     LOG(LWARN, "Filename too long or out of memory: %s", filename);
     return false;
@@ -295,16 +1016,21 @@ static bool initialize(char* filename) {
 
   FILE* tempfile = fopen(tempname, "w+");
   if (tempfile == NULL) {
-    free(tempname);
+    QueueFile_deallocate(qf, tempname);
     return false;
   }
   
   bool success = false;
+  // A manifest is just the header, the elements go to segments.
+  bool segmented = qf->segments.segmentLength > 0;
   // TODO(jochen): if truncate in setLength does not work for target platform, consider
   //  appending 0s using FileIo_writeZeros.
-  if (FileIo_setLength(tempfile, QueueFile_INITIAL_LENGTH)) {
+  if (FileIo_setLength(tempfile, segmented ? QueueFile_HEADER_LENGTH :
+                                             qf->options.initialLength)) {
     byte headerBuffer[QueueFile_HEADER_LENGTH];
-    writeInts(headerBuffer, QueueFile_INITIAL_LENGTH, 0, 0, 0);
+    writeHeaderFields(headerBuffer, segmented ? QueueFile_UNBOUNDED_LENGTH :
+                                                qf->options.initialLength,
+                      0, 0, 0, qf->segments.segmentLength);
     success = FileIo_write(tempfile, headerBuffer, 0, QueueFile_HEADER_LENGTH);
   }
 
@@ -314,14 +1040,491 @@ static bool initialize(char* filename) {
     LOG(LFATAL, "Error initializing temporary file %s", tempname);
     remove(tempname);
   }
-  free(tempname);
+  QueueFile_deallocate(qf, tempname);
   return success;
 }
 
-/** Wraps the position if it exceeds the end of the file. */
-static uint32_t QueueFile_wrapPosition(const QueueFile* qf, uint32_t position) {
-  return position < qf->fileLength ?
-         position : QueueFile_HEADER_LENGTH + position - qf->fileLength;
+/**
+ * Reads count bytes of the ring of a version 1 file, starting at position and
+ * wrapping around its end.
+ */
+static bool QueueFile_readV1Ring(FILE* file, uint64_t fileLength,
+                                 uint64_t position, byte* buffer,
+                                 uint32_t count) {
+  uint32_t beforeEof = fileLength - position < count ?
+                       (uint32_t) (fileLength - position) : count;
+  return FileIo_seek(file, position) &&
+         FileIo_read(file, buffer, 0, beforeEof) &&
+         (beforeEof == count ||
+          (FileIo_seek(file, QueueFile_V1_HEADER_LENGTH) &&
+           FileIo_read(file, buffer, beforeEof, count - beforeEof)));
+}
+
+/**
+ * Converts a version 1 file to the current format, files already in it are
+ * left alone. The live bytes are copied behind a version 2 header into a new
+ * file, which then replaces the original atomically, so a crash leaves either
+ * of them. The ring is unwrapped on the way and doubled if the longer header
+ * doesn't leave room for its contents.
+ */
+static bool QueueFile_migrate(QueueFile* qf, char* filename) {
+  byte header[QueueFile_V1_HEADER_LENGTH];
+  int64_t actualLength = FileIo_getLength(qf->file);
+  if (actualLength < QueueFile_V1_HEADER_LENGTH || !FileIo_seek(qf->file, 0) ||
+      !FileIo_read(qf->file, header, 0, QueueFile_V1_HEADER_LENGTH)) {
+    return false;
+  }
+  if (readInt(header, 0) == QueueFile_MAGIC) return true;
+
+  uint64_t oldLength = readInt(header, 0);
+  uint32_t elementCount = readInt(header, 4);
+  uint64_t first = readInt(header, 8);
+  uint64_t last = readInt(header, 12);
+  if (oldLength <= QueueFile_V1_HEADER_LENGTH ||
+      oldLength > (uint64_t) actualLength ||
+      (elementCount > 0 &&
+       (first < QueueFile_V1_HEADER_LENGTH || first >= oldLength ||
+        last < QueueFile_V1_HEADER_LENGTH || last >= oldLength))) {
+    LOG(LWARN, "Not a queue file or corrupt: %s", filename);
+    return false;
+  }
+
+  // Ring bytes from the first element to the end of the last one.
+  uint64_t distance = 0;
+  uint64_t used = 0;
+  if (elementCount > 0) {
+    byte lengthBuffer[Element_HEADER_LENGTH];
+    if (!QueueFile_readV1Ring(qf->file, oldLength, last, lengthBuffer,
+                              Element_HEADER_LENGTH)) {
+      return false;
+    }
+    distance = last >= first ? last - first :
+               last - QueueFile_V1_HEADER_LENGTH + oldLength - first;
+    used = distance + Element_HEADER_LENGTH + readInt(lengthBuffer, 0);
+    if (used > oldLength - QueueFile_V1_HEADER_LENGTH) {
+      LOG(LWARN, "Corrupt queue file: %s", filename);
+      return false;
+    }
+  }
+  uint64_t newLength = oldLength;
+  while (used > newLength - QueueFile_HEADER_LENGTH) newLength <<= 1;
+
+  char* tempname = makeTempFilename(&qf->options.allocator, filename,
+                                    MAX_FILENAME_LEN);
+  if (tempname == NULL) {
+    LOG(LWARN, "Filename too long or out of memory: %s", filename);
+    return false;
+  }
+  FILE* tempfile = fopen(tempname, "w+");
+  if (tempfile == NULL) {
+    QueueFile_deallocate(qf, tempname);
+    return false;
+  }
+
+  bool success = FileIo_setLength(tempfile, newLength) &&
+                 FileIo_seek(tempfile, QueueFile_HEADER_LENGTH);
+  byte copyBuffer[4096];
+  uint64_t position = first;
+  uint64_t left = used;
+  while (success && left > 0) {
+    uint32_t count = left < sizeof(copyBuffer) ?
+                     (uint32_t) left : (uint32_t) sizeof(copyBuffer);
+    success = QueueFile_readV1Ring(qf->file, oldLength, position, copyBuffer,
+                                   count) &&
+              fwrite(copyBuffer, 1, count, tempfile) == count;
+    position += count;
+    if (position >= oldLength) {
+      position += QueueFile_V1_HEADER_LENGTH - oldLength;
+    }
+    left -= count;
+  }
+  if (success) {
+    // Flushes and syncs the elements along with the header.
+    byte newHeader[QueueFile_HEADER_LENGTH];
+    writeHeaderFields(newHeader, newLength, elementCount,
+                      elementCount > 0 ? QueueFile_HEADER_LENGTH : 0,
+                      elementCount > 0 ? QueueFile_HEADER_LENGTH + distance : 0,
+                      0);
+    success = FileIo_seek(tempfile, 0) &&
+              FileIo_write(tempfile, newHeader, 0, QueueFile_HEADER_LENGTH);
+  }
+  fclose(tempfile);
+  success = success && rename(tempname, filename) == 0;
+  if (!success) {
+    LOG(LWARN, "Error converting %s to version 2", filename);
+    remove(tempname);
+  }
+  QueueFile_deallocate(qf, tempname);
+  if (!success) return false;
+
+  LOG(LINFO, "Converted %s to version 2", filename);
+  fclose(qf->file);
+  qf->file = fopen(filename, "r+");
+  return qf->file != NULL;
+}
+
+/** Wraps the position if it exceeds the end of the file. */
+static uint64_t QueueFile_wrapPosition(const QueueFile* qf, uint64_t position) {
+  return position < qf->fileLength ?
+         position : QueueFile_HEADER_LENGTH + position - qf->fileLength;
+}
+
+/** Returns the position the next element will be written to. */
+static uint64_t QueueFile_tailPosition(const QueueFile* qf) {
+  if (qf->last == NULL) return QueueFile_HEADER_LENGTH;
+  return QueueFile_wrapPosition(qf, qf->last->position +
+                                Element_HEADER_LENGTH + qf->last->length);
+}
+
+/** Number of ring bytes from position up to the start of the last element. */
+static uint64_t QueueFile_distanceToLast(const QueueFile* qf,
+                                         uint64_t position) {
+  return qf->last->position >= position ?
+         qf->last->position - position :
+         qf->last->position - QueueFile_HEADER_LENGTH +
+         qf->fileLength - position;
+}
+
+/**
+ * Finds the eldest position still in use, that is the first element or the
+ * data pinned by an open snapshot, whichever comes first in the ring.
+ * @return false if nothing is in use.
+ */
+static bool QueueFile_oldestPosition(const QueueFile* qf, uint64_t* position) {
+  bool found = false;
+  uint64_t oldestDistance = 0;
+  if (qf->elementCount > 0) {
+    *position = qf->first->position;
+    oldestDistance = QueueFile_distanceToLast(qf, *position);
+    found = true;
+  }
+  QueueFile_Snapshot* snapshot;
+  for (snapshot = qf->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+    if (snapshot->remaining == 0) continue;
+    uint64_t distance = QueueFile_distanceToLast(qf, snapshot->position);
+    if (!found || distance > oldestDistance) {
+      *position = snapshot->position;
+      oldestDistance = distance;
+      found = true;
+    }
+  }
+  return found;
+}
+
+/** Returns true if an open snapshot still has elements left to read. */
+static bool QueueFile_isPinned(const QueueFile* qf) {
+  QueueFile_Snapshot* snapshot;
+  for (snapshot = qf->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+    if (snapshot->remaining > 0) return true;
+  }
+  return false;
+}
+
+/** Updates the position of element if it lies in [from, from + length). */
+static void QueueFile_relocate(Element* element, uint64_t from,
+                               uint64_t length, uint64_t to) {
+  if (element->position >= from && element->position < from + length) {
+    element->position = element->position - from + to;
+  }
+}
+
+/**
+ * Called after length bytes at from were copied to to and the new location
+ * was committed; updates the positions held by open snapshots.
+ */
+static void QueueFile_relocated(QueueFile* qf, uint64_t from, uint64_t length,
+                                uint64_t to) {
+  QueueFile_Snapshot* snapshot;
+  for (snapshot = qf->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+    if (snapshot->remaining > 0 && snapshot->position >= from &&
+        snapshot->position < from + length) {
+      snapshot->position = snapshot->position - from + to;
+    }
+    if (snapshot->streamActive && snapshot->stream.position >= from &&
+        snapshot->stream.position < from + length) {
+      snapshot->stream.position = snapshot->stream.position - from + to;
+    }
+  }
+  ElementIndex_relocate(&qf->index, from, length, to);
+  ElementIndex_relocate(&qf->sparse, from, length, to);
+}
+
+/**
+ * Deletes the segments of a segmented queue that neither elements nor
+ * snapshots use any more. Called after the header moved the first element.
+ * @param recover to also delete unused segments left behind by a crash.
+ */
+static bool QueueFile_trimSegments(QueueFile* qf, bool recover) {
+  if (qf->segments.segmentLength == 0) return true;
+  uint64_t from = 0;
+  uint64_t to = 0;
+  uint64_t oldest;
+  if (QueueFile_oldestPosition(qf, &oldest)) {
+    from = oldest - QueueFile_HEADER_LENGTH;
+    to = QueueFile_tailPosition(qf) - QueueFile_HEADER_LENGTH;
+  }
+  if (recover) return SegmentLog_recover(&qf->segments, from, to);
+  SegmentLog_retain(&qf->segments, from, to);
+  return true;
+}
+
+/** Returns the number of the element the next sparse index entry is for. */
+static uint64_t QueueFile_sparseNext(const QueueFile* qf) {
+  return qf->sparseOffset +
+         (uint64_t) qf->sparse.count * qf->options.sparseIndexInterval;
+}
+
+/** Adds the n-th eldest element to the sparse index if it's due next. */
+static void QueueFile_sparseVisit(QueueFile* qf, uint32_t n, uint64_t position,
+                                  uint32_t length) {
+  if (qf->options.sparseIndexInterval > 0 && n == QueueFile_sparseNext(qf)) {
+    ElementIndex_append(&qf->sparse, position, length);
+  }
+}
+
+/** Drops the sparse index entries of the n eldest elements. */
+static void QueueFile_sparseRemoveFirst(QueueFile* qf, uint32_t n) {
+  uint64_t interval = qf->options.sparseIndexInterval;
+  if (interval == 0) return;
+  if (n <= qf->sparseOffset) {
+    qf->sparseOffset -= n;
+    return;
+  }
+  uint64_t dropped = (n - qf->sparseOffset + interval - 1) / interval;
+  ElementIndex_removeFirst(&qf->sparse, dropped < UINT32_MAX ?
+                                        (uint32_t) dropped : UINT32_MAX);
+  qf->sparseOffset = (uint32_t) (qf->sparseOffset + dropped * interval - n);
+}
+
+/** Drops all sparse index entries. */
+static void QueueFile_sparseClear(QueueFile* qf) {
+  ElementIndex_clear(&qf->sparse);
+  qf->sparseOffset = 0;
+}
+
+/**
+ * Advances element from the (n-1)-th to the n-th eldest element. Taken from
+ * the index if it covers n, else the element header is read and indexed if it
+ * is the next one missing from the index.
+ */
+static bool QueueFile_nextElement(QueueFile* qf, uint32_t n, Element* element) {
+  if (n < qf->index.count) {
+    element->position = ElementIndex_position(&qf->index, n);
+    element->length = ElementIndex_length(&qf->index, n);
+  } else {
+    if (!QueueFile_readElement(qf, QueueFile_wrapPosition(qf,
+                               element->position + Element_HEADER_LENGTH +
+                               element->length), element)) {
+      return false;
+    }
+    if (n == qf->index.count) {
+      ElementIndex_append(&qf->index, element->position, element->length);
+    }
+  }
+  QueueFile_sparseVisit(qf, n, element->position, element->length);
+  return true;
+}
+
+/**
+ * Finds the n-th eldest element, n must be < elementCount. Element headers are
+ * only read past the indexed elements, or past the closest element of the
+ * sparse index once the index can't grow any more.
+ */
+static bool QueueFile_locate(QueueFile* qf, uint32_t n, Element* element) {
+  uint32_t i = qf->index.count > 0 ? qf->index.count - 1 : 0;
+  if (n < i) i = n;
+  uint32_t interval = qf->options.sparseIndexInterval;
+  uint32_t sparseStart = 0;
+  uint32_t entry = 0;
+  if (qf->sparse.count > 0 && n >= qf->sparseOffset) {
+    entry = (n - qf->sparseOffset) / interval;
+    if (entry >= qf->sparse.count) entry = qf->sparse.count - 1;
+    sparseStart = qf->sparseOffset + entry * interval;
+  }
+  // Walking from the end of the index extends it, a jump would leave a gap.
+  if (sparseStart > i && qf->index.count == qf->index.maxCount) {
+    i = sparseStart;
+    element->position = ElementIndex_position(&qf->sparse, entry);
+    element->length = ElementIndex_length(&qf->sparse, entry);
+  } else if (i < qf->index.count) {
+    element->position = ElementIndex_position(&qf->index, i);
+    element->length = ElementIndex_length(&qf->index, i);
+  } else {
+    *element = *qf->first;
+    ElementIndex_append(&qf->index, element->position, element->length);
+    QueueFile_sparseVisit(qf, 0, element->position, element->length);
+  }
+  while (i < n) {
+    if (!QueueFile_nextElement(qf, ++i, element)) return false;
+  }
+  return true;
+}
+
+/** Indexes as many elements as the index has room for. */
+static bool QueueFile_buildIndex(QueueFile* qf) {
+  if (qf->elementCount == 0 || qf->index.maxCount == 0) return true;
+  uint32_t n = qf->elementCount < qf->index.maxCount ?
+               qf->elementCount : qf->index.maxCount;
+  Element element;
+  return QueueFile_locate(qf, n - 1, &element);
+}
+
+/** Returns true if all elements are indexed, so new ones have to be too. */
+static bool QueueFile_isIndexComplete(const QueueFile* qf) {
+  return qf->index.count == qf->elementCount;
+}
+
+/**
+ * Indexes every sparseIndexInterval-th element, reading the element headers
+ * from the last indexed one on.
+ */
+static bool QueueFile_buildSparseIndex(QueueFile* qf) {
+  uint32_t interval = qf->options.sparseIndexInterval;
+  if (interval == 0 || QueueFile_sparseNext(qf) >= qf->elementCount) {
+    return true;
+  }
+  Element element;
+  uint32_t i;
+  if (qf->sparse.count == 0) {
+    QueueFile_sparseClear(qf);
+    i = 0;
+    element = *qf->first;
+    QueueFile_sparseVisit(qf, 0, element.position, element.length);
+  } else {
+    i = (uint32_t) (QueueFile_sparseNext(qf) - interval);
+    element.position = ElementIndex_position(&qf->sparse,
+                                             qf->sparse.count - 1);
+    element.length = ElementIndex_length(&qf->sparse, qf->sparse.count - 1);
+  }
+  while (i + 1 < qf->elementCount) {
+    if (!QueueFile_nextElement(qf, ++i, &element)) return false;
+  }
+  return true;
+}
+
+/**
+ * Loads the sparse index saved when the queue was last closed, if the header
+ * says the queue didn't change since. Else it is built by
+ * QueueFile_buildSparseIndex.
+ * @return false if out of memory.
+ */
+static bool QueueFile_loadSparseIndex(QueueFile* qf) {
+  bool saved = qf->sparseSaved;
+  // Changes from here on invalidate the saved index.
+  qf->sparseSaved = false;
+  if (qf->sparseName == NULL || !saved || qf->elementCount == 0) return true;
+  FILE* file = fopen(qf->sparseName, "r");
+  if (file == NULL) {
+    LOG(LINFO, "No sparse index in %s, rebuilding it", qf->sparseName);
+    return true;
+  }
+
+  uint32_t interval = qf->options.sparseIndexInterval;
+  byte header[QueueFile_SPARSE_HEADER_LENGTH] = { 0 };
+  int64_t fileLength = FileIo_getLength(file);
+  bool valid = fileLength >= QueueFile_SPARSE_HEADER_LENGTH &&
+               FileIo_read(file, header, 0, QueueFile_SPARSE_HEADER_LENGTH) &&
+               readInt(header, 0) == QueueFile_SPARSE_MAGIC &&
+               readInt(header, 4) == interval &&
+               readLong(header, 8) == qf->fileLength &&
+               readLong(header, 16) == qf->elementCount &&
+               readLong(header, 24) == qf->first->position &&
+               readLong(header, 32) == qf->last->position &&
+               readInt(header, 40) < interval;
+  uint32_t offset = readInt(header, 40);
+  uint32_t count = readInt(header, 44);
+  valid = valid && offset < qf->elementCount &&
+          count == (qf->elementCount - 1 - offset) / interval + 1 &&
+          (uint64_t) fileLength == QueueFile_SPARSE_HEADER_LENGTH +
+                                   (uint64_t) count *
+                                   QueueFile_SPARSE_ENTRY_LENGTH;
+  byte* entries = NULL;
+  if (valid) {
+    entries = QueueFile_allocate(qf, (size_t) count *
+                                     QueueFile_SPARSE_ENTRY_LENGTH);
+    if (CHECKOOM(entries)) {
+      fclose(file);
+      return false;
+    }
+    valid = FileIo_read(file, entries, 0,
+                        count * QueueFile_SPARSE_ENTRY_LENGTH);
+  }
+  fclose(file);
+
+  uint32_t i;
+  qf->sparseOffset = offset;
+  for (i = 0; valid && i < count; i++) {
+    uint32_t at = i * QueueFile_SPARSE_ENTRY_LENGTH;
+    uint64_t position = readLong(entries, at);
+    valid = position >= QueueFile_HEADER_LENGTH &&
+            position < qf->fileLength &&
+            (offset > 0 || i > 0 || position == qf->first->position) &&
+            ElementIndex_append(&qf->sparse, position,
+                                readInt(entries, at + 8));
+  }
+  QueueFile_deallocate(qf, entries);
+  if (!valid) {
+    LOG(LINFO, "Sparse index in %s doesn't match the queue, rebuilding it",
+        qf->sparseName);
+    QueueFile_sparseClear(qf);
+  }
+  return true;
+}
+
+/**
+ * Saves the sparse index for the next open and marks the header, called when
+ * the queue is closed. The next header write clears the mark, so a queue
+ * changed after that (or not closed cleanly) rebuilds the index instead.
+ */
+static void QueueFile_saveSparseIndex(QueueFile* qf) {
+  if (qf->sparseName == NULL || qf->elementCount == 0 ||
+      QueueFile_sparseNext(qf) < qf->elementCount) {
+    return;
+  }
+  uint32_t count = qf->sparse.count;
+  uint32_t length = QueueFile_SPARSE_HEADER_LENGTH +
+                    count * QueueFile_SPARSE_ENTRY_LENGTH;
+  byte* buffer = QueueFile_allocate(qf, (size_t) length);
+  char* tempName = makeTempFilename(&qf->options.allocator, qf->sparseName,
+                                    MAX_FILENAME_LEN);
+  bool success = false;
+  if (!CHECKOOM(buffer) && tempName != NULL) {
+    writeInt(buffer, 0, QueueFile_SPARSE_MAGIC);
+    writeInt(buffer, 4, qf->options.sparseIndexInterval);
+    writeLong(buffer, 8, qf->fileLength);
+    writeLong(buffer, 16, qf->elementCount);
+    writeLong(buffer, 24, qf->first->position);
+    writeLong(buffer, 32, qf->last->position);
+    writeInt(buffer, 40, qf->sparseOffset);
+    writeInt(buffer, 44, count);
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+      uint32_t at = QueueFile_SPARSE_HEADER_LENGTH +
+                    i * QueueFile_SPARSE_ENTRY_LENGTH;
+      writeLong(buffer, at, ElementIndex_position(&qf->sparse, i));
+      writeInt(buffer, at + 8, ElementIndex_length(&qf->sparse, i));
+    }
+    // Written and synced aside, so the index is whole once the header is
+    // marked.
+    FILE* file = fopen(tempName, "w");
+    success = file != NULL && FileIo_write(file, buffer, 0, length);
+    if (file != NULL) fclose(file);
+    success = success && rename(tempName, qf->sparseName) == 0;
+    if (success) {
+      qf->sparseSaved = true;
+      success = QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount,
+                                      qf->first->position,
+                                      qf->last->position);
+      qf->sparseSaved = false;
+    } else if (tempName != NULL) {
+      remove(tempName);
+    }
+  }
+  if (!success) {
+    LOG(LWARN, "Error saving sparse index to %s", qf->sparseName);
+  }
+  QueueFile_deallocate(qf, tempName);
+  QueueFile_deallocate(qf, buffer);
 }
 
 /**
@@ -332,18 +1535,28 @@ static uint32_t QueueFile_wrapPosition(const QueueFile* qf, uint32_t position) {
  * @param buffer   to write from
  * @param count    # of bytes to write
  */
-static bool QueueFile_ringWrite(QueueFile* qf, uint32_t position,
+static bool QueueFile_ringWrite(QueueFile* qf, uint64_t position,
                                 const byte* buffer,
     uint32_t offset, uint32_t count) {
   bool success = false;
   position = QueueFile_wrapPosition(qf, position);
-  if (position + count <= qf->fileLength) {
+  // Wrapping, the tail would overwrite the front before it is copied.
+  if (qf->relocation.length > 0 &&
+      (position < qf->relocation.to || position + count > qf->fileLength) &&
+      !QueueFile_finishRelocation(qf)) {
+    return false;
+  }
+  if (qf->segments.segmentLength > 0) {
+    success = SegmentLog_write(&qf->segments,
+                               position - QueueFile_HEADER_LENGTH,
+                               buffer + offset, count);
+  } else if (position + count <= qf->fileLength) {
     success = FileIo_seek(qf->file, position) &&
               FileIo_write(qf->file, buffer, offset, count);
   } else {
     // The write overlaps the EOF.
     // # of bytes to write before the EOF.
-    uint32_t beforeEof = qf->fileLength - position;
+    uint32_t beforeEof = (uint32_t) (qf->fileLength - position);
     success = FileIo_seek(qf->file, position) &&
               FileIo_write(qf->file, buffer, offset, beforeEof) &&
               FileIo_seek(qf->file, QueueFile_HEADER_LENGTH) &&
@@ -353,6 +1566,87 @@ static bool QueueFile_ringWrite(QueueFile* qf, uint32_t position,
   return success;
 }
 
+/**
+ * Records bytes appended at the tail in the tail cache. Called once they are
+ * committed, so that the cache always ends at the tail.
+ */
+static void QueueFile_cacheAppend(QueueFile* qf, const byte* data,
+                                  uint32_t count) {
+  QueueFile_TailCache* cache = &qf->cache;
+  if (cache->capacity == 0) return;
+  if (count > cache->capacity) {
+    data += count - cache->capacity;
+    count = cache->capacity;
+  }
+  uint32_t untilEnd = cache->capacity - cache->next;
+  uint32_t first = count < untilEnd ? count : untilEnd;
+  memcpy(cache->data + cache->next, data, (size_t) first);
+  memcpy(cache->data, data + first, (size_t) (count - first));
+  cache->next = (cache->next + count) % cache->capacity;
+  cache->valid = cache->capacity - cache->valid > count ?
+                 cache->valid + count : cache->capacity;
+}
+
+/**
+ * Copies count bytes at the (wrapped) position from the tail cache.
+ * @return false if they aren't all cached.
+ */
+static bool QueueFile_cacheRead(QueueFile* qf, uint64_t position, byte* buffer,
+                                uint32_t count) {
+  QueueFile_TailCache* cache = &qf->cache;
+  if (cache->capacity == 0) return false;
+  // Distance from position forward to the tail, in ring order.
+  uint64_t tail = QueueFile_tailPosition(qf);
+  uint64_t distance = tail >= position ? tail - position :
+                      tail - QueueFile_HEADER_LENGTH + qf->fileLength - position;
+  if (count > distance || distance > cache->valid) {
+    cache->misses++;
+    return false;
+  }
+  uint32_t slot = (cache->next + cache->capacity - (uint32_t) distance) %
+                  cache->capacity;
+  uint32_t untilEnd = cache->capacity - slot;
+  uint32_t first = count < untilEnd ? count : untilEnd;
+  memcpy(buffer, cache->data + slot, (size_t) first);
+  memcpy(buffer + first, cache->data, (size_t) (count - first));
+  cache->hits++;
+  return true;
+}
+
+/**
+ * Reads count bytes at position from the file, they must not cross its end.
+ * Bytes of the front of the ring that a relocation hasn't copied yet are read
+ * from where they were.
+ */
+static bool QueueFile_fileRead(QueueFile* qf, uint64_t position, byte* buffer,
+                               uint32_t offset, uint32_t count) {
+  uint64_t destination = qf->relocation.to;
+  uint64_t pendingStart = destination + qf->relocation.done;
+  uint64_t pendingEnd = destination + qf->relocation.length;
+  while (count > 0) {
+    uint64_t source = position;
+    uint32_t chunk = count;
+    if (qf->relocation.length > 0 && position < pendingStart) {
+      if (position + chunk > pendingStart) {
+        chunk = (uint32_t) (pendingStart - position);
+      }
+    } else if (qf->relocation.length > 0 && position < pendingEnd) {
+      source = position - destination + QueueFile_HEADER_LENGTH;
+      if (position + chunk > pendingEnd) {
+        chunk = (uint32_t) (pendingEnd - position);
+      }
+    }
+    if (!FileIo_seek(qf->file, source) ||
+        !FileIo_read(qf->file, buffer, offset, chunk)) {
+      return false;
+    }
+    position += chunk;
+    offset += chunk;
+    count -= chunk;
+  }
+  return true;
+}
+
 /**
  * Reads count bytes into buffer from file. Wraps if necessary.
  *
@@ -360,23 +1654,26 @@ static bool QueueFile_ringWrite(QueueFile* qf, uint32_t position,
  * @param buffer   to read into
  * @param count    # of bytes to read
  */
-static bool QueueFile_ringRead(QueueFile* qf, uint32_t position, byte* buffer,
+static bool QueueFile_ringRead(QueueFile* qf, uint64_t position, byte* buffer,
                                uint32_t offset, uint32_t count) {
   bool success = false;
   position = QueueFile_wrapPosition(qf, position);
-  if (position + count <= qf->fileLength) {
-    success = FileIo_seek(qf->file, position) &&
-              FileIo_read(qf->file, buffer, 0, count);
+  if (count > 0 && QueueFile_cacheRead(qf, position, buffer + offset, count)) {
+    success = true;
+  } else if (qf->segments.segmentLength > 0) {
+    success = SegmentLog_read(&qf->segments,
+                              position - QueueFile_HEADER_LENGTH,
+                              buffer + offset, count);
+  } else if (position + count <= qf->fileLength) {
+    success = QueueFile_fileRead(qf, position, buffer, offset, count);
   } else {
     // The read overlaps the EOF.
     // # of bytes to read before the EOF.
-    uint32_t beforeEof = qf->fileLength - position;
+    uint32_t beforeEof = (uint32_t) (qf->fileLength - position);
 
-    success = FileIo_seek(qf->file, position) &&
-              FileIo_read(qf->file, buffer, offset, beforeEof) &&
-              FileIo_seek(qf->file, QueueFile_HEADER_LENGTH) &&
-              FileIo_read(qf->file, buffer, offset + beforeEof, count -
-                          beforeEof);
+    success = QueueFile_fileRead(qf, position, buffer, offset, beforeEof) &&
+              QueueFile_fileRead(qf, QueueFile_HEADER_LENGTH, buffer,
+                                 offset + beforeEof, count - beforeEof);
   }
   return success;
 }
@@ -384,357 +1681,2119 @@ static bool QueueFile_ringRead(QueueFile* qf, uint32_t position, byte* buffer,
 // see description in queuefile.h.
 bool QueueFile_isEmpty(QueueFile* qf) {
   if (NULLARG(qf)) return true;
-  pthread_mutex_lock(&qf->mutex);
+  QueueFile_lock(qf);
   uint32_t elementCount = qf->elementCount == 0;
-  pthread_mutex_unlock(&qf->mutex);
+  QueueFile_unlock(qf);
   return elementCount;
 }
 
+// ------------------------------ Compression ---------------------------------
+
+
+static uint32_t QueueFile_lzCompress(void* context, const byte* data,
+                                     uint32_t length, byte* out,
+                                     uint32_t capacity) {
+  (void) context;
+  return LzCodec_compress(data, length, out, capacity);
+}
+
+static bool QueueFile_lzDecompress(void* context, const byte* data,
+                                   uint32_t length, byte* out,
+                                   uint32_t outLength) {
+  (void) context;
+  return LzCodec_decompress(data, length, out, outLength);
+}
+
+// see description in queuefile.h.
+const QueueFile_Codec QueueFile_CODEC_LZ = {
+  1, QueueFile_lzCompress, QueueFile_lzDecompress, NULL
+};
+
+/**
+ * Compresses the data of an add if the queue has a codec and it is long
+ * enough. Called without holding the lock.
+ * @param encoded set to the data as it is stored, the encoding followed by the
+ *        compressed bytes, or to NULL if data doesn't shrink and is stored as
+ *        it is. Free with QueueFile_deallocate.
+ * @return false if out of memory.
+ */
+static bool QueueFile_compress(QueueFile* qf, const byte* data, uint32_t count,
+                               byte** encoded, uint32_t* encodedCount) {
+  *encoded = NULL;
+  const QueueFile_Codec* codec = qf->options.codec;
+  // It must save at least one byte over the encoding.
+  if (codec == NULL || count < qf->options.compressMinBytes ||
+      count <= Element_ENCODING_LENGTH + 1 ||
+      count > Element_MAX_FLAGGED_LENGTH) {
+    return true;
+  }
+  byte* buffer = QueueFile_allocate(qf, (size_t) count - 1);
+  if (CHECKOOM(buffer)) return false;
+  uint32_t compressed = codec->compress(codec->context, data, count,
+                                        buffer + Element_ENCODING_LENGTH,
+                                        count - 1 - Element_ENCODING_LENGTH);
+  if (compressed == 0) {
+    QueueFile_deallocate(qf, buffer);
+    return true;
+  }
+  buffer[0] = codec->id;
+  writeInt(buffer, 1, count);
+  *encoded = buffer;
+  *encodedCount = Element_ENCODING_LENGTH + compressed;
+  return true;
+}
+
+/**
+ * Reads how an element is stored. Reads nothing unless the queue holds
+ * compressed elements.
+ * @param codec set to the id of the codec its data was compressed with, 0 if
+ *        it is stored as it is.
+ * @param length set to the length of its data once decompressed.
+ */
+static bool QueueFile_readEncoding(QueueFile* qf, const Element* element,
+                                   uint8_t* codec, uint32_t* length) {
+  *codec = 0;
+  *length = element->length;
+  if (!qf->compressed) return true;
+  byte encoding[Element_ENCODING_LENGTH];
+  if (!QueueFile_ringRead(qf, element->position, encoding, 0,
+                          Element_HEADER_LENGTH)) {
+    return false;
+  }
+  if ((readInt(encoding, 0) & Element_COMPRESSED) == 0) return true;
+  if (element->length <= Element_ENCODING_LENGTH ||
+      !QueueFile_ringRead(qf, element->position + Element_HEADER_LENGTH,
+                          encoding, 0, Element_ENCODING_LENGTH)) {
+    LOG(LWARN, "Error reading compressed element at %" PRIu64,
+        element->position);
+    return false;
+  }
+  *codec = encoding[0];
+  *length = readInt(encoding, 1);
+  return true;
+}
+
+/**
+ * Reads the data of an element into buffer, decompressing it if codec isn't
+ * 0. codec and length are as returned by QueueFile_readEncoding.
+ */
+static bool QueueFile_readData(QueueFile* qf, const Element* element,
+                               uint8_t codec, byte* buffer, uint32_t length) {
+  if (codec == 0) {
+    return QueueFile_ringRead(qf, element->position + Element_HEADER_LENGTH,
+                              buffer, 0, length);
+  }
+  const QueueFile_Codec* decoder = NULL;
+  if (qf->options.codec != NULL && qf->options.codec->id == codec) {
+    decoder = qf->options.codec;
+  } else if (codec == QueueFile_CODEC_LZ.id) {
+    decoder = &QueueFile_CODEC_LZ;
+  } else {
+    LOG(LWARN, "Element compressed with unknown codec %u", codec);
+    return false;
+  }
+  uint32_t compressed = element->length - Element_ENCODING_LENGTH;
+  byte* data = QueueFile_allocate(qf, (size_t) compressed);
+  if (CHECKOOM(data)) return false;
+  bool success = QueueFile_ringRead(qf, element->position +
+                                    Element_HEADER_LENGTH +
+                                    Element_ENCODING_LENGTH,
+                                    data, 0, compressed);
+  if (success &&
+      !decoder->decompress(decoder->context, data, compressed, buffer,
+                           length)) {
+    LOG(LWARN, "Corrupt compressed element at %" PRIu64, element->position);
+    success = false;
+  }
+  QueueFile_deallocate(qf, data);
+  return success;
+}
+
+static void QueueFile_initStream(QueueFile_ElementStream* stream,
+                                 QueueFile* qf, uint64_t position,
+                                 uint32_t length);
+
+/**
+ * Sets up a stream over the data of an element. A compressed element is
+ * decompressed into a buffer first, which the stream is served from.
+ * @param inflated set to that buffer, to be freed with QueueFile_deallocate
+ *        once the stream is done, or to NULL.
+ */
+static bool QueueFile_initDecodedStream(QueueFile_ElementStream* stream,
+                                        QueueFile* qf, const Element* element,
+                                        byte** inflated) {
+  *inflated = NULL;
+  QueueFile_initStream(stream, qf, element->position, element->length);
+  uint8_t codec;
+  uint32_t length;
+  if (!QueueFile_readEncoding(qf, element, &codec, &length)) return false;
+  if (codec == 0) return true;
+  *inflated = QueueFile_allocate(qf, length == 0 ? 1 : (size_t) length);
+  if (CHECKOOM(*inflated)) return false;
+  if (!QueueFile_readData(qf, element, codec, *inflated, length)) {
+    QueueFile_deallocate(qf, *inflated);
+    *inflated = NULL;
+    return false;
+  }
+  stream->remaining = stream->buffered = length;
+  stream->next = *inflated;
+  return true;
+}
+
+/** Logs that readers of the stored bytes can't serve compressed elements. */
+static bool QueueFile_isCompressed(const QueueFile* qf, const char* what) {
+  if (qf->compressed) {
+    LOG(LWARN, "%s not supported on queues holding compressed elements", what);
+  }
+  return qf->compressed;
+}
+
 static bool QueueFile_expandIfNecessary(QueueFile* qf, uint32_t dataLength);
+static bool QueueFile_makeRoom(QueueFile* qf, uint64_t elementLength,
+                               uint64_t* deadline);
+static bool QueueFile_dropOldest(QueueFile* qf, uint64_t elementLength);
+static bool QueueFile_expand(QueueFile* qf, uint64_t elementLength,
+                             uint32_t stepBytes);
+static uint64_t QueueFile_grownLength(QueueFile* qf, uint64_t length);
+static bool QueueFile_isAboveWatermark(QueueFile* qf);
+static void QueueFile_expandAheadIfNecessary(QueueFile* qf);
+static void QueueFile_shrinkIfNecessary(QueueFile* qf);
+static bool QueueFile_relocateStep(QueueFile* qf, uint64_t maxBytes);
+
+/**
+ * Wakes QueueFile_await callers and adds waiting for room after elements were
+ * added or removed.
+ */
+static void QueueFile_notifyChanged(QueueFile* qf) {
+  // In shared mode QueueFile_unlock publishes and wakes.
+  if (qf->shared == NULL) {
+    __sync_fetch_and_add(&qf->localGeneration, 1);
+    QueueFile_futexWake(&qf->localGeneration, false);
+  }
+}
 
 // see description in queuefile.h.
 bool QueueFile_add(QueueFile* qf, const byte* data, uint32_t offset,
                    uint32_t count) {
   if (NULLARG(qf) || NULLARG(data)) return false;
+  byte* encoded;
+  uint32_t encodedCount;
+  if (!QueueFile_compress(qf, data + offset, count, &encoded, &encodedCount)) {
+    return false;
+  }
+  uint32_t header = count;
+  if (encoded != NULL) {
+    data = encoded;
+    offset = 0;
+    count = encodedCount;
+    header = count | Element_COMPRESSED;
+  }
 
   bool success = false;
-  pthread_mutex_lock(&qf->mutex);
-
-  if (QueueFile_expandIfNecessary(qf, count)) {
+  QueueFile_lock(qf);
+
+  if (qf->elementCount == UINT32_MAX) {
+    LOG(LWARN, "Queue is full, it holds %u elements", qf->elementCount);
+  } else if (count > Element_MAX_FLAGGED_LENGTH &&
+             (qf->compressed || qf->options.codec != NULL)) {
+    LOG(LWARN, "Element too long for a compressed queue: %u", count);
+  } else if (QueueFile_expandIfNecessary(qf, count)) {
     
     // Insert a new element after the current last element.
     bool wasEmpty = QueueFile_isEmpty(qf);
-    uint32_t position = wasEmpty ? QueueFile_HEADER_LENGTH :
-                        QueueFile_wrapPosition(qf, qf->last->position +
-                                               Element_HEADER_LENGTH +
-                                               qf->last->length);
-    Element* newLast = Element_new(position, count);
+    uint64_t position = QueueFile_tailPosition(qf);
 
     // Write length & data.
-    writeInt(qf->buffer, 0, count);
-    if (newLast != NULL) {
-      if (QueueFile_ringWrite(qf, newLast->position, qf->buffer, 0,
-                              Element_HEADER_LENGTH) &&
-        QueueFile_ringWrite(qf, newLast->position + Element_HEADER_LENGTH, data,
+    if (encoded != NULL) qf->compressed = true;
+    writeInt(qf->buffer, 0, header);
+    if (QueueFile_ringWrite(qf, position, qf->buffer, 0,
+                            Element_HEADER_LENGTH) &&
+        QueueFile_ringWrite(qf, position + Element_HEADER_LENGTH, data,
                             offset, count)) {
 
-        // Commit the addition. If wasEmpty, first == last.
-        uint32_t firstPosition = wasEmpty ? newLast->position : qf->first->position;
-        success = QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount + 1,
-                                        firstPosition, newLast->position);
+      // Commit the addition. If wasEmpty, first == last.
+      uint64_t firstPosition = wasEmpty ? position : qf->first->position;
+      success = QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount + 1,
+                                      firstPosition, position);
+    }
+    if (success) {
+      if (QueueFile_isIndexComplete(qf)) {
+        ElementIndex_append(&qf->index, position, count);
       }
-      if (success) {
-        if (freeAndAssignNonNull(&qf->last, newLast)) {
-          if (wasEmpty) freeAndAssignNonNull(&qf->first,
-                                             Element_new(qf->last->position,
-                                                         qf->last->length));
-          success = true;
-          qf->elementCount++;
+      QueueFile_sparseVisit(qf, qf->elementCount, position, count);
+      byte lengthBuffer[Element_HEADER_LENGTH];
+      writeInt(lengthBuffer, 0, header);
+      QueueFile_cacheAppend(qf, lengthBuffer, Element_HEADER_LENGTH);
+      QueueFile_cacheAppend(qf, data + offset, count);
+      QueueFile_setLast(qf, position, count);
+      if (wasEmpty) QueueFile_setFirst(qf, position, count);
+      qf->elementCount++;
+      qf->addSequence++;
+      QueueFile_notifyChanged(qf);
+      QueueFile_relocateStep(qf, qf->options.expansionStepBytes);
+      QueueFile_expandAheadIfNecessary(qf);
+    }
+  }
+
+  QueueFile_unlock(qf);
+  QueueFile_deallocate(qf, encoded);
+  return success;
+}
+
+/**
+ * Adds a list of elements with one write for all of them and one header
+ * commit.
+ * @param firstSequence set to the sequence number of the first element.
+ * @return false if an error occurred, nothing was added then.
+ */
+static bool QueueFile_addBatch(QueueFile* qf, QueueFile_PendingAdd* batch,
+                               uint64_t* firstSequence) {
+  uint32_t elements = 0;
+  uint32_t total = 0;
+  uint32_t longest = 0;
+  bool compressed = false;
+  QueueFile_PendingAdd* add;
+  for (add = batch; add != NULL; add = add->next) {
+    elements++;
+    total += Element_HEADER_LENGTH + add->count;
+    if (add->count > longest) longest = add->count;
+    compressed |= add->compressed;
+  }
+  if (elements == 0) return true;
+
+  // Lengths and data of all elements, as they are laid out in the ring.
+  byte* buffer = QueueFile_allocate(qf, (size_t) total);
+  if (CHECKOOM(buffer)) return false;
+  uint32_t offset = 0;
+  uint32_t lastOffset = 0;
+  uint32_t lastLength = 0;
+  for (add = batch; add != NULL; add = add->next) {
+    lastOffset = offset;
+    lastLength = add->count;
+    writeInt(buffer, offset, add->compressed ?
+                             add->count | Element_COMPRESSED : add->count);
+    memcpy(buffer + offset + Element_HEADER_LENGTH, add->data,
+           (size_t) add->count);
+    offset += Element_HEADER_LENGTH + add->count;
+  }
+
+  bool success = false;
+  QueueFile_lock(qf);
+  if (UINT32_MAX - qf->elementCount < elements) {
+    LOG(LWARN, "Queue is full, it holds %u elements", qf->elementCount);
+  } else if (longest > Element_MAX_FLAGGED_LENGTH &&
+             (qf->compressed || qf->options.codec != NULL)) {
+    LOG(LWARN, "Element too long for a compressed queue: %u", longest);
+  } else if (QueueFile_expandIfNecessary(qf, total - Element_HEADER_LENGTH)) {
+    bool wasEmpty = qf->elementCount == 0;
+    if (compressed) qf->compressed = true;
+    uint64_t position = QueueFile_tailPosition(qf);
+    uint64_t lastPosition = QueueFile_wrapPosition(qf, position + lastOffset);
+    uint64_t firstPosition = wasEmpty ? position : qf->first->position;
+    if (QueueFile_ringWrite(qf, position, buffer, 0, total) &&
+        QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount + elements,
+                              firstPosition, lastPosition)) {
+      bool indexComplete = QueueFile_isIndexComplete(qf);
+      uint32_t n = qf->elementCount;
+      offset = 0;
+      for (add = batch; add != NULL; add = add->next) {
+        uint64_t elementPosition = QueueFile_wrapPosition(qf,
+                                                          position + offset);
+        if (indexComplete) {
+          ElementIndex_append(&qf->index, elementPosition, add->count);
         }
-      } else {
-        free(newLast);
+        QueueFile_sparseVisit(qf, n++, elementPosition, add->count);
+        offset += Element_HEADER_LENGTH + add->count;
       }
+      QueueFile_cacheAppend(qf, buffer, total);
+      QueueFile_setLast(qf, lastPosition, lastLength);
+      if (wasEmpty) QueueFile_setFirst(qf, position, batch->count);
+      qf->elementCount += elements;
+      *firstSequence = qf->addSequence + 1;
+      qf->addSequence += elements;
+      QueueFile_notifyChanged(qf);
+      QueueFile_relocateStep(qf, qf->options.expansionStepBytes);
+      QueueFile_expandAheadIfNecessary(qf);
+      success = true;
     }
   }
+  QueueFile_unlock(qf);
 
-  pthread_mutex_unlock(&qf->mutex);
+  QueueFile_deallocate(qf, buffer);
   return success;
 }
 
-/** Returns the number of used bytes. */
-static uint32_t QueueFile_usedBytes(QueueFile* qf) {
-  if (qf->elementCount == 0) return QueueFile_HEADER_LENGTH;
-
-  if (qf->last->position >= qf->first->position) {
-    // Contiguous queue.
-    return (qf->last->position - qf->first->position)   // all but last entry
-           + Element_HEADER_LENGTH + qf->last->length // last entry
-           + QueueFile_HEADER_LENGTH;
-  } else {
-    // tail < head. The queue wraps.
-    return qf->last->position                      // buffer front + header
-           + Element_HEADER_LENGTH + qf->last->length // last entry
-           + qf->fileLength - qf->first->position;        // buffer end
+/**
+ * Expands the file for QueueFile_expandAheadIfNecessary, unless it was
+ * emptied or expanded since. The space is preallocated before the lock is
+ * taken, as nothing uses the bytes beyond fileLength yet, and the lock is
+ * released between the copy steps, so that adds go on meanwhile.
+ */
+static void QueueFile_expandAhead(QueueFile* qf) {
+  uint32_t stepBytes = qf->options.expansionStepBytes > 0 ?
+                       qf->options.expansionStepBytes :
+                       QueueFile_EXPAND_AHEAD_STEP_BYTES;
+  QueueFile_lock(qf);
+  uint64_t previousLength = qf->fileLength;
+  bool success = QueueFile_isAboveWatermark(qf);
+  uint64_t newLength = QueueFile_grownLength(qf, previousLength);
+  QueueFile_unlock(qf);
+  if (!success) return;
+
+  // Grows the file to newLength, which the header doesn't refer to yet.
+  success = FileIo_preallocate(qf->file, previousLength,
+                               newLength - previousLength);
+  QueueFile_lock(qf);
+  if (success && qf->fileLength == previousLength &&
+      QueueFile_isAboveWatermark(qf)) {
+    success = QueueFile_expand(qf, 0, stepBytes);
+  }
+  while (success && qf->relocation.length > 0) {
+    success = QueueFile_relocateStep(qf, stepBytes);
+    QueueFile_unlock(qf);
+    QueueFile_lock(qf);
   }
+  QueueFile_unlock(qf);
 }
 
-/** Returns number of unused bytes. */
-static uint32_t QueueFile_remainingBytes(QueueFile* qf) {
-  return qf->fileLength - QueueFile_usedBytes(qf);
+/**
+ * Body of the I/O thread: adds whatever is pending as one batch, then calls
+ * the callbacks. Exits once stopping and nothing is pending. Expands the file
+ * when asked to in between.
+ */
+static void* QueueFile_asyncMain(void* arg) {
+  QueueFile* qf = arg;
+  pthread_mutex_lock(&qf->asyncMutex);
+  while (true) {
+    while (qf->pendingHead == NULL && !qf->expansionRequested &&
+           !qf->asyncStopping) {
+      pthread_cond_wait(&qf->asyncCondition, &qf->asyncMutex);
+    }
+    if (qf->expansionRequested && !qf->asyncStopping) {
+      pthread_mutex_unlock(&qf->asyncMutex);
+      QueueFile_expandAhead(qf);
+      pthread_mutex_lock(&qf->asyncMutex);
+      qf->expansionRequested = false;
+      continue;
+    }
+    if (qf->pendingHead == NULL) break;
+
+    // Take as many pending adds as fit in a batch, but at least one.
+    QueueFile_PendingAdd* batch = qf->pendingHead;
+    QueueFile_PendingAdd* batchLast = batch;
+    uint32_t batchBytes = Element_HEADER_LENGTH + batch->count;
+    while (batchLast->next != NULL &&
+           batchBytes + Element_HEADER_LENGTH + batchLast->next->count <=
+           QueueFile_ASYNC_MAX_BATCH_BYTES) {
+      batchLast = batchLast->next;
+      batchBytes += Element_HEADER_LENGTH + batchLast->count;
+    }
+    qf->pendingHead = batchLast->next;
+    if (qf->pendingHead == NULL) qf->pendingTail = NULL;
+    batchLast->next = NULL;
+    pthread_mutex_unlock(&qf->asyncMutex);
+
+    uint64_t sequence = 0;
+    bool success = QueueFile_addBatch(qf, batch, &sequence);
+    while (batch != NULL) {
+      QueueFile_PendingAdd* done = batch;
+      batch = batch->next;
+      if (done->callback != NULL) {
+        (*done->callback)(done->context, success, success ? sequence++ : 0);
+      }
+      QueueFile_deallocate(qf, done->data);
+      QueueFile_deallocate(qf, done);
+    }
+
+    pthread_mutex_lock(&qf->asyncMutex);
+  }
+  pthread_mutex_unlock(&qf->asyncMutex);
+  return NULL;
+}
+
+/** Starts the I/O thread unless it runs already, asyncMutex must be held. */
+static bool QueueFile_startAsync(QueueFile* qf) {
+  if (qf->asyncStarted) return true;
+  if (pthread_create(&qf->asyncThread, NULL, QueueFile_asyncMain, qf) != 0) {
+    LOG(LWARN, "Could not start I/O thread");
+    return false;
+  }
+  qf->asyncStarted = true;
+  return true;
+}
+
+/**
+ * Asks the I/O thread to expand the file once more than expandAtPercent of it
+ * is used. Called after adds.
+ */
+static void QueueFile_expandAheadIfNecessary(QueueFile* qf) {
+  if (!QueueFile_isAboveWatermark(qf)) return;
+  pthread_mutex_lock(&qf->asyncMutex);
+  if (!qf->asyncStopping && !qf->expansionRequested &&
+      QueueFile_startAsync(qf)) {
+    qf->expansionRequested = true;
+    pthread_cond_signal(&qf->asyncCondition);
+  }
+  pthread_mutex_unlock(&qf->asyncMutex);
+}
+
+// see description in queuefile.h.
+bool QueueFile_addAsync(QueueFile* qf, const byte* data, uint32_t offset,
+                        uint32_t count, QueueFile_AddCallback callback,
+                        void* context) {
+  if (NULLARG(qf) || NULLARG(data)) return false;
+  QueueFile_PendingAdd* add = QueueFile_allocate(qf,
+                                                 sizeof(QueueFile_PendingAdd));
+  if (CHECKOOM(add)) return false;
+  // Compressed by the caller, the I/O thread only writes.
+  if (!QueueFile_compress(qf, data + offset, count, &add->data, &add->count)) {
+    QueueFile_deallocate(qf, add);
+    return false;
+  }
+  add->compressed = add->data != NULL;
+  if (!add->compressed) {
+    add->data = QueueFile_allocate(qf, count == 0 ? 1 : (size_t) count);
+    if (CHECKOOM(add->data)) {
+      QueueFile_deallocate(qf, add);
+      return false;
+    }
+    memcpy(add->data, data + offset, (size_t) count);
+    add->count = count;
+  }
+  add->callback = callback;
+  add->context = context;
+  add->next = NULL;
+
+  bool success = true;
+  pthread_mutex_lock(&qf->asyncMutex);
+  if (qf->asyncStopping) {
+    LOG(LWARN, "Queue is closing, can't add");
+    success = false;
+  } else {
+    success = QueueFile_startAsync(qf);
+  }
+  if (success) {
+    if (qf->pendingTail == NULL) {
+      qf->pendingHead = add;
+    } else {
+      qf->pendingTail->next = add;
+    }
+    qf->pendingTail = add;
+    pthread_cond_signal(&qf->asyncCondition);
+  }
+  pthread_mutex_unlock(&qf->asyncMutex);
+
+  if (!success) {
+    QueueFile_deallocate(qf, add->data);
+    QueueFile_deallocate(qf, add);
+  }
+  return success;
+}
+
+/** Lets the I/O thread complete all pending adds and waits for it to exit. */
+static void QueueFile_stopAsync(QueueFile* qf) {
+  pthread_mutex_lock(&qf->asyncMutex);
+  bool started = qf->asyncStarted;
+  qf->asyncStopping = true;
+  pthread_cond_signal(&qf->asyncCondition);
+  pthread_mutex_unlock(&qf->asyncMutex);
+  if (started) pthread_join(qf->asyncThread, NULL);
+}
+
+/**
+ * Returns the number of used bytes, counting data pinned by snapshots as used
+ * so that it isn't overwritten while they read it.
+ */
+static uint64_t QueueFile_usedBytes(QueueFile* qf) {
+  uint64_t oldest;
+  if (!QueueFile_oldestPosition(qf, &oldest)) return QueueFile_HEADER_LENGTH;
+
+  return QueueFile_distanceToLast(qf, oldest)       // all but last entry
+         + Element_HEADER_LENGTH + qf->last->length // last entry
+         + QueueFile_HEADER_LENGTH;
+}
+
+/**
+ * Returns the number of bytes open snapshots keep in use, from the eldest
+ * position one still reads to the end of the last element, or just the
+ * header if none does.
+ */
+static uint64_t QueueFile_pinnedBytes(QueueFile* qf) {
+  uint64_t pinned = QueueFile_HEADER_LENGTH;
+  QueueFile_Snapshot* snapshot;
+  for (snapshot = qf->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+    if (snapshot->remaining == 0) continue;
+    uint64_t bytes = QueueFile_distanceToLast(qf, snapshot->position) +
+                     Element_HEADER_LENGTH + qf->last->length +
+                     QueueFile_HEADER_LENGTH;
+    if (bytes > pinned) pinned = bytes;
+  }
+  return pinned;
+}
+
+/** Returns number of unused bytes. */
+static uint64_t QueueFile_remainingBytes(QueueFile* qf) {
+  return qf->fileLength - QueueFile_usedBytes(qf);
+}
+
+/** Returns whether more than expandAtPercent of the file is used. */
+static bool QueueFile_isAboveWatermark(QueueFile* qf) {
+  return qf->options.expandAtPercent > 0 &&
+         qf->segments.segmentLength == 0 &&
+         (qf->options.maxFileLength == 0 ||
+          qf->fileLength < qf->options.maxFileLength) &&
+         QueueFile_usedBytes(qf) * 100 >
+         qf->fileLength * qf->options.expandAtPercent;
+}
+
+/**
+ * Returns the number of bytes the next add may use. While a view is out the
+ * tail must not wrap to the start of the ring: expansion copies the front of
+ * a wrapped ring to the end of the file, and the old copy a view may point
+ * into has to stay intact until the viewed element is removed.
+ */
+static uint64_t QueueFile_writableBytes(QueueFile* qf) {
+  uint64_t remaining = QueueFile_remainingBytes(qf);
+  if (!qf->viewActive) return remaining;
+  uint64_t tail = QueueFile_tailPosition(qf);
+  uint64_t oldest;
+  if (QueueFile_oldestPosition(qf, &oldest) && tail <= oldest) {
+    // Wrapped, the free space [tail, oldest) doesn't cross the end.
+    return remaining;
+  }
+  // Keep one byte so that the tail doesn't end up at the start either.
+  uint64_t untilEnd = qf->fileLength - tail - 1;
+  return untilEnd < remaining ? untilEnd : remaining;
+}
+
+/**
+ * If necessary, expands the file to accommodate an additional element of the
+ * given length.
+ *
+ * @param dataLength length of data being added
+ * @returns false only if an error was encountered.
+ */
+static bool QueueFile_expandIfNecessary(QueueFile* qf, uint32_t dataLength) {
+  uint64_t elementLength = (uint64_t) Element_HEADER_LENGTH + dataLength;
+  uint64_t deadline = 0;
+  // With a view out one expansion may not leave enough space at the end.
+  while (QueueFile_writableBytes(qf) < elementLength) {
+    uint64_t maxLength = qf->options.maxFileLength;
+    if (maxLength > 0 &&
+        (qf->fileLength >= maxLength ||
+         QueueFile_usedBytes(qf) + elementLength > maxLength)) {
+      if (!QueueFile_makeRoom(qf, elementLength, &deadline)) return false;
+    } else if (!QueueFile_expand(qf, elementLength,
+                                 qf->options.expansionStepBytes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Applies the fullPolicy when an element doesn't fit below maxFileLength.
+ * @param deadline of QueueFile_FULL_BLOCK, 0 before the first wait.
+ * @return true if the queue may have room now, false if the add fails.
+ */
+static bool QueueFile_makeRoom(QueueFile* qf, uint64_t elementLength,
+                               uint64_t* deadline) {
+  if (QueueFile_HEADER_LENGTH + elementLength > qf->options.maxFileLength) {
+    LOG(LINFO, "Element of %" PRIu64 " bytes exceeds maxFileLength",
+        elementLength);
+    return false;
+  }
+  if (qf->options.fullPolicy == QueueFile_FULL_DROP_OLDEST &&
+      qf->elementCount > 0) {
+    return QueueFile_dropOldest(qf, elementLength);
+  }
+  if (qf->options.fullPolicy == QueueFile_FULL_BLOCK && qf->lockDepth > 1) {
+    // Unlocking once leaves the queue locked, no removal could end the wait.
+    LOG(LINFO, "Queue is full, can't wait for room while it is locked");
+    return false;
+  }
+  if (qf->options.fullPolicy == QueueFile_FULL_BLOCK) {
+    uint64_t now = QueueFile_nowMillis();
+    if (*deadline == 0) *deadline = now + qf->options.fullTimeoutMillis;
+    if (now < *deadline) {
+      // Removals bump the word, so one after unlocking ends the wait.
+      uint32_t* word = qf->shared != NULL ? &qf->shared->generation :
+                                            &qf->localGeneration;
+      uint32_t seen = *word;
+      QueueFile_unlock(qf);
+      QueueFile_futexWait(word, seen, (uint32_t) (*deadline - now),
+                          qf->shared != NULL);
+      QueueFile_lock(qf);
+      return true;
+    }
+  }
+  LOG(LINFO, "Queue is full at %" PRIu64 " bytes", qf->fileLength);
+  return false;
+}
+
+/**
+ * Removes as many of the eldest elements as it takes to make room for
+ * elementLength bytes below maxFileLength, at least one, with one commit.
+ */
+static bool QueueFile_dropOldest(QueueFile* qf, uint64_t elementLength) {
+  uint64_t maxLength = qf->options.maxFileLength;
+  if (QueueFile_pinnedBytes(qf) + elementLength > maxLength) {
+    // Removals free nothing a snapshot still reads, keep the elements.
+    LOG(LINFO, "Queue is full at %" PRIu64 " bytes pinned by snapshots",
+        qf->fileLength);
+    return false;
+  }
+  // Bytes used by the elements alone, what removing them can free.
+  uint64_t used = QueueFile_distanceToLast(qf, qf->first->position) +
+                  Element_HEADER_LENGTH + qf->last->length +
+                  QueueFile_HEADER_LENGTH;
+  uint64_t needed = used + elementLength > maxLength ?
+                    used + elementLength - maxLength : 0;
+  Element element = *qf->first;
+  uint32_t n = 0;
+  uint64_t freed = 0;
+  uint64_t bytes = 0;
+  while (true) {
+    n++;
+    freed += Element_HEADER_LENGTH + element.length;
+    bytes += element.length;
+    if (freed >= needed || n == qf->elementCount) break;
+    if (!QueueFile_readElement(qf, QueueFile_wrapPosition(qf,
+            element.position + Element_HEADER_LENGTH + element.length),
+            &element)) {
+      return false;
+    }
+  }
+  if (!QueueFile_removeN(qf, n)) return false;
+  qf->dropped.elements += n;
+  qf->dropped.bytes += bytes;
+  return true;
+}
+
+/**
+ * Returns the length the file grows to from length, see
+ * QueueFile_Options.growthPercent, at most maxFileLength.
+ */
+static uint64_t QueueFile_grownLength(QueueFile* qf, uint64_t length) {
+  uint64_t grown = length << 1;
+  if (qf->options.growthPercent > 0 || qf->options.growthIncrement > 0) {
+    uint64_t growth = qf->options.growthIncrement;
+    if (growth == 0) growth = length / 100 * qf->options.growthPercent;
+    if (growth == 0) growth = 1;
+    grown = (length + growth + QueueFile_BLOCK_LENGTH - 1) /
+            QueueFile_BLOCK_LENGTH * QueueFile_BLOCK_LENGTH;
+  }
+  uint64_t maxLength = qf->options.maxFileLength;
+  return maxLength > 0 && grown > maxLength ? maxLength : grown;
+}
+
+/**
+ * Expands the file so that it has at least elementLength unused bytes, or
+ * grows it by one step if elementLength is 0. Callers make sure that the
+ * element fits below maxFileLength.
+ * @param stepBytes 0 to copy the wrapped front at once, else see
+ *                  QueueFile_Options.expansionStepBytes.
+ * @returns false only if an error was encountered.
+ */
+static bool QueueFile_expand(QueueFile* qf, uint64_t elementLength,
+                             uint32_t stepBytes) {
+  // A relocation copies to the old end of the file, which is about to move.
+  if (!QueueFile_finishRelocation(qf)) return false;
+  uint64_t remainingBytes = QueueFile_remainingBytes(qf);
+
+  // Calculate the position of the tail end of the data in the ring buffer
+  uint64_t endOfLastElement = QueueFile_tailPosition(qf);
+  uint64_t oldest = qf->fileLength;
+  bool wrapped = QueueFile_oldestPosition(qf, &oldest) &&
+                 endOfLastElement <= oldest;
+  // Space behind the old end that unwrapping the ring copies to, see below.
+  uint64_t frontLength = endOfLastElement - QueueFile_HEADER_LENGTH;
+  uint64_t backLength = qf->fileLength - oldest;
+  bool moveBack = backLength < frontLength && !qf->viewActive;
+  // When both sides take more than stepBytes the front is left to later
+  // calls, see QueueFile_relocateStep, and needs room behind the old end.
+  bool incremental = wrapped && stepBytes > 0 && !qf->viewActive &&
+                     frontLength > stepBytes && backLength > stepBytes;
+  uint64_t copyRoom = !wrapped ? 0 :
+                      moveBack && !incremental ? backLength : frontLength;
+
+  // Expand.
+  uint64_t previousLength = qf->fileLength;
+  uint64_t newLength;
+  uint64_t maxLength = qf->options.maxFileLength;
+
+  // Grow the length until we can fit the new data and the copy.
+  do {
+    newLength = QueueFile_grownLength(qf, previousLength);
+    remainingBytes += newLength - previousLength;
+    previousLength = newLength;
+  } while ((remainingBytes < elementLength ||
+            newLength - qf->fileLength < copyRoom) &&
+           (maxLength == 0 || newLength < maxLength));
+  // The header holds the old end in whole blocks or as half the new length.
+  if (incremental &&
+      (newLength - qf->fileLength < frontLength ||
+       (newLength != qf->fileLength << 1 &&
+        (qf->fileLength % QueueFile_BLOCK_LENGTH != 0 ||
+         qf->fileLength / QueueFile_BLOCK_LENGTH > UINT32_MAX)))) {
+    incremental = false;
+    copyRoom = moveBack ? backLength : frontLength;
+  }
+  if (newLength - qf->fileLength < copyRoom) {
+    LOG(LINFO, "No room to unwrap the ring within maxFileLength");
+    return false;
+  }
+
+  // TODO(jochen): if truncate in setLength does not work for target platform,
+  //  consider appending 0s using FileIo_writeZeros.
+  if (!FileIo_setLength(qf->file, newLength)) {
+    return false;
+  }
+
+  // If the buffer is split, we need to make it contiguous. Either append the
+  // front of the ring, up to the tail, to after the end of the old file, or
+  // move the back of the ring, from the eldest position to the old end, to
+  // the new end; whichever copies less. A view may point into the old copy of
+  // the front though, which the tail only leaves alone in the first case.
+  uint64_t from = 0;
+  uint64_t count = 0;
+  uint64_t to = 0;
+  if (wrapped) {
+    if (moveBack && !incremental) {
+      from = oldest;
+      count = backLength;
+      to = newLength - backLength;
+    } else {
+      from = QueueFile_HEADER_LENGTH;
+      count = frontLength;
+      to = qf->fileLength;
+    }
+    if (incremental) {
+      qf->relocation.length = count;
+      qf->relocation.done = 0;
+      qf->relocation.to = to;
+    } else if (!FileIo_transferTo(qf->file, from, to, count)) {
+      return false;
+    }
+  }
+
+  // Commit the expansion. The copy is only referenced once the header is
+  // written, a crash before leaves the old ring intact. Moving the front
+  // always moves the last element and, if a snapshot pins older data, can
+  // also move the first; moving the back always moves the eldest data.
+  Element first = { 0, 0 };
+  Element last = { 0, 0 };
+  if (qf->elementCount > 0) {
+    first = *qf->first;
+    last = *qf->last;
+    QueueFile_relocate(&first, from, count, to);
+    QueueFile_relocate(&last, from, count, to);
+  }
+  if (!QueueFile_writeHeader(qf, newLength, qf->elementCount, first.position,
+                             last.position)) {
+    memset(&qf->relocation, 0, sizeof(QueueFile_Relocation));
+    return false;
+  }
+  if (wrapped) {
+    if (qf->elementCount > 0) QueueFile_relocate(qf->first, from, count, to);
+    QueueFile_relocate(qf->last, from, count, to);
+    QueueFile_relocated(qf, from, count, to);
+  }
+  qf->fileLength = newLength;
+  return true;
+}
+
+/**
+ * Copies the next at most maxBytes of a pending relocation and commits the
+ * progress. The front stays where it was until the relocation is done, so a
+ * crash before the commit only means copying the same bytes again.
+ */
+static bool QueueFile_relocateStep(QueueFile* qf, uint64_t maxBytes) {
+  QueueFile_Relocation* relocation = &qf->relocation;
+  if (relocation->length == 0 || maxBytes == 0) return true;
+  QueueFile_Relocation previous = *relocation;
+  uint64_t count = relocation->length - relocation->done;
+  if (count > maxBytes) count = maxBytes;
+  if (!FileIo_transferTo(qf->file, QueueFile_HEADER_LENGTH + relocation->done,
+                         relocation->to + relocation->done, count)) {
+    return false;
+  }
+  relocation->done += count;
+  if (relocation->done == relocation->length) {
+    memset(relocation, 0, sizeof(QueueFile_Relocation));
+  }
+  bool empty = qf->elementCount == 0;
+  if (!QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount,
+                             empty ? 0 : qf->first->position,
+                             empty ? 0 : qf->last->position)) {
+    *relocation = previous;
+    return false;
+  }
+  return true;
+}
+
+/** Copies the rest of a pending relocation. */
+static bool QueueFile_finishRelocation(QueueFile* qf) {
+  return QueueFile_relocateStep(qf, UINT64_MAX);
+}
+
+/**
+ * Halves the file if less than shrinkPercent of it is used and the elements
+ * fit into the first half. They're left in place if they already lie there,
+ * else moved to its start, as long as they don't wrap, don't overlap where
+ * they go (a crash before the commit would corrupt them) and take at most
+ * QueueFile_SHRINK_COPY_LIMIT bytes. Otherwise consumers and producers move
+ * them on and a later call tries again. Errors leave the file as it was.
+ */
+static void QueueFile_shrinkIfNecessary(QueueFile* qf) {
+  if (qf->options.shrinkPercent == 0 || qf->elementCount == 0 ||
+      qf->segments.segmentLength > 0 || QueueFile_isPinned(qf) ||
+      qf->viewActive || qf->relocation.length > 0) {
+    return;
+  }
+  uint64_t newLength = qf->fileLength >> 1;
+  if (newLength < qf->options.initialLength) return;
+  uint64_t used = QueueFile_usedBytes(qf);
+  if (used * 100 >= qf->fileLength * qf->options.shrinkPercent ||
+      used > newLength) {
+    return;
+  }
+
+  uint64_t from = qf->first->position;
+  uint64_t length = used - QueueFile_HEADER_LENGTH;
+  if (from + length > qf->fileLength) return; // wrapped
+  uint64_t to = from;
+  if (from + length > newLength) {
+    to = QueueFile_HEADER_LENGTH;
+    if (to + length > from || length > QueueFile_SHRINK_COPY_LIMIT ||
+        !FileIo_transferTo(qf->file, from, to, length)) {
+      return;
+    }
+  }
+
+  // Commit the shrink, then give the space back.
+  uint64_t firstPosition = qf->first->position - from + to;
+  uint64_t lastPosition = qf->last->position - from + to;
+  if (!QueueFile_writeHeader(qf, newLength, qf->elementCount, firstPosition,
+                             lastPosition)) {
+    return;
+  }
+  if (to != from) {
+    qf->first->position = firstPosition;
+    qf->last->position = lastPosition;
+    QueueFile_relocated(qf, from, length, to);
+  }
+  qf->fileLength = newLength;
+  // The header no longer refers to the rest, a failed truncate only wastes it.
+  if (!FileIo_setLength(qf->file, newLength)) {
+    LOG(LWARN, "Error truncating queue file to %" PRIu64, newLength);
+  }
+}
+
+/**
+ * Returns a copy of the data of an element for QueueFile_peek and
+ * QueueFile_get, or NULL on error.
+ * @param returnedLength set to its length.
+ */
+static byte* QueueFile_copyElement(QueueFile* qf, const Element* element,
+                                   uint32_t* returnedLength) {
+  uint8_t codec;
+  uint32_t length;
+  if (!QueueFile_readEncoding(qf, element, &codec, &length)) return NULL;
+  byte* data = QueueFile_allocate(qf, (size_t) length);
+  if (!CHECKOOM(data) &&
+      !QueueFile_readData(qf, element, codec, data, length)) {
+    QueueFile_deallocate(qf, data);
+    data = NULL;
+  }
+  if (data != NULL) *returnedLength = length;
+  return data;
+}
+
+// see description in queuefile.h.
+byte* QueueFile_peek(QueueFile* qf, uint32_t* returnedLength) {
+  if (NULLARG(qf) || NULLARG(returnedLength)) return NULL;
+  QueueFile_lock(qf);
+  *returnedLength = 0;
+  // Checked under lock, a concurrent remove may have drained the queue.
+  if (qf->elementCount == 0) {
+    QueueFile_unlock(qf);
+    return NULL;
+  }
+
+  byte* data = QueueFile_copyElement(qf, qf->first, returnedLength);
+
+  QueueFile_unlock(qf);
+  return data;
+}
+
+// see description in queuefile.h.
+void QueueFile_freeBuffer(QueueFile* qf, void* buffer) {
+  if (NULLARG(qf)) return;
+  QueueFile_deallocate(qf, buffer);
+}
+
+// see description in queuefile.h.
+uint32_t QueueFile_peekSize(QueueFile* qf) {
+  if (NULLARG(qf)) return 0;
+  QueueFile_lock(qf);
+  uint8_t codec;
+  uint32_t length = 0;
+  if (qf->elementCount > 0 &&
+      !QueueFile_readEncoding(qf, qf->first, &codec, &length)) {
+    length = 0;
+  }
+  QueueFile_unlock(qf);
+  return length;
+}
+
+/**
+ * Copies the data of an element into buffer for QueueFile_peekInto and
+ * QueueFile_peekAt.
+ */
+static QueueFile_PeekStatus QueueFile_peekElement(QueueFile* qf,
+                                                  const Element* element,
+                                                  byte* buffer,
+                                                  uint32_t capacity,
+                                                  uint32_t* length) {
+  uint8_t codec;
+  if (!QueueFile_readEncoding(qf, element, &codec, length)) {
+    *length = 0;
+    return QueueFile_PEEK_ERROR;
+  }
+  if (*length > capacity) return QueueFile_PEEK_TOO_SMALL;
+  if (*length == 0) return QueueFile_PEEK_OK;
+  if (NULLARG(buffer) ||
+      !QueueFile_readData(qf, element, codec, buffer, *length)) {
+    return QueueFile_PEEK_ERROR;
+  }
+  return QueueFile_PEEK_OK;
+}
+
+// see description in queuefile.h.
+QueueFile_PeekStatus QueueFile_peekInto(QueueFile* qf, byte* buffer,
+                                        uint32_t capacity, uint32_t* length) {
+  if (NULLARG(qf) || NULLARG(length)) return QueueFile_PEEK_ERROR;
+  QueueFile_lock(qf);
+
+  QueueFile_PeekStatus status;
+  *length = 0;
+  if (qf->elementCount == 0) {
+    status = QueueFile_PEEK_EMPTY;
+  } else {
+    status = QueueFile_peekElement(qf, qf->first, buffer, capacity, length);
+  }
+
+  QueueFile_unlock(qf);
+  return status;
+}
+
+/**
+ * Reads the elements from element, the n-th eldest, into batch for
+ * QueueFile_peekBatch and QueueFile_peekBatchAt. Must hold the lock.
+ */
+static bool QueueFile_readBatch(QueueFile* qf, const Element* element,
+                                uint32_t n, uint32_t maxCount,
+                                uint32_t maxBytes, QueueFile_Batch* batch) {
+  // The elements from this one up to the tail are contiguous in the ring,
+  // read as much of them as fits with one read (two if it wraps).
+  uint64_t used = QueueFile_distanceToLast(qf, element->position) +
+                  Element_HEADER_LENGTH + qf->last->length;
+  uint32_t count = used < maxBytes ? (uint32_t) used : maxBytes;
+  if (!QueueFile_ringRead(qf, element->position, batch->buffer, 0, count)) {
+    return false;
+  }
+  uint32_t offset = 0;
+  while (batch->count < maxCount && batch->count < qf->elementCount - n &&
+         count - offset >= Element_HEADER_LENGTH) {
+    uint32_t length = readInt(batch->buffer, offset);
+    if (length > count - offset - Element_HEADER_LENGTH) break;
+    QueueFile_Segment* segment = &batch->elements[batch->count++];
+    segment->data = batch->buffer + offset + Element_HEADER_LENGTH;
+    segment->length = length;
+    offset += Element_HEADER_LENGTH + length;
+  }
+  batch->bytes = offset;
+  return true;
+}
+
+// see description in queuefile.h.
+bool QueueFile_peekBatch(QueueFile* qf, uint32_t maxCount, uint32_t maxBytes,
+                         QueueFile_Batch* batch) {
+  return QueueFile_peekBatchAt(qf, 0, maxCount, maxBytes, batch);
+}
+
+// see description in queuefile.h.
+bool QueueFile_peekBatchAt(QueueFile* qf, uint32_t n, uint32_t maxCount,
+                           uint32_t maxBytes, QueueFile_Batch* batch) {
+  if (NULLARG(qf) || NULLARG(batch) || NULLARG(batch->buffer) ||
+      NULLARG(batch->elements)) {
+    return false;
+  }
+  batch->count = 0;
+  batch->bytes = 0;
+  QueueFile_lock(qf);
+
+  bool success = !QueueFile_isCompressed(qf, "Batches are");
+  if (success && n < qf->elementCount && maxCount > 0) {
+    Element element;
+    success = QueueFile_locate(qf, n, &element) &&
+              QueueFile_readBatch(qf, &element, n, maxCount, maxBytes, batch);
+  }
+
+  QueueFile_unlock(qf);
+  return success;
+}
+
+/** Sets up a stream over the data of the element at position. */
+static void QueueFile_initStream(QueueFile_ElementStream* stream,
+                                 QueueFile* qf, uint64_t position,
+                                 uint32_t length) {
+  stream->qf = qf;
+  stream->position = QueueFile_wrapPosition(qf, position +
+                                            Element_HEADER_LENGTH);
+  stream->remaining = length;
+  stream->next = NULL;
+  stream->buffered = 0;
+}
+
+/** Copies up to length buffered bytes, returns the number copied. */
+static uint32_t QueueFile_readBuffered(QueueFile_ElementStream* stream,
+                                       byte* buffer, uint32_t length) {
+  uint32_t count = length < stream->buffered ? length : stream->buffered;
+  if (count > 0) {
+    memcpy(buffer, stream->next, (size_t) count);
+    stream->next += count;
+    stream->buffered -= count;
+    stream->remaining -= count;
+  }
+  return count;
+}
+
+// see description in queuefile.h.
+bool QueueFile_readElementStream(QueueFile_ElementStream* stream, byte* buffer,
+                                 uint32_t length, uint32_t* lengthRemaining) {
+  if (NULLARG(stream) || NULLARG(buffer) || NULLARG(stream->qf)) return false;
+  if (length > stream->remaining) length = stream->remaining;
+  uint32_t copied = QueueFile_readBuffered(stream, buffer, length);
+
+  bool success = true;
+  if (copied < length) {
+    // The buffer is drained. Snapshot streams are read without holding the
+    // lock between reads.
+    QueueFile* qf = stream->qf;
+    uint32_t wanted = length - copied;
+    QueueFile_lock(qf);
+    if (wanted >= QueueFile_STREAM_BUFFER_LENGTH) {
+      // Large reads go to the caller's buffer directly.
+      success = QueueFile_ringRead(qf, stream->position, buffer, copied,
+                                   wanted);
+      if (success) {
+        stream->position = QueueFile_wrapPosition(qf, stream->position +
+                                                  wanted);
+        stream->remaining -= wanted;
+      }
+    } else {
+      uint32_t fill = stream->remaining < QueueFile_STREAM_BUFFER_LENGTH ?
+                      stream->remaining : QueueFile_STREAM_BUFFER_LENGTH;
+      success = QueueFile_ringRead(qf, stream->position, stream->buffer, 0,
+                                   fill);
+      if (success) {
+        stream->position = QueueFile_wrapPosition(qf, stream->position + fill);
+        stream->next = stream->buffer;
+        stream->buffered = fill;
+        QueueFile_readBuffered(stream, buffer + copied, wanted);
+      }
+    }
+    QueueFile_unlock(qf);
+  }
+  if (lengthRemaining != NULL) *lengthRemaining = stream->remaining;
+  return success;
+}
+
+// see description in queuefile.h.
+int QueueFile_readElementStreamNextByte(QueueFile_ElementStream* stream) {
+  byte buffer = 0;
+  uint32_t remaining;
+  if (NULLARG(stream) || stream->remaining == 0) {
+    return -1;
+  }
+  if (stream->buffered > 0) {
+    stream->buffered--;
+    stream->remaining--;
+    return (int) *stream->next++;
+  }
+  if (!QueueFile_readElementStream(stream, &buffer, (uint32_t) sizeof(byte),
+                                  &remaining)) {
+    return -1;
+  }
+  return (int)buffer;
+}
+
+// see description in queuefile.h.
+bool QueueFile_peekWithElementReader(QueueFile* qf,
+                                     QueueFile_ElementReaderFunc reader) {
+  if (NULLARG(reader) || NULLARG(qf)) return false;
+  QueueFile_lock(qf);
+
+  bool success = false;
+  if (qf->elementCount == 0) {
+    success = true;
+  } else {
+    if (qf->first == NULL) {
+      LOG(LFATAL, "Internal error: queue should have a first element.");
+    } else {
+      Element current;
+      QueueFile_ElementStream stream;
+      byte* inflated;
+      if (QueueFile_readElement(qf, qf->first->position, &current) &&
+          QueueFile_initDecodedStream(&stream, qf, &current, &inflated)) {
+        (*reader)(&stream, stream.remaining);
+        QueueFile_deallocate(qf, inflated);
+        success = true;
+      }
+    }
+  }
+  
+  QueueFile_unlock(qf);
+  return success;
+}
+
+/**
+ * Reads the elements of the ring through a window of
+ * QueueFile_SCAN_WINDOW_LENGTH bytes, so that element headers and small
+ * elements are decoded from memory. Used by QueueFile_forEach and
+ * QueueFile_forEachBatch.
+ */
+typedef struct {
+  QueueFile* qf;
+  byte* window;
+  /** Ring bytes from the first element to the end of the last one. */
+  uint64_t used;
+  /** Offsets below are counted in ring bytes from the first element. */
+  uint64_t windowStart;
+  uint32_t windowLength;
+  /** Offset of the next element. */
+  uint64_t offset;
+  /** Number of the next element, 0 for the first one. */
+  uint32_t next;
+} QueueFile_Scanner;
+
+static void QueueFile_scanInit(QueueFile_Scanner* scanner, QueueFile* qf,
+                               byte* window) {
+  scanner->qf = qf;
+  scanner->window = window;
+  scanner->used = QueueFile_distanceToLast(qf, qf->first->position) +
+                  Element_HEADER_LENGTH + qf->last->length;
+  scanner->windowStart = 0;
+  scanner->windowLength = 0;
+  scanner->offset = 0;
+  scanner->next = 0;
+}
+
+/** Returns true if the count bytes at the next element are in the window. */
+static bool QueueFile_scanHas(const QueueFile_Scanner* scanner,
+                              uint32_t count) {
+  uint64_t start = scanner->offset - scanner->windowStart;
+  return scanner->offset >= scanner->windowStart &&
+         start <= scanner->windowLength &&
+         count <= scanner->windowLength - start;
+}
+
+/** Returns the position of the next element. */
+static uint64_t QueueFile_scanPosition(const QueueFile_Scanner* scanner) {
+  return QueueFile_wrapPosition(scanner->qf, scanner->qf->first->position +
+                                scanner->offset);
+}
+
+/** Returns the address of byte offset of the next element in the window. */
+static const byte* QueueFile_scanAddress(const QueueFile_Scanner* scanner,
+                                         uint32_t offset) {
+  return scanner->window + scanner->offset - scanner->windowStart + offset;
+}
+
+/** Moves the window to start at the next element. */
+static bool QueueFile_scanFill(QueueFile_Scanner* scanner) {
+  uint64_t left = scanner->used - scanner->offset;
+  scanner->windowStart = scanner->offset;
+  scanner->windowLength = left < QueueFile_SCAN_WINDOW_LENGTH ?
+                          (uint32_t) left : QueueFile_SCAN_WINDOW_LENGTH;
+  return scanner->windowLength >= Element_HEADER_LENGTH &&
+         QueueFile_ringRead(scanner->qf, QueueFile_scanPosition(scanner),
+                            scanner->window, 0, scanner->windowLength);
+}
+
+/**
+ * Reads the length of the next element, from the window if the header is in
+ * it, else the window is moved first.
+ */
+static bool QueueFile_scanLength(QueueFile_Scanner* scanner,
+                                 uint32_t* length) {
+  if (!QueueFile_scanHas(scanner, Element_HEADER_LENGTH) &&
+      !QueueFile_scanFill(scanner)) {
+    return false;
+  }
+  *length = QueueFile_storedLength(scanner->qf,
+                                   readInt((byte*) QueueFile_scanAddress(
+                                       scanner, 0), 0));
+  return true;
+}
+
+/** Skips the next element, indexing it if it's the next one missing. */
+static void QueueFile_scanAdvance(QueueFile_Scanner* scanner,
+                                  uint32_t length) {
+  QueueFile* qf = scanner->qf;
+  if (scanner->next == qf->index.count) {
+    ElementIndex_append(&qf->index, QueueFile_scanPosition(scanner), length);
+  }
+  scanner->offset += Element_HEADER_LENGTH + length;
+  scanner->next++;
+}
+
+/**
+ * Takes the scan window of the queue, or allocates one if a scan is already
+ * running (forEach called from a callback) or it can't be kept.
+ * @return NULL if out of memory.
+ */
+static byte* QueueFile_beginScan(QueueFile* qf) {
+  if (qf->scanWindow == NULL) {
+    // Kept until the queue is closed.
+    qf->scanWindow = QueueFile_allocate(qf, QueueFile_SCAN_WINDOW_LENGTH);
+  }
+  if (qf->scanWindow != NULL && !qf->scanning) {
+    qf->scanning = true;
+    return qf->scanWindow;
+  }
+  return QueueFile_allocate(qf, QueueFile_SCAN_WINDOW_LENGTH);
+}
+
+/** Gives back a window from QueueFile_beginScan. */
+static void QueueFile_endScan(QueueFile* qf, byte* window) {
+  if (window == qf->scanWindow) {
+    qf->scanning = false;
+  } else {
+    QueueFile_deallocate(qf, window);
+  }
+}
+
+/**
+ * Calls the reader for all elements. Elements which lie entirely within the
+ * window are streamed from it.
+ * @return false if an error occurred.
+ */
+static bool QueueFile_scan(QueueFile* qf, byte* window,
+                           QueueFile_ElementReaderFunc reader) {
+  QueueFile_Scanner scanner;
+  QueueFile_scanInit(&scanner, qf, window);
+  bool stopRequested = false;
+  while (scanner.next < qf->elementCount && !stopRequested) {
+    uint32_t length;
+    if (!QueueFile_scanLength(&scanner, &length)) return false;
+    uint32_t elementLength = Element_HEADER_LENGTH + length;
+    if (!QueueFile_scanHas(&scanner, elementLength) &&
+        elementLength <= QueueFile_SCAN_WINDOW_LENGTH &&
+        !QueueFile_scanFill(&scanner)) {
+      return false;
+    }
+
+    QueueFile_ElementStream stream;
+    byte* inflated = NULL;
+    if (qf->compressed) {
+      Element element = { QueueFile_scanPosition(&scanner), length };
+      if (!QueueFile_initDecodedStream(&stream, qf, &element, &inflated)) {
+        return false;
+      }
+    } else {
+      QueueFile_initStream(&stream, qf, QueueFile_scanPosition(&scanner),
+                           length);
+      if (QueueFile_scanHas(&scanner, elementLength)) {
+        // Nothing left to read from the file.
+        stream.position = QueueFile_wrapPosition(qf, stream.position + length);
+        stream.next = QueueFile_scanAddress(&scanner, Element_HEADER_LENGTH);
+        stream.buffered = length;
+      }
+    }
+    stopRequested = !(*reader)(&stream, stream.remaining);
+    QueueFile_deallocate(qf, inflated);
+    QueueFile_scanAdvance(&scanner, length);
+  }
+  return true;
+}
+
+// see description in queuefile.h.
+bool QueueFile_forEach(QueueFile* qf, QueueFile_ElementReaderFunc reader) {
+  if (NULLARG(reader) || NULLARG(qf)) return false;
+  QueueFile_lock(qf);
+
+  bool success = false;
+  if (qf->elementCount == 0) {
+    success = true;
+  } else {
+    // Without a window elements are read one by one.
+    byte* window = QueueFile_beginScan(qf);
+    if (qf->first == NULL) {
+      LOG(LFATAL, "Internal error: queue should have a first element.");
+    } else if (window != NULL) {
+      success = QueueFile_scan(qf, window, reader);
+    } else {
+      Element current;
+      uint32_t i;
+      bool stopRequested = false;
+      success = QueueFile_locate(qf, 0, &current);
+      for (i = 0; i < qf->elementCount && !stopRequested && success; i++) {
+        QueueFile_ElementStream stream;
+        byte* inflated;
+        if ((i == 0 || QueueFile_nextElement(qf, i, &current)) &&
+            QueueFile_initDecodedStream(&stream, qf, &current, &inflated)) {
+          stopRequested = !(*reader)(&stream, stream.remaining);
+          QueueFile_deallocate(qf, inflated);
+        } else {
+          success = false;
+        }
+      }
+    }
+    if (window != NULL) QueueFile_endScan(qf, window);
+  }
+  
+  QueueFile_unlock(qf);
+  return success;
+}
+
+// see description in queuefile.h.
+bool QueueFile_forEachBatch(QueueFile* qf, QueueFile_Segment* elements,
+                            uint32_t maxElements,
+                            QueueFile_BatchReaderFunc reader, void* context) {
+  if (NULLARG(qf) || NULLARG(elements) || NULLARG(reader)) return false;
+  if (maxElements == 0) {
+    LOG(LWARN, "maxElements must be > 0");
+    return false;
+  }
+  QueueFile_lock(qf);
+  bool compressed = QueueFile_isCompressed(qf, "Batches are");
+  if (qf->elementCount == 0 || compressed) {
+    QueueFile_unlock(qf);
+    return !compressed;
+  }
+  byte* window = QueueFile_beginScan(qf);
+  if (CHECKOOM(window)) {
+    QueueFile_unlock(qf);
+    return false;
+  }
+
+  QueueFile_Scanner scanner;
+  QueueFile_scanInit(&scanner, qf, window);
+  bool success = true;
+  bool stopRequested = false;
+  uint32_t count = 0;
+  while (success && !stopRequested) {
+    bool done = scanner.next == qf->elementCount;
+    uint32_t length = 0;
+    uint32_t elementLength = 0;
+    if (!done) {
+      // The views point into the window, they're passed on before it moves.
+      bool fits = QueueFile_scanHas(&scanner, Element_HEADER_LENGTH);
+      if (fits) {
+        length = readInt((byte*) QueueFile_scanAddress(&scanner, 0), 0);
+        elementLength = Element_HEADER_LENGTH + length;
+        fits = QueueFile_scanHas(&scanner, elementLength);
+      }
+      if (fits && count < maxElements) {
+        elements[count].data = QueueFile_scanAddress(&scanner,
+                                                     Element_HEADER_LENGTH);
+        elements[count].length = length;
+        count++;
+        QueueFile_scanAdvance(&scanner, length);
+        continue;
+      }
+    }
+    if (count > 0) {
+      stopRequested = !(*reader)(context, elements, count);
+      count = 0;
+      continue;
+    }
+    if (done) break;
+
+    success = QueueFile_scanLength(&scanner, &length);
+    elementLength = Element_HEADER_LENGTH + length;
+    if (!success || QueueFile_scanHas(&scanner, elementLength)) continue;
+    if (elementLength <= QueueFile_SCAN_WINDOW_LENGTH) {
+      success = QueueFile_scanFill(&scanner);
+    } else {
+      // Too large for the window, passed on its own in a buffer of its own.
+      byte* data = QueueFile_allocate(qf, (size_t) length);
+      success = !CHECKOOM(data) &&
+                QueueFile_ringRead(qf, QueueFile_scanPosition(&scanner) +
+                                   Element_HEADER_LENGTH, data, 0, length);
+      if (success) {
+        elements[0].data = data;
+        elements[0].length = length;
+        stopRequested = !(*reader)(context, elements, 1);
+        QueueFile_scanAdvance(&scanner, length);
+      }
+      QueueFile_deallocate(qf, data);
+    }
+  }
+
+  QueueFile_endScan(qf, window);
+  QueueFile_unlock(qf);
+  return success;
 }
 
 /**
- * If necessary, expands the file to accommodate an additional element of the
- * given length.
- *
- * @param dataLength length of data being added
- * @returns false only if an error was encountered.
+ * Makes sure qf->mapping covers the whole file. A mapping that is too short is
+ * retired if a view may point into it.
  */
-static bool QueueFile_expandIfNecessary(QueueFile* qf, uint32_t dataLength) {
-  uint32_t elementLength = Element_HEADER_LENGTH + dataLength;
-  uint32_t remainingBytes = QueueFile_remainingBytes(qf);
-  if (remainingBytes >= elementLength) {
+static bool QueueFile_mapFile(QueueFile* qf) {
+  if (qf->mapping != NULL && qf->mapping->length >= qf->fileLength) {
     return true;
   }
+  QueueFile_Mapping* mapping = QueueFile_allocate(qf,
+                                                 sizeof(QueueFile_Mapping));
+  if (CHECKOOM(mapping)) return false;
+  void* address = mmap(NULL, (size_t) qf->fileLength, PROT_READ, MAP_SHARED,
+                       fileno(qf->file), 0);
+  if (address == MAP_FAILED) {
+    LOG(LWARN, "Error mapping queue file, fhandle %d", fileno(qf->file));
+    QueueFile_deallocate(qf, mapping);
+    return false;
+  }
+  mapping->address = address;
+  mapping->length = qf->fileLength;
+  mapping->next = NULL;
+
+  QueueFile_Mapping* old = qf->mapping;
+  if (old != NULL) {
+    if (qf->viewActive) {
+      old->next = qf->retiredMappings;
+      qf->retiredMappings = old;
+    } else {
+      munmap(old->address, old->length);
+      QueueFile_deallocate(qf, old);
+    }
+  }
+  qf->mapping = mapping;
+  return true;
+}
 
-  // Expand.
-  uint32_t previousLength = qf->fileLength;
-  uint32_t newLength;
-
-  // Double the length until we can fit the new data.
-  do {
-    remainingBytes += previousLength;
-    newLength = previousLength << 1;
-    previousLength = newLength;
-  } while (remainingBytes < elementLength);
+/** Called when the first element is removed, which invalidates views. */
+static void QueueFile_endView(QueueFile* qf) {
+  qf->viewActive = false;
+  while (qf->retiredMappings != NULL) {
+    QueueFile_Mapping* retired = qf->retiredMappings;
+    qf->retiredMappings = retired->next;
+    munmap(retired->address, retired->length);
+    QueueFile_deallocate(qf, retired);
+  }
+}
 
-  // TODO(jochen): if truncate in setLength does not work for target platform,
-  //  consider appending 0s using FileIo_writeZeros.
-  if (!FileIo_setLength(qf->file, newLength)) {
+// see description in queuefile.h.
+bool QueueFile_peekView(QueueFile* qf, QueueFile_View* view) {
+  if (NULLARG(qf) || NULLARG(view)) return false;
+  if (qf->shared != NULL) {
+    // Other processes may remove and overwrite the element at any time.
+    LOG(LWARN, "Views are not supported in shared mode");
     return false;
   }
-
-  // Calculate the position of the tail end of the data in the ring buffer
-  uint32_t endOfLastElement = QueueFile_wrapPosition(qf, qf->last->position +
-                                                     Element_HEADER_LENGTH +
-                                                     qf->last->length);
-
-  // If the buffer is split, we need to make it contiguous, so append the
-  // tail of the queue to after the end of the old file.
-  if (endOfLastElement < qf->first->position) {
-    uint32_t count = endOfLastElement - Element_HEADER_LENGTH;
-    if (!FileIo_transferTo(qf->file, QueueFile_HEADER_LENGTH,
-                          qf->fileLength, count)) {
-      return false;
-    }
+  if (qf->segments.segmentLength > 0) {
+    // Elements may span segments, there is no one mapping to view them in.
+    LOG(LWARN, "Views are not supported on segmented queues");
+    return false;
   }
+  memset(view, 0, sizeof(QueueFile_View));
 
-  // Commit the expansion.
-  if (qf->last->position < qf->first->position) {
-    uint32_t newLastPosition = qf->fileLength + qf->last->position -
-                               QueueFile_HEADER_LENGTH;
-    if (!QueueFile_writeHeader(qf, newLength, qf->elementCount,
-                               qf->first->position, newLastPosition)) {
-      return false;
-    }
-    if (!freeAndAssignNonNull(&qf->last,
-                             Element_new(newLastPosition, qf->last->length))) {
-      return false;
-    }
-  } else {
-    if (!QueueFile_writeHeader(qf, newLength, qf->elementCount,
-                              qf->first->position, qf->last->position)) {
-      return false;
+  QueueFile_lock(qf);
+  bool success = false;
+  // Views point straight into the file, where the front must be by now.
+  if (qf->elementCount > 0 && !QueueFile_isCompressed(qf, "Views are") &&
+      QueueFile_finishRelocation(qf) &&
+      QueueFile_mapFile(qf)) {
+    uint64_t start = QueueFile_wrapPosition(qf, qf->first->position +
+                                            Element_HEADER_LENGTH);
+    uint32_t length = qf->first->length;
+    uint64_t untilEnd = qf->fileLength - start;
+    view->length = length;
+    view->segments[0].data = qf->mapping->address + start;
+    if (length <= untilEnd) {
+      view->segmentCount = 1;
+      view->segments[0].length = length;
+    } else {
+      // Same split as QueueFile_ringRead.
+      view->segmentCount = 2;
+      view->segments[0].length = (uint32_t) untilEnd;
+      view->segments[1].data = qf->mapping->address + QueueFile_HEADER_LENGTH;
+      view->segments[1].length = (uint32_t) (length - untilEnd);
     }
+    qf->viewActive = true;
+    success = true;
   }
-  qf->fileLength = newLength;
-  return true;
+  QueueFile_unlock(qf);
+  return success;
 }
 
 // see description in queuefile.h.
-byte* QueueFile_peek(QueueFile* qf, uint32_t* returnedLength) {
-  if (NULLARG(qf) || NULLARG(returnedLength) || QueueFile_isEmpty(qf)) return NULL;
-  pthread_mutex_lock(&qf->mutex);
-  *returnedLength = 0;
+void QueueFile_releaseView(QueueFile* qf) {
+  if (NULLARG(qf)) return;
+  QueueFile_lock(qf);
+  QueueFile_endView(qf);
+  QueueFile_unlock(qf);
+}
 
-  uint32_t length = qf->first->length;
-  byte* data = malloc((size_t) length);
-  if (CHECKOOM(data)) return NULL;
-  if (!QueueFile_ringRead(qf, qf->first->position + Element_HEADER_LENGTH,
-                         data, 0, length)) {
-    free(data);
-    data = NULL;
+// see description in queuefile.h.
+QueueFile_Snapshot* QueueFile_snapshot(QueueFile* qf) {
+  if (NULLARG(qf)) return NULL;
+  if (qf->shared != NULL) {
+    // Pins are per process, other processes would overwrite the data.
+    LOG(LWARN, "Snapshots are not supported in shared mode");
+    return NULL;
+  }
+  QueueFile_Snapshot* snapshot = QueueFile_allocate(qf,
+                                                   sizeof(QueueFile_Snapshot));
+  if (CHECKOOM(snapshot)) return NULL;
+  memset(snapshot, 0, sizeof(QueueFile_Snapshot));
+  snapshot->qf = qf;
+
+  QueueFile_lock(qf);
+  if (qf->elementCount > 0) {
+    snapshot->position = qf->first->position;
+    snapshot->remaining = qf->elementCount;
   }
-  *returnedLength = length;
+  snapshot->next = qf->snapshots;
+  qf->snapshots = snapshot;
+  QueueFile_unlock(qf);
+  return snapshot;
+}
 
-  pthread_mutex_unlock(&qf->mutex);
-  return data;
+// see description in queuefile.h.
+uint32_t QueueFile_snapshotRemaining(QueueFile_Snapshot* snapshot) {
+  if (NULLARG(snapshot)) return 0;
+  QueueFile_lock(snapshot->qf);
+  uint32_t remaining = snapshot->remaining;
+  QueueFile_unlock(snapshot->qf);
+  return remaining;
 }
 
+/**
+ * Reads the next element of a snapshot and calls the reader for it. The lock
+ * is only held to read the element header, not while the reader runs; the
+ * element stays pinned until the reader returns.
+ * @param readerResult set to what the reader returned.
+ * @return false if the snapshot is exhausted or an error occurred.
+ */
+static bool QueueFile_snapshotRead(QueueFile_Snapshot* snapshot,
+                                   QueueFile_ElementReaderFunc reader,
+                                   bool* readerResult) {
+  QueueFile* qf = snapshot->qf;
+
+  QueueFile_lock(qf);
+  Element element;
+  byte* inflated = NULL;
+  bool success = snapshot->remaining > 0 &&
+                 QueueFile_readElement(qf, snapshot->position, &element) &&
+                 QueueFile_initDecodedStream(&snapshot->stream, qf, &element,
+                                             &inflated);
+  if (success) snapshot->streamActive = true;
+  QueueFile_unlock(qf);
+  if (!success) return false;
+
+  *readerResult = (*reader)(&snapshot->stream, snapshot->stream.remaining);
+
+  QueueFile_lock(qf);
+  snapshot->streamActive = false;
+  QueueFile_deallocate(qf, inflated);
+  snapshot->position = QueueFile_wrapPosition(qf, snapshot->position +
+                                              Element_HEADER_LENGTH +
+                                              element.length);
+  --snapshot->remaining;
+  QueueFile_unlock(qf);
+  return true;
+}
 
-struct _QueueFile_ElementStream {
-  QueueFile* qf;
-  uint32_t position;
-  uint32_t remaining;
-};
+// see description in queuefile.h.
+bool QueueFile_snapshotNext(QueueFile_Snapshot* snapshot,
+                            QueueFile_ElementReaderFunc reader) {
+  if (NULLARG(snapshot) || NULLARG(reader)) return false;
+  bool readerResult;
+  return QueueFile_snapshotRead(snapshot, reader, &readerResult);
+}
 
 // see description in queuefile.h.
-bool QueueFile_readElementStream(QueueFile_ElementStream* stream, byte* buffer,
-                                 uint32_t length, uint32_t* lengthRemaining) {
-  if (NULLARG(stream) || NULLARG(buffer) || NULLARG(lengthRemaining) ||
-      NULLARG(stream->qf)) return false;
-  *lengthRemaining = 0;
-  if (stream->remaining == 0) {
-    return true;
-  }
-  if (length > stream->remaining) length = stream->remaining;
-  if (QueueFile_ringRead(stream->qf, stream->position, buffer, 0, length)) {
-    stream->position = QueueFile_wrapPosition(stream->qf,
-                                              stream->position + length);
-    stream->remaining -= length;
-    *lengthRemaining = stream->remaining;
-  } else {
-    return false;
+bool QueueFile_snapshotRelease(QueueFile_Snapshot* snapshot) {
+  if (NULLARG(snapshot)) return false;
+  QueueFile* qf = snapshot->qf;
+  bool success = true;
+
+  QueueFile_lock(qf);
+  QueueFile_Snapshot** link = &qf->snapshots;
+  while (*link != NULL && *link != snapshot) link = &(*link)->next;
+  if (*link != NULL) *link = snapshot->next;
+  // If the queue was drained while pinned, do the reset clear skipped.
+  if (qf->elementCount == 0 && qf->last != NULL && !QueueFile_isPinned(qf)) {
+    success = QueueFile_clear(qf);
   }
-  return true;
+  QueueFile_unlock(qf);
+
+  QueueFile_deallocate(qf, snapshot);
+  return success;
 }
 
 // see description in queuefile.h.
-int QueueFile_readElementStreamNextByte(QueueFile_ElementStream* stream) {
-  byte buffer;
-  uint32_t remaining;
-  if (stream->remaining == 0) {
-    return -1;
-  }
-  if (!QueueFile_readElementStream(stream, &buffer, (uint32_t) sizeof(byte),
-                                  &remaining)) {
-    return -1;
+bool QueueFile_forEachSnapshot(QueueFile* qf,
+                               QueueFile_ElementReaderFunc reader) {
+  if (NULLARG(reader) || NULLARG(qf)) return false;
+  QueueFile_Snapshot* snapshot = QueueFile_snapshot(qf);
+  if (snapshot == NULL) return false;
+
+  bool success = true;
+  bool keepGoing = true;
+  while (keepGoing && success && snapshot->remaining > 0) {
+    success = QueueFile_snapshotRead(snapshot, reader, &keepGoing);
   }
-  return (int)buffer;
+
+  return QueueFile_snapshotRelease(snapshot) && success;
 }
 
 // see description in queuefile.h.
-bool QueueFile_peekWithElementReader(QueueFile* qf,
-                                     QueueFile_ElementReaderFunc reader) {
-  if (NULLARG(reader) || NULLARG(qf)) return false;
-  pthread_mutex_lock(&qf->mutex);
+uint32_t QueueFile_size(QueueFile* qf) {
+  if (NULLARG(qf)) return 0;
+  QueueFile_lock(qf);
+  uint32_t elementCount = qf->elementCount;
+  QueueFile_unlock(qf);
+  return elementCount;
+}
+
+// see description in queuefile.h.
+bool QueueFile_remove(QueueFile* qf) {
+  if (NULLARG(qf)) return false;
+  QueueFile_lock(qf);
 
   bool success = false;
-  if (qf->elementCount == 0) {
-    success = true;
-  } else {
-    if (qf->first == NULL) {
-      LOG(LFATAL, "Internal error: queue should have a first element.");
+  if (!QueueFile_isEmpty(qf)) {
+    if (qf->elementCount == 1) {
+      success = QueueFile_clear(qf);
     } else {
-      Element* current = QueueFile_readElement(qf, qf->first->position);
-      if (current != NULL) {
-        QueueFile_ElementStream stream;
-        stream.qf = qf;
-        stream.position = QueueFile_wrapPosition(qf, current->position +
-                                                 Element_HEADER_LENGTH);
-        stream.remaining = current->length;
-        free(current);
-        (*reader)(&stream, stream.remaining);
+      // assert elementCount > 1
+      Element newFirst;
+      if (QueueFile_locate(qf, 1, &newFirst) &&
+          QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount - 1,
+                                newFirst.position, qf->last->position)) {
+        QueueFile_setFirst(qf, newFirst.position, newFirst.length);
+        --qf->elementCount;
+        ElementIndex_removeFirst(&qf->index, 1);
+        QueueFile_sparseRemoveFirst(qf, 1);
+        QueueFile_endView(qf);
+        QueueFile_trimSegments(qf, false);
+        QueueFile_shrinkIfNecessary(qf);
+        QueueFile_relocateStep(qf, qf->options.expansionStepBytes);
+        QueueFile_notifyChanged(qf);
         success = true;
       }
     }
   }
-  
-  pthread_mutex_unlock(&qf->mutex);
+
+  QueueFile_unlock(qf);
   return success;
 }
 
 // see description in queuefile.h.
-bool QueueFile_forEach(QueueFile* qf, QueueFile_ElementReaderFunc reader) {
-  if (NULLARG(reader) || NULLARG(qf)) return false;
-  pthread_mutex_lock(&qf->mutex);
+bool QueueFile_removeN(QueueFile* qf, uint32_t n) {
+  if (NULLARG(qf)) return false;
+  QueueFile_lock(qf);
 
   bool success = false;
-  if (qf->elementCount == 0) {
+  if (n == 0) {
     success = true;
+  } else if (n > qf->elementCount) {
+    LOG(LINFO, "Can't remove %d elements, only %d queued", n,
+        qf->elementCount);
+  } else if (n == qf->elementCount) {
+    success = QueueFile_clear(qf);
   } else {
-    if (qf->first == NULL) {
-      LOG(LFATAL, "Internal error: queue should have a first element.");
-    } else {
-      uint32_t nextReadPosition = qf->first->position;
-      uint32_t i;
-      bool stopRequested = false;
+    // Walks the element headers up to the new first element, unless indexed.
+    Element newFirst;
+    if (QueueFile_locate(qf, n, &newFirst) &&
+        QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount - n,
+                              newFirst.position, qf->last->position)) {
+      QueueFile_setFirst(qf, newFirst.position, newFirst.length);
+      qf->elementCount -= n;
+      ElementIndex_removeFirst(&qf->index, n);
+      QueueFile_sparseRemoveFirst(qf, n);
+      QueueFile_endView(qf);
+      QueueFile_trimSegments(qf, false);
+      QueueFile_shrinkIfNecessary(qf);
+      QueueFile_relocateStep(qf, qf->options.expansionStepBytes);
+      QueueFile_notifyChanged(qf);
       success = true;
-      for (i = 0; i < qf->elementCount && !stopRequested && success; i++) {
-        Element* current = QueueFile_readElement(qf, nextReadPosition);
-        if (current != NULL) {
-          QueueFile_ElementStream stream;
-          stream.qf = qf;
-          stream.position = QueueFile_wrapPosition(qf, current->position +
-                                                   Element_HEADER_LENGTH);
-          stream.remaining = current->length;
-          stopRequested = !(*reader)(&stream, stream.remaining);
-          nextReadPosition = QueueFile_wrapPosition(qf, current->position +
-                                                    Element_HEADER_LENGTH +
-                                                    current->length);
-          free(current);
-        } else {
-          success = false;
-        }
-      }
     }
   }
-  
-  pthread_mutex_unlock(&qf->mutex);
+
+  QueueFile_unlock(qf);
   return success;
 }
 
 // see description in queuefile.h.
-uint32_t QueueFile_size(QueueFile* qf) {
+QueueFile_PeekStatus QueueFile_peekAt(QueueFile* qf, uint32_t n, byte* buffer,
+                                      uint32_t capacity, uint32_t* length) {
+  if (NULLARG(qf) || NULLARG(length)) return QueueFile_PEEK_ERROR;
+  QueueFile_lock(qf);
+
+  QueueFile_PeekStatus status;
+  Element element;
+  *length = 0;
+  if (n >= qf->elementCount) {
+    status = QueueFile_PEEK_EMPTY;
+  } else if (!QueueFile_locate(qf, n, &element)) {
+    status = QueueFile_PEEK_ERROR;
+  } else {
+    status = QueueFile_peekElement(qf, &element, buffer, capacity, length);
+  }
+
+  QueueFile_unlock(qf);
+  return status;
+}
+
+// see description in queuefile.h.
+byte* QueueFile_get(QueueFile* qf, uint32_t n, uint32_t* returnedLength) {
+  if (NULLARG(qf) || NULLARG(returnedLength)) return NULL;
+  QueueFile_lock(qf);
+  *returnedLength = 0;
+  Element element;
+  byte* data = NULL;
+  if (n < qf->elementCount && QueueFile_locate(qf, n, &element)) {
+    data = QueueFile_copyElement(qf, &element, returnedLength);
+  }
+  QueueFile_unlock(qf);
+  return data;
+}
+
+// see description in queuefile.h.
+uint64_t QueueFile_sizeInBytes(QueueFile* qf) {
   if (NULLARG(qf)) return 0;
-  pthread_mutex_lock(&qf->mutex);
-  uint32_t elementCount = qf->elementCount;
-  pthread_mutex_unlock(&qf->mutex);
-  return elementCount;
+  QueueFile_lock(qf);
+  uint64_t size = 0;
+  if (qf->elementCount > 0) {
+    // The elements are contiguous from first to last, minus their headers.
+    size = (uint64_t) QueueFile_distanceToLast(qf, qf->first->position) +
+           Element_HEADER_LENGTH + qf->last->length -
+           (uint64_t) qf->elementCount * Element_HEADER_LENGTH;
+  }
+  QueueFile_unlock(qf);
+  return size;
 }
 
 // see description in queuefile.h.
-bool QueueFile_remove(QueueFile* qf) {
-  if (NULLARG(qf)) return false;
-  pthread_mutex_lock(&qf->mutex);
+bool QueueFile_getIndexStats(QueueFile* qf, QueueFile_IndexStats* stats) {
+  if (NULLARG(qf) || NULLARG(stats)) return false;
+  if (!qf->options.indexed) return false;
+  QueueFile_lock(qf);
+  stats->entries = qf->index.count;
+  stats->capacity = qf->index.capacity;
+  stats->memoryBytes = ElementIndex_memory(&qf->index);
+  QueueFile_unlock(qf);
+  return true;
+}
+
+// see description in queuefile.h.
+bool QueueFile_getCacheStats(QueueFile* qf, QueueFile_CacheStats* stats) {
+  if (NULLARG(qf) || NULLARG(stats)) return false;
+  if (qf->cache.capacity == 0) return false;
+  QueueFile_lock(qf);
+  stats->hits = qf->cache.hits;
+  stats->misses = qf->cache.misses;
+  stats->capacity = qf->cache.capacity;
+  stats->cachedBytes = qf->cache.valid;
+  QueueFile_unlock(qf);
+  return true;
+}
+
+// see description in queuefile.h.
+bool QueueFile_getDropStats(QueueFile* qf, QueueFile_DropStats* stats) {
+  if (NULLARG(qf) || NULLARG(stats)) return false;
+  QueueFile_lock(qf);
+  *stats = qf->dropped;
+  QueueFile_unlock(qf);
+  return true;
+}
 
+// see description in queuefile.h.
+bool QueueFile_clear(QueueFile* qf) {
+  if (NULLARG(qf)) return false;
   bool success = false;
-  if (!QueueFile_isEmpty(qf)) {
-    if (qf->elementCount == 1) {
-      success = QueueFile_clear(qf);
-    } else {
-      // assert elementCount > 1
-      uint32_t newFirstPosition = QueueFile_wrapPosition(qf,
-                                                         qf->first->position +
-                                                         Element_HEADER_LENGTH +
-                                                         qf->first->length);
-      if (QueueFile_ringRead(qf, newFirstPosition, qf->buffer, 0,
-                            Element_HEADER_LENGTH)) {
-        int length = readInt(qf->buffer, 0);
-        if (QueueFile_writeHeader(qf, qf->fileLength, qf->elementCount - 1,
-                                 newFirstPosition, qf->last->position)) {
-          if (freeAndAssignNonNull(&qf->first, Element_new(newFirstPosition,
-                                                          (uint32_t) length))) {
-            --qf->elementCount;
-            success = true;
-          }
+  QueueFile_lock(qf);
+  // Segmented queues free their space by deleting the segments instead. A
+  // file created with a smaller initialLength isn't grown either.
+  uint64_t resetLength = qf->segments.segmentLength > 0 ||
+                         qf->fileLength < qf->options.initialLength ?
+                         qf->fileLength : qf->options.initialLength;
+
+  if (QueueFile_isPinned(qf)) {
+    // Snapshots still read the data, so keep the ring as is and only mark the
+    // queue as empty. The file is reset once the last snapshot is done.
+    if (QueueFile_writeHeader(qf, qf->fileLength, 0, 0, 0)) {
+      qf->elementCount = 0;
+      qf->first = NULL;
+      ElementIndex_clear(&qf->index);
+      QueueFile_sparseClear(qf);
+      QueueFile_endView(qf);
+      QueueFile_trimSegments(qf, false);
+      success = true;
+    }
+  } else {
+    // Nothing is left to read from the front, copied or not.
+    QueueFile_Relocation relocation = qf->relocation;
+    memset(&qf->relocation, 0, sizeof(QueueFile_Relocation));
+    bool compressed = qf->compressed;
+    qf->compressed = false;
+    if (QueueFile_writeHeader(qf, resetLength, 0, 0, 0)) {
+      qf->elementCount = 0;
+      qf->first = NULL;
+      qf->last = NULL;
+      ElementIndex_clear(&qf->index);
+      QueueFile_sparseClear(qf);
+      // The tail moves back to the start of the ring.
+      qf->cache.next = qf->cache.valid = 0;
+      QueueFile_endView(qf);
+      QueueFile_trimSegments(qf, false);
+      if (qf->fileLength > resetLength) {
+        if (FileIo_setLength(qf->file, resetLength)) {
+          qf->fileLength = resetLength;
+          success = true;
         }
+      } else {
+        success = true;
       }
+    } else {
+      qf->relocation = relocation;
+      qf->compressed = compressed;
     }
   }
 
-  pthread_mutex_unlock(&qf->mutex);
+  if (success) QueueFile_notifyChanged(qf);
+  QueueFile_unlock(qf);
   return success;
 }
 
-// see description in queuefile.h.
-bool QueueFile_clear(QueueFile* qf) {
-  if (NULLARG(qf)) return false;
-  bool success = false;
-  pthread_mutex_lock(&qf->mutex);
+// ------------------------------ Shared mode ---------------------------------
+
+
+/**
+ * Opens the control file and takes the flock that tells whether any other
+ * process has the queue open. Every process holds a shared flock while the
+ * queue is open; a process that can get the exclusive flock is the only user
+ * and (re)initializes the shared state, which also discards a mutex left
+ * locked by a process that died while no one else had the queue open.
+ *
+ * @param firstUser set to true if this process holds the exclusive flock,
+ *        QueueFile_attachShared downgrades it.
+ */
+static bool QueueFile_openShared(QueueFile* qf, const char* filename,
+                                 bool* firstUser) {
+  char* controlName = makeFilenameWithSuffix(&qf->options.allocator, filename,
+                                             QueueFile_SHARED_SUFFIX,
+                                             MAX_FILENAME_LEN);
+  if (controlName == NULL) {
+    LOG(LWARN, "Filename too long or out of memory: %s", filename);
+    return false;
+  }
+  qf->sharedFd = open(controlName, O_RDWR | O_CREAT, 0644);
+  if (qf->sharedFd < 0) {
+    LOG(LWARN, "Error opening control file %s", controlName);
+    QueueFile_deallocate(qf, controlName);
+    return false;
+  }
+  QueueFile_deallocate(qf, controlName);
+
+  *firstUser = flock(qf->sharedFd, LOCK_EX | LOCK_NB) == 0;
+  // Blocks while the first user initializes.
+  if (!*firstUser && flock(qf->sharedFd, LOCK_SH) != 0) {
+    LOG(LWARN, "Error locking control file, fhandle %d", qf->sharedFd);
+    return false;
+  }
+  if (ftruncate(qf->sharedFd, (off_t) sizeof(QueueFile_SharedState)) != 0) {
+    LOG(LWARN, "Error sizing control file, fhandle %d", qf->sharedFd);
+    return false;
+  }
+  void* mapped = mmap(NULL, sizeof(QueueFile_SharedState),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, qf->sharedFd, 0);
+  if (mapped == MAP_FAILED) {
+    LOG(LWARN, "Error mapping control file, fhandle %d", qf->sharedFd);
+    return false;
+  }
+  qf->shared = mapped;
+  return true;
+}
+
+/**
+ * Copies the in-memory state to the shared state and wakes waiters.
+ * @param force publish even if nothing seems to have changed.
+ */
+static void QueueFile_publishShared(QueueFile* qf, bool force) {
+  QueueFile_SharedState* shared = qf->shared;
+  uint64_t firstPosition = qf->first == NULL ? 0 : qf->first->position;
+  uint32_t firstLength = qf->first == NULL ? 0 : qf->first->length;
+  uint64_t lastPosition = qf->last == NULL ? 0 : qf->last->position;
+  uint32_t lastLength = qf->last == NULL ? 0 : qf->last->length;
+  if (!force &&
+      shared->fileLength == qf->fileLength &&
+      shared->elementCount == qf->elementCount &&
+      shared->firstPosition == firstPosition &&
+      shared->firstLength == firstLength &&
+      shared->lastPosition == lastPosition &&
+      shared->lastLength == lastLength) {
+    return;
+  }
+  shared->fileLength = qf->fileLength;
+  shared->elementCount = qf->elementCount;
+  shared->firstPosition = firstPosition;
+  shared->firstLength = firstLength;
+  shared->lastPosition = lastPosition;
+  shared->lastLength = lastLength;
+  qf->sharedGeneration = __sync_add_and_fetch(&shared->generation, 1);
+  QueueFile_futexWake(&shared->generation, true);
+}
+
+/** Picks up changes other processes published. */
+static void QueueFile_loadShared(QueueFile* qf) {
+  QueueFile_SharedState* shared = qf->shared;
+  qf->fileLength = shared->fileLength;
+  qf->elementCount = shared->elementCount;
+  QueueFile_setFirst(qf, shared->firstPosition, shared->firstLength);
+  QueueFile_setLast(qf, shared->lastPosition, shared->lastLength);
+  qf->sharedGeneration = shared->generation;
+}
 
-  if (QueueFile_writeHeader(qf, QueueFile_INITIAL_LENGTH, 0, 0, 0)) {
-    qf->elementCount = 0;
-    if (qf->first != NULL) {
-      free(qf->first);
+/**
+ * Finishes opening in shared mode: initializes the shared state if this is the
+ * first user, and publishes the header just read from the file, which is
+ * authoritative.
+ */
+static bool QueueFile_attachShared(QueueFile* qf, bool firstUser) {
+  QueueFile_SharedState* shared = qf->shared;
+  if (firstUser) {
+    memset(shared, 0, sizeof(QueueFile_SharedState));
+    pthread_mutexattr_t mta;
+    pthread_mutexattr_init(&mta);
+    pthread_mutexattr_setpshared(&mta, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mta, PTHREAD_MUTEX_ROBUST);
+    bool success = pthread_mutex_init(&shared->mutex, &mta) == 0;
+    pthread_mutexattr_destroy(&mta);
+    if (!success) {
+      LOG(LWARN, "Error initializing shared mutex, fhandle %d", qf->sharedFd);
+      return false;
     }
-    qf->first = NULL;
-    if (qf->last != NULL) {
-      free(qf->last);
+    shared->magic = QueueFile_SHARED_MAGIC;
+    msync(shared, sizeof(QueueFile_SharedState), MS_SYNC);
+    // Let other processes in.
+    if (flock(qf->sharedFd, LOCK_SH) != 0) {
+      LOG(LWARN, "Error locking control file, fhandle %d", qf->sharedFd);
+      return false;
     }
-    qf->last = NULL;
-    if (qf->fileLength > QueueFile_INITIAL_LENGTH) {
-      if (FileIo_setLength(qf->file, QueueFile_INITIAL_LENGTH)) {
-        qf->fileLength = QueueFile_INITIAL_LENGTH;
-        success = true;
-      }
+  } else if (shared->magic != QueueFile_SHARED_MAGIC) {
+    LOG(LWARN, "Control file not initialized, fhandle %d", qf->sharedFd);
+    return false;
+  }
+
+  // The header is authoritative, the shared state may be stale if this is the
+  // first user or a process died while updating it.
+  QueueFile_lock(qf);
+  bool success = QueueFile_readHeader(qf);
+  if (success) QueueFile_publishShared(qf, true);
+  QueueFile_unlock(qf);
+  return success;
+}
+
+/**
+ * Locks the queue. In shared mode the outermost lock also takes the shared
+ * mutex and picks up changes published by other processes.
+ */
+static void QueueFile_lock(QueueFile* qf) {
+  pthread_mutex_lock(&qf->mutex);
+  if (qf->lockDepth++ > 0 || qf->shared == NULL) return;
+
+  int rc = pthread_mutex_lock(&qf->shared->mutex);
+  if (rc == EOWNERDEAD) {
+    // The shared state might be half updated, but the file header is only
+    // ever written as a whole. Rebuild from it.
+    LOG(LINFO, "Process died holding the queue lock, recovering from header");
+    pthread_mutex_consistent(&qf->shared->mutex);
+    if (QueueFile_readHeader(qf)) {
+      QueueFile_publishShared(qf, true);
     } else {
-      success = true;
+      LOG(LFATAL, "Could not recover shared state from queue file header");
     }
+  } else if (rc != 0) {
+    LOG(LFATAL, "Error %d locking shared queue state", rc);
+  } else if (qf->shared->generation != qf->sharedGeneration) {
+    QueueFile_loadShared(qf);
   }
+}
 
+/** Unlocks the queue, publishing changes in shared mode. */
+static void QueueFile_unlock(QueueFile* qf) {
+  if (--qf->lockDepth == 0 && qf->shared != NULL) {
+    QueueFile_publishShared(qf, false);
+    pthread_mutex_unlock(&qf->shared->mutex);
+  }
   pthread_mutex_unlock(&qf->mutex);
-  return success;
+}
+
+/** Sleeps until *word no longer equals expected, or timeout. May wake early. */
+static void QueueFile_futexWait(uint32_t* word, uint32_t expected,
+                                uint32_t timeoutMillis, bool shared) {
+#ifdef __linux__
+  struct timespec timeout;
+  timeout.tv_sec = (time_t) (timeoutMillis / 1000);
+  timeout.tv_nsec = (long) (timeoutMillis % 1000) * 1000000L;
+  syscall(SYS_futex, word, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, expected,
+          &timeout, NULL, 0);
+#else
+  // No futex, poll.
+  (void) shared;
+  if (*(volatile uint32_t*) word == expected) {
+    usleep(timeoutMillis < 10 ? timeoutMillis * 1000 : 10000);
+  }
+#endif
+}
+
+/** Wakes all threads sleeping in QueueFile_futexWait on word. */
+static void QueueFile_futexWake(uint32_t* word, bool shared) {
+#ifdef __linux__
+  syscall(SYS_futex, word, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT32_MAX,
+          NULL, NULL, 0);
+#else
+  (void) word;
+  (void) shared;
+#endif
+}
+
+/** Milliseconds on the monotonic clock. */
+static uint64_t QueueFile_nowMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// see description in queuefile.h.
+bool QueueFile_await(QueueFile* qf, uint32_t timeoutMillis) {
+  if (NULLARG(qf)) return false;
+  uint64_t deadline = QueueFile_nowMillis() + timeoutMillis;
+  uint32_t* word = qf->shared != NULL ? &qf->shared->generation :
+                                        &qf->localGeneration;
+  while (true) {
+    QueueFile_lock(qf);
+    bool notEmpty = qf->elementCount > 0;
+    uint32_t seen = *word;
+    QueueFile_unlock(qf);
+    if (notEmpty) return true;
+
+    uint64_t now = QueueFile_nowMillis();
+    if (now >= deadline) return false;
+    QueueFile_futexWait(word, seen, (uint32_t) (deadline - now),
+                        qf->shared != NULL);
+  }
+}
+
+void _for_testing_QueueFile_lockAndAbandon(QueueFile* qf) {
+  QueueFile_lock(qf);
 }
 
 // TODO(jochen): bool QueueFile_fprintf(QueueFile *qf);
@@ -749,39 +3808,32 @@ FILE* _for_testing_QueueFile_getFhandle(QueueFile *qf) {
 
 /**
  * Make a temporary filename (appends ".tmp") at most maxLen chars long.
- * Caller must free result.
+ * Caller must free result with the given allocator.
  */
-char* makeTempFilename(const char* filename, int maxLen) {
+char* makeTempFilename(const QueueFile_Allocator* allocator,
+                       const char* filename, int maxLen) {
   // Use a temp file so we don't leave a partially-initialized file.
-  if (filename == NULL || maxLen < 4) {
-    return NULL;
-  }
-  size_t len = strnlen(filename, (size_t) maxLen - 5) + 5;
-  char* tempname = malloc(len);
-  if (CHECKOOM(tempname)) {
-    return NULL;
-  }
-  strncpy(tempname, filename, len);
-  tempname[len-1] = '\0'; // make sure it's terminated if filename was too long.
-  strcat(tempname, ".tmp");
-  return tempname;
+  return makeFilenameWithSuffix(allocator, filename, ".tmp", maxLen);
 }
 
-static bool _freeAndAssignNonNull(void** oldPointer, void* newPointer) {
-  if (newPointer != NULL) {
-    if (*oldPointer != NULL) {
-      free(*oldPointer);
-    }
-    *oldPointer = newPointer;
-    return true;
+/**
+ * Make a filename with the given suffix appended, at most maxLen chars long.
+ * Caller must free result with the given allocator.
+ */
+static char* makeFilenameWithSuffix(const QueueFile_Allocator* allocator,
+                                    const char* filename, const char* suffix,
+                                    int maxLen) {
+  size_t suffixLen = strlen(suffix) + 1;
+  if (filename == NULL || maxLen < 0 || (size_t) maxLen < suffixLen) {
+    return NULL;
   }
-  return false;
-}
-
-static bool _freeAndAssign(void** oldPointer, void* newPointer) {
-  if (*oldPointer != NULL) {
-    free(*oldPointer);
+  size_t len = strnlen(filename, (size_t) maxLen - suffixLen) + suffixLen;
+  char* name = allocator->alloc(allocator->context, len);
+  if (CHECKOOM(name)) {
+    return NULL;
   }
-  *oldPointer = newPointer;
-  return true;
+  strncpy(name, filename, len);
+  name[len-1] = '\0'; // make sure it's terminated if filename was too long.
+  strcat(name, suffix);
+  return name;
 }
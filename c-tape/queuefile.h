@@ -18,7 +18,9 @@
 /*
  * Port of Tape project from Java. https://github.com/square/tape
  *
- * Integers are forced to be 32-bit, maximum file size supported is 2^32 (4GB).
+ * File positions and lengths are 64-bit (format version 2), elements and
+ * element counts are limited to 32 bits. Version 1 files, which had 32-bit
+ * positions, are converted when opened.
  *
  * Original description:
  *
@@ -49,6 +51,7 @@
 #ifndef QUEUEFILE_H_
 #define QUEUEFILE_H_
 
+#include<stddef.h>
 #include"types.h"
 
 struct _QueueFile;
@@ -61,6 +64,231 @@ typedef struct _QueueFile QueueFile;
  */
 QueueFile* QueueFile_new(char* filename);
 
+/**
+ * Memory allocator of a queue, see QueueFile_Options. Both functions are
+ * called with context as the first argument and may be called from any thread
+ * using the queue.
+ */
+typedef struct {
+  /** Returns size bytes of memory, or NULL if out of memory. */
+  void* (*alloc)(void* context, size_t size);
+  /** Frees memory returned by alloc, never called with NULL. */
+  void (*free)(void* context, void* pointer);
+  void* context;
+} QueueFile_Allocator;
+
+/**
+ * What an add does when the file has grown to maxFileLength and the element
+ * doesn't fit, see QueueFile_Options.
+ */
+typedef enum {
+  /** The add fails. */
+  QueueFile_FULL_REJECT = 0,
+  /**
+   * The add waits up to fullTimeoutMillis for removals to make room. Adds
+   * made under the queue's lock, from a QueueFile_forEach reader for
+   * instance, fail instead: no removal could happen while they wait.
+   */
+  QueueFile_FULL_BLOCK,
+  /**
+   * The eldest elements are removed until the new one fits, with one header
+   * commit before the add's, see QueueFile_getDropStats. With initialLength
+   * equal to maxFileLength this makes the queue a flight recorder: a file of
+   * fixed size holding the newest elements. Elements an open snapshot still
+   * reads are not removed, if the new one doesn't fit without them the add
+   * fails and nothing is dropped.
+   */
+  QueueFile_FULL_DROP_OLDEST
+} QueueFile_FullPolicy;
+
+/**
+ * Compresses elements, see QueueFile_Options.codec. Both functions are called
+ * with context as the first argument and may be called from any thread using
+ * the queue, also at the same time.
+ */
+typedef struct {
+  /**
+   * Stored with every element compressed by the codec, 1 to 255. 1 is taken
+   * by QueueFile_CODEC_LZ.
+   */
+  uint8_t id;
+  /**
+   * Compresses length bytes of data into out.
+   * @return the compressed length, 0 if it doesn't fit into capacity bytes.
+   */
+  uint32_t (*compress)(void* context, const byte* data, uint32_t length,
+                       byte* out, uint32_t capacity);
+  /**
+   * Decompresses length bytes of data into exactly outLength bytes.
+   * @return false if the data is corrupt.
+   */
+  bool (*decompress)(void* context, const byte* data, uint32_t length,
+                     byte* out, uint32_t outLength);
+  void* context;
+} QueueFile_Codec;
+
+/**
+ * Built-in codec, a fast LZ77 compressor in the style of LZ4. Elements
+ * compressed with it can be read whatever codec the queue is opened with.
+ */
+extern const QueueFile_Codec QueueFile_CODEC_LZ;
+
+/** Options for QueueFile_newWithOptions. */
+typedef struct {
+  /**
+   * Lets several processes use the queue file at the same time. The queue
+   * state is kept in a memory mapped control file ("<filename>.shm") guarded
+   * by a process-shared robust mutex, so processes see each other's commits
+   * without re-reading the header. A process dying while holding the lock is
+   * recovered from the file header. Every process using the file must open it
+   * in shared mode. Snapshots are not supported in shared mode.
+   */
+  bool shared;
+
+  /**
+   * Allocator for all memory of the queue: the QueueFile itself, snapshots,
+   * pending async adds, temporary filenames and the buffers returned by
+   * QueueFile_peek. Leave alloc NULL to use malloc and free.
+   */
+  QueueFile_Allocator allocator;
+
+  /**
+   * Keeps the positions and lengths of the elements in memory, so that
+   * removals, QueueFile_peekAt and QueueFile_forEach don't read element
+   * headers from the file. The index is built when the queue is opened, costs
+   * 12 bytes per element and covers at most indexMaxElements of the eldest
+   * elements, see QueueFile_getIndexStats. Not supported in shared mode.
+   */
+  bool indexed;
+
+  /** Maximum number of indexed elements, 0 for the default of 2^20. */
+  uint32_t indexMaxElements;
+
+  /**
+   * Size in bytes of a write-through cache of the most recently added
+   * elements, 0 for none. Reads of elements (and element headers) which lie
+   * within the last tailCacheBytes bytes written are served from memory, so
+   * consumers keeping up with producers don't read from the file. Allocated
+   * when the queue is opened. Not supported in shared mode.
+   */
+  uint32_t tailCacheBytes;
+
+  /**
+   * Stores the queue in a directory of segment files of this many bytes
+   * instead of a single ring file, 0 for a ring file. filename then names the
+   * directory, which holds a manifest with the queue header and the segments.
+   * Adds go to the newest segment and never copy existing data; segments are
+   * deleted as soon as all elements in them are removed. Only applies when
+   * the queue is created, existing queues keep their segment length. Not
+   * supported in shared mode, and views (QueueFile_peekView) aren't either.
+   */
+  uint32_t segmentLength;
+
+  /**
+   * Shrinks the file online once less than this percentage of it is in use,
+   * must be below 50; 0 for never, the file is then only truncated when the
+   * queue is emptied. Checked after removals: the file is halved when the
+   * elements lie in its first half, or when they can be moved there by
+   * copying at most 1MB, else a later removal tries again. Each step commits
+   * the new length through the header before the file is truncated.
+   */
+  uint32_t shrinkPercent;
+
+  /**
+   * Bounds the latency of expansion, 0 to expand in one go. When the file
+   * grows while the ring wraps around its end, the wrapped front of the ring
+   * has to be copied behind the old end. With this option the file is grown
+   * and the new space usable at once, and the front is copied by the
+   * following adds and removals, at most expansionStepBytes per call; until
+   * then it is read from where it was. The progress is committed in the
+   * header, a queue reopened after a crash goes on copying. Not supported in
+   * shared mode.
+   */
+  uint32_t expansionStepBytes;
+
+  /**
+   * Expands the file ahead of time once more than this percentage of it is
+   * in use, 0 to only expand when an add doesn't fit. The I/O thread (see
+   * QueueFile_addAsync) grows the file as an add would (see growthPercent),
+   * preallocates it and copies the wrapped front of the ring in steps of
+   * expansionStepBytes (64KB if 0), letting adds use the free space in
+   * between, so producers rarely wait for an expansion. Must be below 100,
+   * and more than twice shrinkPercent when that is set. Not supported in
+   * shared mode.
+   */
+  uint32_t expandAtPercent;
+
+  /**
+   * Length of a new file and of the file after QueueFile_clear, 0 for 4096
+   * bytes (one file system block). Shrinking stops there as well.
+   */
+  uint64_t initialLength;
+
+  /**
+   * How much the file grows when an add doesn't fit: by growthPercent of its
+   * length, 0 for 100 (doubling), or by growthIncrement bytes if that isn't
+   * 0. Lengths grown either way are rounded up to whole 4096 byte blocks.
+   * To copy the wrapped front in steps (see expansionStepBytes) the file
+   * grows until all of it fits behind the old end; unless it doubles, the
+   * old length must be a whole number of blocks, else the copy is done at
+   * once.
+   */
+  uint32_t growthPercent;
+  uint64_t growthIncrement;
+
+  /**
+   * Length the file never grows beyond, 0 for no limit; fullPolicy decides
+   * what adds do once an element doesn't fit any more. Must be at least
+   * initialLength. Not supported for segmented queues.
+   */
+  uint64_t maxFileLength;
+  QueueFile_FullPolicy fullPolicy;
+
+  /** Longest time an add waits for room with QueueFile_FULL_BLOCK. */
+  uint32_t fullTimeoutMillis;
+
+  /**
+   * Compresses the data of added elements of at least compressMinBytes bytes
+   * (0 for 64), NULL for no compression; must stay valid while the queue is
+   * open. Elements which don't shrink are stored as they are. Compressed
+   * elements are flagged in their header and decompressed by peeks, element
+   * streams, QueueFile_forEach and snapshots, whose lengths are those of the
+   * decompressed data. Once a queue holds compressed elements, which lasts
+   * until it is cleared, elements are limited to 2^31 - 1 bytes and
+   * QueueFile_peekView, QueueFile_peekBatch and QueueFile_forEachBatch, which
+   * hand out the stored bytes, fail. Not supported in shared mode.
+   */
+  const QueueFile_Codec* codec;
+  uint32_t compressMinBytes;
+
+  /**
+   * Keeps the position of every sparseIndexInterval-th element in memory, 0
+   * for none, so that reaching element n (QueueFile_get, QueueFile_peekAt,
+   * QueueFile_removeN) reads fewer than sparseIndexInterval element headers
+   * instead of n. Costs 12 bytes per interval elements. Closing the queue
+   * saves the index to "<filename>.idx" (in the directory of a segmented
+   * queue) and marks the header; the next open loads it instead of reading
+   * all element headers, unless the queue changed since or the interval
+   * differs. Not supported in shared mode.
+   */
+  uint32_t sparseIndexInterval;
+} QueueFile_Options;
+
+/**
+ * Sets all options to their defaults.
+ * @param options to initialize.
+ */
+void QueueFile_initOptions(QueueFile_Options* options);
+
+/**
+ * Create new queuefile.
+ * @param filename
+ * @param options or NULL for defaults, see QueueFile_initOptions.
+ * @return new queuefile or NULL on error.
+ */
+QueueFile* QueueFile_newWithOptions(char* filename,
+                                    const QueueFile_Options* options);
+
 /** 
  * Closes the underlying file and frees all memory including
  * the pointer passed.
@@ -80,20 +308,179 @@ bool QueueFile_closeAndFree(QueueFile* qf);
 bool QueueFile_add(QueueFile* qf, const byte* data, uint32_t offset,
                    uint32_t count);
 
+/**
+ * Called by the I/O thread once an element passed to QueueFile_addAsync was
+ * committed, or failed to be.
+ * @param context as passed to QueueFile_addAsync.
+ * @param success true if the element is durable.
+ * @param sequence 1-based number of the element among all elements added
+ *        through this queuefile since it was opened, 0 on failure.
+ */
+typedef void (*QueueFile_AddCallback)(void* context, bool success,
+                                      uint64_t sequence);
+
+/**
+ * Adds an element to the end of the queue without waiting for the write.
+ * The data is copied and written by an I/O thread, which combines the adds
+ * pending at the time into one write and one header commit. Elements are
+ * added in the order of the calls. Closing the queue completes all pending
+ * adds.
+ * @param qf queuefile
+ * @param data to copy bytes from
+ * @param offset to start from in buffer
+ * @param count number of bytes to copy
+ * @param callback called from the I/O thread once the element is durable or
+ *        failed, may be NULL. Must not close the queue.
+ * @param context passed to callback.
+ * @return false if the element could not be queued, the callback won't be
+ *         called then.
+ */
+bool QueueFile_addAsync(QueueFile* qf, const byte* data, uint32_t offset,
+                        uint32_t count, QueueFile_AddCallback callback,
+                        void* context);
+
 /** 
  * Reads the eldest element. Returns null if the queue is empty.
  * @param qf queuefile
  * @param returnedLength contains the size of the returned buffer.
- * @return element buffer (null if queue is empty) CALLER MUST FREE THIS
+ * @return element buffer (null if queue is empty) CALLER MUST FREE THIS, with
+ *         QueueFile_freeBuffer if a custom allocator is used.
  */
 byte* QueueFile_peek(QueueFile* qf, uint32_t* returnedLength);
 
+/**
+ * Frees a buffer returned by QueueFile_peek using the allocator of the queue.
+ * @param qf queuefile
+ * @param buffer to free, may be NULL.
+ */
+void QueueFile_freeBuffer(QueueFile* qf, void* buffer);
+
+/** Result of QueueFile_peekInto. */
+typedef enum {
+  /** The element was copied to the buffer. */
+  QueueFile_PEEK_OK = 0,
+  /** The queue is empty. */
+  QueueFile_PEEK_EMPTY,
+  /** The buffer is too small, nothing was copied. */
+  QueueFile_PEEK_TOO_SMALL,
+  /** An error occurred or NULL was passed. */
+  QueueFile_PEEK_ERROR
+} QueueFile_PeekStatus;
+
+/**
+ * @param qf queuefile
+ * @return the length of the eldest element, 0 if the queue is empty or NULL
+ *         is passed (elements may be empty too, see QueueFile_isEmpty).
+ */
+uint32_t QueueFile_peekSize(QueueFile* qf);
+
+/**
+ * Copies the eldest element into a caller supplied buffer, so a consumer can
+ * reuse one buffer instead of allocating for every peek.
+ * @param qf queuefile
+ * @param buffer to copy the element to, may be NULL if capacity is 0.
+ * @param capacity size of buffer.
+ * @param length set to the length of the element, also when the buffer is
+ *        too small, or to 0 if the queue is empty.
+ * @return QueueFile_PEEK_OK if the element was copied, QueueFile_PEEK_TOO_SMALL
+ *         if it needs a buffer of *length bytes.
+ */
+QueueFile_PeekStatus QueueFile_peekInto(QueueFile* qf, byte* buffer,
+                                        uint32_t capacity, uint32_t* length);
+
+/** A contiguous part of an element, see QueueFile_View. */
+typedef struct {
+  const byte* data;
+  uint32_t length;
+} QueueFile_Segment;
+
+/** Zero-copy view of an element, see QueueFile_peekView. */
+typedef struct {
+  /** Length of the element. */
+  uint32_t length;
+  /** 1, or 2 if the element wraps around the end of the ring. */
+  uint32_t segmentCount;
+  /** The element is the concatenation of the segments. */
+  QueueFile_Segment segments[2];
+} QueueFile_View;
+
+/**
+ * Zero-copy peek: points view at the eldest element in a read-only memory
+ * mapping of the file, so large elements can be parsed or forwarded without
+ * copying them.
+ *
+ * The view stays valid until that element is removed (QueueFile_remove,
+ * QueueFile_removeN or QueueFile_clear), QueueFile_releaseView is called or the
+ * queue is closed. While a view is out, adds grow the file rather than reuse
+ * space at the start of the ring. Not supported in shared mode or on queues
+ * holding compressed elements, see QueueFile_Options.codec.
+ * @param qf queuefile
+ * @param view set to the eldest element.
+ * @return false if the queue is empty, an error occurred or NULL passed.
+ */
+bool QueueFile_peekView(QueueFile* qf, QueueFile_View* view);
+
+/**
+ * Gives up the view of the eldest element without removing it.
+ * @param qf queuefile
+ */
+void QueueFile_releaseView(QueueFile* qf);
+
+/** Caller owned storage for QueueFile_peekBatch. */
+typedef struct {
+  /** Receives the raw elements, must hold at least maxBytes. */
+  byte* buffer;
+  /** Receives the elements, must hold at least maxCount. */
+  QueueFile_Segment* elements;
+  /** Set to the number of elements read. */
+  uint32_t count;
+  /** Set to the bytes of buffer taken by them, including their lengths. */
+  uint32_t bytes;
+} QueueFile_Batch;
+
+/**
+ * Reads the eldest elements with one large read (two if the ring wraps),
+ * rather than one seek and read per element. Pair it with QueueFile_removeN
+ * to drain a queue in batches.
+ *
+ * The buffer receives the elements as they are laid out in the file,
+ * including the 4 byte length before each element, so maxBytes must allow
+ * for those too. The elements array points into the buffer. If the eldest
+ * element alone exceeds maxBytes, no element is returned; use
+ * QueueFile_peekSize and QueueFile_peekInto for it. Fails on queues holding
+ * compressed elements, see QueueFile_Options.codec.
+ * @param qf queuefile
+ * @param maxCount maximum number of elements to return.
+ * @param maxBytes maximum number of bytes to read.
+ * @param batch storage for the elements, see QueueFile_Batch.
+ * @return false if an error occurred or NULL passed.
+ */
+bool QueueFile_peekBatch(QueueFile* qf, uint32_t maxCount, uint32_t maxBytes,
+                         QueueFile_Batch* batch);
+
+/**
+ * Like QueueFile_peekBatch, but starts at the n-th eldest element. The
+ * elements before it are found as for QueueFile_peekAt, then the batch is
+ * read with one large read.
+ * @param qf queuefile
+ * @param n 0-based number of the first element to return.
+ * @param maxCount maximum number of elements to return.
+ * @param maxBytes maximum number of bytes to read.
+ * @param batch storage for the elements, count is 0 if fewer than n + 1
+ *        elements are queued.
+ * @return false if an error occurred or NULL passed.
+ */
+bool QueueFile_peekBatchAt(QueueFile* qf, uint32_t n, uint32_t maxCount,
+                           uint32_t maxBytes, QueueFile_Batch* batch);
+
 
 struct _QueueFile_ElementStream;
 typedef struct _QueueFile_ElementStream QueueFile_ElementStream;
 
 /**
- * Read data from an element stream.
+ * Read data from an element stream. Streams read ahead in chunks of a few
+ * KB, so small reads are mostly served from memory; reads of more than that
+ * go to the file directly.
  * @param stream pointer to element stream.
  * @param buffer  to copy bytes to.
  * @param length  size of buffer.
@@ -101,8 +488,8 @@ typedef struct _QueueFile_ElementStream QueueFile_ElementStream;
  * @return false if an error occurred.
  *
  * *********************************************************
- * WARNING! MUST ONLY BE USED INSIDE A CALLBACK FROM FOREACH
- * as this ensures the queuefile is under mutex lock.
+ * WARNING! MUST ONLY BE USED INSIDE A CALLBACK FROM FOREACH (or from a
+ * snapshot, see QueueFile_snapshot).
  * the validity of stream is only guaranteed under this callback.
  * *********************************************************
  */
@@ -115,8 +502,8 @@ bool QueueFile_readElementStream(QueueFile_ElementStream* stream, byte* buffer,
  * @return as int, or -1 if the element has ended, or on error.
  *
  * *********************************************************
- * WARNING! MUST ONLY BE USED INSIDE A CALLBACK FROM FOREACH
- * as this ensures the queuefile is under mutex lock.
+ * WARNING! MUST ONLY BE USED INSIDE A CALLBACK FROM FOREACH (or from a
+ * snapshot, see QueueFile_snapshot).
  * the validity of stream is only guaranteed under this callback.
  * *********************************************************
  */
@@ -144,13 +531,96 @@ bool QueueFile_peekWithElementReader(QueueFile* qf,
 /**
  * Invokes the given reader once for each element in the queue, from eldest to
  * most recently added. Note that this is under lock.
- * There will be no callback if the queue is empty.
+ * There will be no callback if the queue is empty. The queue is read in large
+ * windows (64KB, allocated by the first call and kept until the queue is
+ * closed), so elements within a window are read from memory.
  * @param qf queuefile.
  * @param reader function pointer for callback.
  * @return false if an error occurred.
  */
 bool QueueFile_forEach(QueueFile* qf, QueueFile_ElementReaderFunc reader);
 
+/**
+ * Function which is called by QueueFile_forEachBatch for consecutive elements.
+ * @param context as passed to QueueFile_forEachBatch.
+ * @param elements views of the elements, only valid during the call.
+ * @param count number of elements, at least 1.
+ * @return false to stop the iteration.
+ */
+typedef bool (*QueueFile_BatchReaderFunc)(void* context,
+                                          const QueueFile_Segment* elements,
+                                          uint32_t count);
+
+/**
+ * Like QueueFile_forEach, but passes the elements to the reader in batches of
+ * up to maxElements views into memory, read with the same windows. A batch
+ * ends early where the window moves on, and elements larger than the window
+ * are passed on their own in a buffer allocated for them. Fails on queues
+ * holding compressed elements, see QueueFile_Options.codec.
+ * @param qf queuefile.
+ * @param elements storage for maxElements views, passed to the reader.
+ * @param maxElements maximum number of elements per call, must be > 0.
+ * @param reader function called for each batch.
+ * @param context passed to reader.
+ * @return false if an error occurred or NULL passed.
+ */
+bool QueueFile_forEachBatch(QueueFile* qf, QueueFile_Segment* elements,
+                            uint32_t maxElements,
+                            QueueFile_BatchReaderFunc reader, void* context);
+
+
+struct _QueueFile_Snapshot;
+typedef struct _QueueFile_Snapshot QueueFile_Snapshot;
+
+/**
+ * Captures the elements currently in the queue for iteration without holding
+ * the queue lock for the whole scan. Producers and consumers keep running
+ * while the snapshot is read: the space of elements not yet read is pinned,
+ * so it isn't reused by adds even after those elements were removed (the file
+ * grows instead). Elements added after the snapshot was taken are not part of
+ * it.
+ *
+ * All snapshots must be released before the queuefile is closed.
+ * @param qf queuefile.
+ * @return new snapshot or NULL on error. Release with QueueFile_snapshotRelease.
+ */
+QueueFile_Snapshot* QueueFile_snapshot(QueueFile* qf);
+
+/**
+ * Invokes the given reader for the next element of the snapshot. The reader
+ * runs without the queue lock, its return value is ignored. Only one thread
+ * may read a given snapshot.
+ * @param snapshot snapshot.
+ * @param reader function pointer for callback.
+ * @return false if there are no more elements or an error occurred.
+ */
+bool QueueFile_snapshotNext(QueueFile_Snapshot* snapshot,
+                            QueueFile_ElementReaderFunc reader);
+
+/**
+ * @param snapshot snapshot.
+ * @return the number of elements not read yet, or 0 if NULL is passed.
+ */
+uint32_t QueueFile_snapshotRemaining(QueueFile_Snapshot* snapshot);
+
+/**
+ * Unpins whatever is left of the snapshot and frees it.
+ * @param snapshot snapshot.
+ * @return false if an error occurred.
+ */
+bool QueueFile_snapshotRelease(QueueFile_Snapshot* snapshot);
+
+/**
+ * Like QueueFile_forEach, but iterates a snapshot so the queue lock is only
+ * held briefly per element rather than for the whole walk, including the
+ * callbacks. See QueueFile_snapshot.
+ * @param qf queuefile.
+ * @param reader function pointer for callback.
+ * @return false if an error occurred.
+ */
+bool QueueFile_forEachSnapshot(QueueFile* qf,
+                               QueueFile_ElementReaderFunc reader);
+
 /** Returns true if there are no entries or NULL passed. */
 bool QueueFile_isEmpty(QueueFile* qf);
 
@@ -168,6 +638,15 @@ bool QueueFile_clear(QueueFile* qf);
  */
 uint32_t QueueFile_size(QueueFile* qf);
 
+/**
+ * Waits until the queue is not empty. In shared mode this also wakes up for
+ * elements added by other processes.
+ * @param qf queuefile.
+ * @param timeoutMillis maximum time to wait.
+ * @return true if the queue is not empty, false on timeout or NULL passed.
+ */
+bool QueueFile_await(QueueFile* qf, uint32_t timeoutMillis);
+
 /**
  * Removes the eldest element.
  * @param qf queuefile.
@@ -175,7 +654,110 @@ uint32_t QueueFile_size(QueueFile* qf);
  */
 bool QueueFile_remove(QueueFile* qf);
 
+/**
+ * Removes the n eldest elements with a single header write, much cheaper than
+ * n calls to QueueFile_remove as only the first n element headers are read,
+ * or fewer with an index (see QueueFile_Options.sparseIndexInterval).
+ * @param qf queuefile.
+ * @param n number of elements to remove, 0 is a no-op.
+ * @return false if fewer than n elements are queued, an error occurred or
+ *         NULL passed. Nothing is removed in this case.
+ */
+bool QueueFile_removeN(QueueFile* qf, uint32_t n);
+
+/**
+ * Copies the n-th eldest element into a caller-provided buffer, like
+ * QueueFile_peekInto for the first element. Without an index, or beyond the
+ * indexed elements, the element headers before it are read from the file,
+ * with a sparse index only those after the closest indexed element.
+ * @param qf queuefile.
+ * @param n 0-based number of the element, 0 is the first one.
+ * @param buffer to copy the data to, may be NULL if capacity is 0.
+ * @param capacity size of buffer in bytes.
+ * @param length set to the length of the element, 0 if there is none.
+ * @return QueueFile_PEEK_EMPTY if fewer than n + 1 elements are queued, else
+ *         as QueueFile_peekInto.
+ */
+QueueFile_PeekStatus QueueFile_peekAt(QueueFile* qf, uint32_t n, byte* buffer,
+                                      uint32_t capacity, uint32_t* length);
+
+/**
+ * Reads the n-th eldest element, like QueueFile_peek for the first element.
+ * Element headers are read as for QueueFile_peekAt.
+ * @param qf queuefile.
+ * @param n 0-based number of the element, 0 is the first one.
+ * @param returnedLength set to the length of the element, 0 if there is none.
+ * @return element buffer, NULL if fewer than n + 1 elements are queued or an
+ *         error occurred. CALLER MUST FREE THIS, see QueueFile_peek.
+ */
+byte* QueueFile_get(QueueFile* qf, uint32_t n, uint32_t* returnedLength);
+
+/**
+ * @param qf queuefile.
+ * @return the sum of the lengths of all elements as stored, compressed ones
+ *         count with their compressed length, without their headers, or 0
+ *         if NULL is passed. Doesn't read from the file.
+ */
+uint64_t QueueFile_sizeInBytes(QueueFile* qf);
+
+/** Memory used by the element index, see QueueFile_Options.indexed. */
+typedef struct {
+  /** Number of elements indexed, counted from the eldest one. */
+  uint32_t entries;
+  /** Number of entries memory is allocated for. */
+  uint32_t capacity;
+  /** Bytes allocated for the index. */
+  uint64_t memoryBytes;
+} QueueFile_IndexStats;
+
+/**
+ * Reports the memory used by the element index.
+ * @param qf queuefile.
+ * @param stats filled in.
+ * @return false if the queue isn't indexed or NULL passed.
+ */
+bool QueueFile_getIndexStats(QueueFile* qf, QueueFile_IndexStats* stats);
+
+/** Effectiveness of the tail cache, see QueueFile_Options.tailCacheBytes. */
+typedef struct {
+  /** Reads served from the cache since the queue was opened. */
+  uint64_t hits;
+  /** Reads which went to the file. */
+  uint64_t misses;
+  /** Size of the cache in bytes. */
+  uint32_t capacity;
+  /** Number of bytes currently cached. */
+  uint32_t cachedBytes;
+} QueueFile_CacheStats;
+
+/**
+ * Reports the hits and misses of the tail cache.
+ * @param qf queuefile.
+ * @param stats filled in.
+ * @return false if the queue has no tail cache or NULL passed.
+ */
+bool QueueFile_getCacheStats(QueueFile* qf, QueueFile_CacheStats* stats);
+
+/** Elements removed to make room, see QueueFile_FULL_DROP_OLDEST. */
+typedef struct {
+  /** Number of elements dropped since the queue was opened. */
+  uint64_t elements;
+  /** Their data bytes, not counting element headers. */
+  uint64_t bytes;
+} QueueFile_DropStats;
+
+/**
+ * Reports how much adds dropped to make room.
+ * @param qf queuefile.
+ * @param stats filled in.
+ * @return false if NULL passed.
+ */
+bool QueueFile_getDropStats(QueueFile* qf, QueueFile_DropStats* stats);
+
 
 FILE* _for_testing_QueueFile_getFhandle(QueueFile* qf);
 
+/** For testing only, takes the queue lock and never releases it. */
+void _for_testing_QueueFile_lockAndAbandon(QueueFile* qf);
+
 #endif //queuefile_h
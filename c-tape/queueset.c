@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logutil.h"
+#include "queueset.h"
+
+/*
+ * See description in queueset.h.
+ *
+ * The set itself holds no lock: each shard is synchronized by its own
+ * QueueFile mutex, and the cursors, claims and counters below are only
+ * accessed with atomic builtins so that producers and consumers on different
+ * shards never serialize.
+ */
+
+/** Counters of one shard, see QueueSet_ShardStats. */
+typedef struct {
+  QueueFile* queue;
+  /**
+   * 1 while a fair consumer holds the eldest element, from QueueSet_peek to
+   * QueueSet_remove or QueueSet_release.
+   */
+  uint32_t claimed;
+  uint64_t added;
+  uint64_t removed;
+  uint64_t addFailures;
+} QueueSet_Shard;
+
+struct _QueueSet {
+  /** Number of shards. */
+  uint32_t shardCount;
+
+  /** Round-robin cursor for QueueSet_add, only ever incremented. */
+  uint32_t addCursor;
+
+  /** Shard the next fair peek starts searching at, only a hint. */
+  uint32_t peekCursor;
+
+  /** Array of shardCount shards. */
+  QueueSet_Shard* shards;
+};
+
+// see description in queueset.h.
+QueueSet* QueueSet_new(char** filenames, uint32_t shardCount) {
+  if (NULLARG(filenames)) return NULL;
+  if (shardCount == 0) {
+    LOG(LWARN, "A queue set needs at least one shard");
+    return NULL;
+  }
+  QueueSet* qs = malloc(sizeof(QueueSet));
+  if (CHECKOOM(qs)) return NULL;
+  memset(qs, 0, sizeof(QueueSet));
+  qs->shards = calloc((size_t) shardCount, sizeof(QueueSet_Shard));
+  if (CHECKOOM(qs->shards)) {
+    free(qs);
+    return NULL;
+  }
+  qs->shardCount = shardCount;
+
+  uint32_t i;
+  for (i = 0; i < shardCount; i++) {
+    if (NULLARG(filenames[i]) ||
+        (qs->shards[i].queue = QueueFile_new(filenames[i])) == NULL) {
+      LOG(LWARN, "Could not open shard %d of queue set", i);
+      QueueSet_closeAndFree(qs);
+      return NULL;
+    }
+  }
+  return qs;
+}
+
+// see description in queueset.h.
+bool QueueSet_closeAndFree(QueueSet* qs) {
+  if (NULLARG(qs)) return false;
+  bool success = true;
+  uint32_t i;
+  for (i = 0; i < qs->shardCount; i++) {
+    if (qs->shards[i].queue != NULL &&
+        !QueueFile_closeAndFree(qs->shards[i].queue)) {
+      success = false;
+    }
+  }
+  free(qs->shards);
+  free(qs);
+  return success;
+}
+
+/** Adds to a shard and maintains its counters. */
+static bool QueueSet_addToShard(QueueSet* qs, uint32_t shard, const byte* data,
+                                uint32_t offset, uint32_t count) {
+  QueueSet_Shard* s = &qs->shards[shard];
+  if (QueueFile_add(s->queue, data, offset, count)) {
+    __sync_fetch_and_add(&s->added, 1);
+    return true;
+  }
+  __sync_fetch_and_add(&s->addFailures, 1);
+  return false;
+}
+
+// see description in queueset.h.
+bool QueueSet_add(QueueSet* qs, const byte* data, uint32_t offset,
+                  uint32_t count, uint32_t* shard) {
+  if (NULLARG(qs) || NULLARG(data)) return false;
+  uint32_t target = __sync_fetch_and_add(&qs->addCursor, 1) % qs->shardCount;
+  if (shard != NULL) *shard = target;
+  return QueueSet_addToShard(qs, target, data, offset, count);
+}
+
+/** 32-bit FNV-1a, stable across runs so keys keep their shard on reopen. */
+static uint32_t hashKey(const byte* key, uint32_t keyLength) {
+  uint32_t hash = 2166136261u;
+  uint32_t i;
+  for (i = 0; i < keyLength; i++) {
+    hash ^= key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// see description in queueset.h.
+uint32_t QueueSet_shardForKey(QueueSet* qs, const byte* key,
+                              uint32_t keyLength) {
+  if (NULLARG(qs) || NULLARG(key)) return 0;
+  return hashKey(key, keyLength) % qs->shardCount;
+}
+
+// see description in queueset.h.
+bool QueueSet_addWithKey(QueueSet* qs, const byte* key, uint32_t keyLength,
+                         const byte* data, uint32_t offset, uint32_t count) {
+  if (NULLARG(qs) || NULLARG(key) || NULLARG(data)) return false;
+  return QueueSet_addToShard(qs, QueueSet_shardForKey(qs, key, keyLength),
+                             data, offset, count);
+}
+
+// see description in queueset.h.
+byte* QueueSet_peek(QueueSet* qs, uint32_t* returnedLength, uint32_t* shard) {
+  if (NULLARG(qs) || NULLARG(returnedLength) || NULLARG(shard)) return NULL;
+  uint32_t start = __atomic_load_n(&qs->peekCursor, __ATOMIC_RELAXED);
+  uint32_t i;
+  for (i = 0; i < qs->shardCount; i++) {
+    uint32_t candidate = (start + i) % qs->shardCount;
+    QueueFile* queue = qs->shards[candidate].queue;
+    uint32_t* claimed = &qs->shards[candidate].claimed;
+    if (QueueFile_isEmpty(queue) ||
+        !__sync_bool_compare_and_swap(claimed, 0, 1)) {
+      continue;
+    }
+    // Might have been drained between the check and the peek.
+    byte* data = QueueFile_peek(queue, returnedLength);
+    if (data != NULL) {
+      *shard = candidate;
+      return data;
+    }
+    __atomic_store_n(claimed, 0, __ATOMIC_RELEASE);
+  }
+  *returnedLength = 0;
+  return NULL;
+}
+
+// see description in queueset.h.
+byte* QueueSet_peekShard(QueueSet* qs, uint32_t shard,
+                         uint32_t* returnedLength) {
+  if (NULLARG(qs) || NULLARG(returnedLength)) return NULL;
+  if (shard >= qs->shardCount) {
+    LOG(LWARN, "Shard %d out of range, queue set has %d shards", shard,
+        qs->shardCount);
+    return NULL;
+  }
+  return QueueFile_peek(qs->shards[shard].queue, returnedLength);
+}
+
+// see description in queueset.h.
+bool QueueSet_remove(QueueSet* qs, uint32_t shard) {
+  if (NULLARG(qs)) return false;
+  if (shard >= qs->shardCount) {
+    LOG(LWARN, "Shard %d out of range, queue set has %d shards", shard,
+        qs->shardCount);
+    return false;
+  }
+  QueueSet_Shard* s = &qs->shards[shard];
+  bool success = QueueFile_remove(s->queue);
+  if (success) {
+    __sync_fetch_and_add(&s->removed, 1);
+    __atomic_store_n(&qs->peekCursor, (shard + 1) % qs->shardCount,
+                     __ATOMIC_RELAXED);
+  }
+  // Only after the removal, or another consumer could peek the same element.
+  __atomic_store_n(&s->claimed, 0, __ATOMIC_RELEASE);
+  return success;
+}
+
+// see description in queueset.h.
+bool QueueSet_release(QueueSet* qs, uint32_t shard) {
+  if (NULLARG(qs)) return false;
+  if (shard >= qs->shardCount) {
+    LOG(LWARN, "Shard %d out of range, queue set has %d shards", shard,
+        qs->shardCount);
+    return false;
+  }
+  __atomic_store_n(&qs->shards[shard].claimed, 0, __ATOMIC_RELEASE);
+  return true;
+}
+
+// see description in queueset.h.
+uint64_t QueueSet_size(QueueSet* qs) {
+  if (NULLARG(qs)) return 0;
+  uint64_t size = 0;
+  uint32_t i;
+  for (i = 0; i < qs->shardCount; i++) {
+    size += QueueFile_size(qs->shards[i].queue);
+  }
+  return size;
+}
+
+// see description in queueset.h.
+bool QueueSet_isEmpty(QueueSet* qs) {
+  if (NULLARG(qs)) return true;
+  uint32_t i;
+  for (i = 0; i < qs->shardCount; i++) {
+    if (!QueueFile_isEmpty(qs->shards[i].queue)) return false;
+  }
+  return true;
+}
+
+// see description in queueset.h.
+uint32_t QueueSet_shardCount(QueueSet* qs) {
+  if (NULLARG(qs)) return 0;
+  return qs->shardCount;
+}
+
+// see description in queueset.h.
+QueueFile* QueueSet_getShard(QueueSet* qs, uint32_t shard) {
+  if (NULLARG(qs) || shard >= qs->shardCount) return NULL;
+  return qs->shards[shard].queue;
+}
+
+// see description in queueset.h.
+bool QueueSet_getShardStats(QueueSet* qs, uint32_t shard,
+                            QueueSet_ShardStats* stats) {
+  if (NULLARG(qs) || NULLARG(stats) || shard >= qs->shardCount) return false;
+  QueueSet_Shard* s = &qs->shards[shard];
+  stats->size = QueueFile_size(s->queue);
+  stats->added = __sync_fetch_and_add(&s->added, 0);
+  stats->removed = __sync_fetch_and_add(&s->removed, 0);
+  stats->addFailures = __sync_fetch_and_add(&s->addFailures, 0);
+  return true;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * A set of QueueFile shards which together behave like one queue.
+ *
+ * Every QueueFile is serialized by its own mutex and limited by the fsync rate
+ * of its own file. A QueueSet owns N independent QueueFiles (which may live in
+ * different directories or on different disks) so that producers and
+ * consumers working on different shards don't contend.
+ *
+ * Placement on add is either round-robin (QueueSet_add) or by hashing a key
+ * (QueueSet_addWithKey). All elements added with the same key land in the same
+ * shard, so they are consumed in the order they were added.
+ *
+ * Consumers either use the fair API (QueueSet_peek + QueueSet_remove), which
+ * rotates over the non-empty shards, or drain a single shard with
+ * QueueSet_peekShard + QueueSet_remove to keep per-key ordering.
+ *
+ * As with QueueFile, an element is only gone once QueueSet_remove is called
+ * for it. Any number of threads may consume through the fair API: a fair peek
+ * claims the shard it read from until the element is removed or released, and
+ * other fair peeks skip claimed shards. A shard drained with
+ * QueueSet_peekShard should have only one consumer, and no fair ones.
+ */
+
+#ifndef QUEUESET_H_
+#define QUEUESET_H_
+
+#include"types.h"
+#include"queuefile.h"
+
+struct _QueueSet;
+typedef struct _QueueSet QueueSet;
+
+/** Per-shard statistics, see QueueSet_getShardStats. */
+typedef struct {
+  /** Number of elements currently in the shard. */
+  uint32_t size;
+  /** Elements successfully added through this set since it was opened. */
+  uint64_t added;
+  /** Elements successfully removed through this set since it was opened. */
+  uint64_t removed;
+  /** Failed add attempts since the set was opened. */
+  uint64_t addFailures;
+} QueueSet_ShardStats;
+
+/**
+ * Opens (or creates) a queue set.
+ * @param filenames one queue file per shard, shards keep their index as long
+ *        as the same filenames are passed in the same order.
+ * @param shardCount number of filenames, must be > 0.
+ * @return new queue set or NULL on error.
+ */
+QueueSet* QueueSet_new(char** filenames, uint32_t shardCount);
+
+/**
+ * Closes all shards and frees all memory including the pointer passed.
+ * @param qs queue set.
+ * @return false if an error occurred closing any of the shards.
+ */
+bool QueueSet_closeAndFree(QueueSet* qs);
+
+/**
+ * Adds an element to the next shard in round-robin order.
+ * @param qs queue set.
+ * @param data to copy bytes from
+ * @param offset to start from in buffer
+ * @param count number of bytes to copy
+ * @param shard if not NULL, set to the shard the element was added to.
+ * @return false if an error occurred
+ */
+bool QueueSet_add(QueueSet* qs, const byte* data, uint32_t offset,
+                  uint32_t count, uint32_t* shard);
+
+/**
+ * Adds an element to the shard selected by hashing the key.
+ * @param qs queue set.
+ * @param key bytes to hash.
+ * @param keyLength number of key bytes.
+ * @param data to copy bytes from
+ * @param offset to start from in buffer
+ * @param count number of bytes to copy
+ * @return false if an error occurred
+ */
+bool QueueSet_addWithKey(QueueSet* qs, const byte* key, uint32_t keyLength,
+                         const byte* data, uint32_t offset, uint32_t count);
+
+/**
+ * @return the shard elements added with the given key are placed in.
+ */
+uint32_t QueueSet_shardForKey(QueueSet* qs, const byte* key,
+                              uint32_t keyLength);
+
+/**
+ * Fair peek: reads the eldest element of the next non-empty shard no other
+ * fair consumer has claimed, rotating over the shards as elements are
+ * removed, and claims that shard.
+ * @param qs queue set.
+ * @param returnedLength contains the size of the returned buffer.
+ * @param shard set to the shard the element was read from, pass it to
+ *        QueueSet_remove once the element has been processed, or to
+ *        QueueSet_release to leave it to another consumer.
+ * @return element buffer (null if all shards are empty or claimed) CALLER
+ *         MUST FREE THIS
+ */
+byte* QueueSet_peek(QueueSet* qs, uint32_t* returnedLength, uint32_t* shard);
+
+/**
+ * Reads the eldest element of the given shard, see QueueFile_peek.
+ * @return element buffer (null if the shard is empty) CALLER MUST FREE THIS
+ */
+byte* QueueSet_peekShard(QueueSet* qs, uint32_t shard,
+                         uint32_t* returnedLength);
+
+/**
+ * Removes the eldest element of the given shard, and moves the fair peek on
+ * to the following shard. Ends the claim of a fair peek either way.
+ * @return false if the shard is empty or an error occurred.
+ */
+bool QueueSet_remove(QueueSet* qs, uint32_t shard);
+
+/**
+ * Ends the claim of a fair peek without removing the element, so that the
+ * next fair peek may return it again.
+ * @return false if NULL is passed or shard is out of range.
+ */
+bool QueueSet_release(QueueSet* qs, uint32_t shard);
+
+/** @return the number of elements in all shards, or 0 if NULL is passed. */
+uint64_t QueueSet_size(QueueSet* qs);
+
+/** @return true if all shards are empty or NULL is passed. */
+bool QueueSet_isEmpty(QueueSet* qs);
+
+/** @return the number of shards, or 0 if NULL is passed. */
+uint32_t QueueSet_shardCount(QueueSet* qs);
+
+/**
+ * Direct access to a shard, e.g. for forEach. The set keeps ownership, don't
+ * close it. Adds and removes done directly on the shard are not counted in
+ * the shard stats.
+ * @return the shard or NULL if out of range.
+ */
+QueueFile* QueueSet_getShard(QueueSet* qs, uint32_t shard);
+
+/**
+ * Copies the statistics of a shard.
+ * @return false if NULL is passed or shard is out of range.
+ */
+bool QueueSet_getShardStats(QueueSet* qs, uint32_t shard,
+                            QueueSet_ShardStats* stats);
+
+#endif //queueset_h
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "logutil.h"
+#include "segmentlog.h"
+
+/** Length of a segment name, 16 hex digits and ".seg". */
+#define SegmentLog_NAME_LENGTH 20
+
+// see description in segmentlog.h.
+bool SegmentLog_init(SegmentLog* log, const QueueFile_Allocator* allocator,
+                     const char* directory, uint32_t segmentLength) {
+  memset(log, 0, sizeof(SegmentLog));
+  log->allocator = allocator;
+  log->directoryLength = strlen(directory) + 1;
+  log->path = allocator->alloc(allocator->context,
+                               log->directoryLength +
+                               SegmentLog_NAME_LENGTH + 1);
+  if (CHECKOOM(log->path)) return false;
+  strcpy(log->path, directory);
+  strcat(log->path, "/");
+  log->segmentLength = segmentLength;
+  return true;
+}
+
+/** Closes the segment files kept open. */
+static void SegmentLog_closeFiles(SegmentLog* log) {
+  if (log->writeFile != NULL) fclose(log->writeFile);
+  if (log->readFile != NULL) fclose(log->readFile);
+  log->writeFile = log->readFile = NULL;
+}
+
+// see description in segmentlog.h.
+void SegmentLog_free(SegmentLog* log) {
+  SegmentLog_closeFiles(log);
+  if (log->path != NULL) {
+    log->allocator->free(log->allocator->context, log->path);
+    log->path = NULL;
+  }
+}
+
+/** Points log->path at the file of a segment. */
+static const char* SegmentLog_segmentPath(SegmentLog* log, uint64_t segment) {
+  snprintf(log->path + log->directoryLength, SegmentLog_NAME_LENGTH + 1,
+           "%016" PRIx64 ".seg", segment);
+  return log->path;
+}
+
+/** Syncs the directory, so that a created segment survives a crash. */
+static bool SegmentLog_syncDirectory(SegmentLog* log) {
+  log->path[log->directoryLength] = '\0';
+  int fd = open(log->path, O_RDONLY);
+  bool success = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0) close(fd);
+  if (!success) LOG(LWARN, "Error syncing directory %s", log->path);
+  return success;
+}
+
+/** Returns the segment opened for writing, creating it if necessary. */
+static FILE* SegmentLog_openForWrite(SegmentLog* log, uint64_t segment) {
+  if (log->writeFile != NULL && log->writeSegment == segment) {
+    return log->writeFile;
+  }
+  if (log->writeFile != NULL) fclose(log->writeFile);
+  log->writeFile = fopen(SegmentLog_segmentPath(log, segment), "r+");
+  if (log->writeFile == NULL && errno == ENOENT) {
+    log->writeFile = fopen(log->path, "w+");
+    if (log->writeFile != NULL &&
+        (!FileIo_setLength(log->writeFile, log->segmentLength) ||
+         !SegmentLog_syncDirectory(log))) {
+      fclose(log->writeFile);
+      log->writeFile = NULL;
+    }
+  }
+  if (log->writeFile == NULL) {
+    LOG(LWARN, "Error opening segment %" PRIu64 " for writing", segment);
+    return NULL;
+  }
+  log->writeSegment = segment;
+  if (log->head == log->end) {
+    log->head = segment;
+    log->end = segment + 1;
+  } else if (segment >= log->end) {
+    log->end = segment + 1;
+  }
+  return log->writeFile;
+}
+
+/** Returns the segment opened for reading. */
+static FILE* SegmentLog_openForRead(SegmentLog* log, uint64_t segment) {
+  if (log->readFile != NULL && log->readSegment == segment) {
+    return log->readFile;
+  }
+  if (log->readFile != NULL) fclose(log->readFile);
+  log->readFile = fopen(SegmentLog_segmentPath(log, segment), "r");
+  // stdio must not serve bytes it read ahead before they were written.
+  if (log->readFile != NULL && setvbuf(log->readFile, NULL, _IONBF, 0) != 0) {
+    fclose(log->readFile);
+    log->readFile = NULL;
+  }
+  if (log->readFile == NULL) {
+    LOG(LWARN, "Error opening segment %" PRIu64 " for reading", segment);
+    return NULL;
+  }
+  log->readSegment = segment;
+  return log->readFile;
+}
+
+// see description in segmentlog.h.
+bool SegmentLog_read(SegmentLog* log, uint64_t offset, byte* buffer,
+                     uint32_t count) {
+  while (count > 0) {
+    uint64_t segment = offset / log->segmentLength;
+    uint32_t within = (uint32_t) (offset % log->segmentLength);
+    uint32_t chunk = log->segmentLength - within;
+    if (chunk > count) chunk = count;
+    FILE* file = SegmentLog_openForRead(log, segment);
+    if (file == NULL || !FileIo_seek(file, within) ||
+        !FileIo_read(file, buffer, 0, chunk)) {
+      return false;
+    }
+    buffer += chunk;
+    offset += chunk;
+    count -= chunk;
+  }
+  return true;
+}
+
+// see description in segmentlog.h.
+bool SegmentLog_write(SegmentLog* log, uint64_t offset, const byte* buffer,
+                      uint32_t count) {
+  while (count > 0) {
+    uint64_t segment = offset / log->segmentLength;
+    uint32_t within = (uint32_t) (offset % log->segmentLength);
+    uint32_t chunk = log->segmentLength - within;
+    if (chunk > count) chunk = count;
+    FILE* file = SegmentLog_openForWrite(log, segment);
+    if (file == NULL || !FileIo_seek(file, within) ||
+        !FileIo_write(file, buffer, 0, chunk)) {
+      return false;
+    }
+    buffer += chunk;
+    offset += chunk;
+    count -= chunk;
+  }
+  return true;
+}
+
+/** Deletes a segment, closing it first if it is open. */
+static void SegmentLog_delete(SegmentLog* log, uint64_t segment) {
+  if (log->writeFile != NULL && log->writeSegment == segment) {
+    fclose(log->writeFile);
+    log->writeFile = NULL;
+  }
+  if (log->readFile != NULL && log->readSegment == segment) {
+    fclose(log->readFile);
+    log->readFile = NULL;
+  }
+  if (unlink(SegmentLog_segmentPath(log, segment)) != 0 && errno != ENOENT) {
+    // Left behind, SegmentLog_recover deletes it when the queue is reopened.
+    LOG(LWARN, "Error deleting segment %" PRIu64, segment);
+  }
+}
+
+// see description in segmentlog.h.
+void SegmentLog_retain(SegmentLog* log, uint64_t from, uint64_t to) {
+  uint64_t first = from < to ? from / log->segmentLength : log->end;
+  while (log->head < first && log->head < log->end) {
+    SegmentLog_delete(log, log->head++);
+  }
+  if (log->head >= log->end) log->head = log->end = 0;
+}
+
+/**
+ * Parses the number of a segment from its file name.
+ * @return false if name isn't the name of a segment.
+ */
+static bool SegmentLog_parseName(const char* name, uint64_t* segment) {
+  if (strlen(name) != SegmentLog_NAME_LENGTH ||
+      strcmp(name + SegmentLog_NAME_LENGTH - 4, ".seg") != 0) {
+    return false;
+  }
+  *segment = 0;
+  int i;
+  for (i = 0; i < SegmentLog_NAME_LENGTH - 4; i++) {
+    char c = name[i];
+    uint64_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = (uint64_t) (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      digit = (uint64_t) (c - 'a' + 10);
+    } else {
+      return false;
+    }
+    *segment = (*segment << 4) | digit;
+  }
+  return true;
+}
+
+// see description in segmentlog.h.
+bool SegmentLog_recover(SegmentLog* log, uint64_t from, uint64_t to) {
+  SegmentLog_closeFiles(log);
+  log->head = log->end = 0;
+  if (from < to) {
+    log->head = from / log->segmentLength;
+    log->end = (to - 1) / log->segmentLength + 1;
+  }
+
+  log->path[log->directoryLength] = '\0';
+  DIR* directory = opendir(log->path);
+  if (directory == NULL) {
+    LOG(LWARN, "Error listing segments in %s", log->path);
+    return false;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    uint64_t segment;
+    if (SegmentLog_parseName(entry->d_name, &segment) &&
+        (segment < log->head || segment >= log->end)) {
+      LOG(LINFO, "Deleting unused segment %" PRIu64, segment);
+      SegmentLog_delete(log, segment);
+    }
+  }
+  closedir(directory);
+  return true;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SEGMENTLOG_H_
+#define SEGMENTLOG_H_
+
+#include <stdio.h>
+
+#include"types.h"
+#include"queuefile.h"
+
+/**
+ * An unbounded byte stream stored in a directory of fixed size segment files.
+ * Byte offset o lives in segment o / segmentLength, which is named after its
+ * number in hex ("00000000000000a3.seg"). Internal to QueueFile, see
+ * QueueFile_Options.segmentLength.
+ *
+ * Segments are created as writes reach them and deleted once no byte in them
+ * is in use any more, so disk usage follows the data in use instead of its
+ * peak.
+ */
+typedef struct {
+  /** "<directory>/" followed by room for a segment name. */
+  char* path;
+  /** Length of the directory part of path, including the '/'. */
+  size_t directoryLength;
+  /** Bytes per segment, 0 if the log isn't used. */
+  uint32_t segmentLength;
+  /** Segments [head, end) may exist, head == end if none does. */
+  uint64_t head;
+  uint64_t end;
+  /** Segment writes go to, kept open as appends mostly stay in it. */
+  FILE* writeFile;
+  uint64_t writeSegment;
+  /** Segment last read from, unbuffered as its tail may still be written. */
+  FILE* readFile;
+  uint64_t readSegment;
+  const QueueFile_Allocator* allocator;
+} SegmentLog;
+
+/**
+ * Sets up a log over the segments in directory, which must exist. Nothing is
+ * opened yet.
+ * @return false if out of memory.
+ */
+bool SegmentLog_init(SegmentLog* log, const QueueFile_Allocator* allocator,
+                     const char* directory, uint32_t segmentLength);
+
+/** Closes the open segments and frees the memory of the log. */
+void SegmentLog_free(SegmentLog* log);
+
+/** Reads count bytes at offset, they may span several segments. */
+bool SegmentLog_read(SegmentLog* log, uint64_t offset, byte* buffer,
+                     uint32_t count);
+
+/**
+ * Writes count bytes at offset and syncs them, creating segments as needed.
+ */
+bool SegmentLog_write(SegmentLog* log, uint64_t offset, const byte* buffer,
+                      uint32_t count);
+
+/**
+ * Deletes the segments before the one holding offset from, all segments if
+ * from == to. The bytes in [from, to) are the ones still in use.
+ */
+void SegmentLog_retain(SegmentLog* log, uint64_t from, uint64_t to);
+
+/**
+ * Deletes every segment in the directory which holds no byte of [from, to),
+ * such as the ones left behind by a crash before they were deleted. Called
+ * once the range in use is known after opening.
+ */
+bool SegmentLog_recover(SegmentLog* log, uint64_t from, uint64_t to);
+
+#endif //segmentlog_h
@@ -0,0 +1,576 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logutil.h"
+#include "taskrunner.h"
+
+/*
+ * See description in taskrunner.h.
+ *
+ * Locking: runner->mutex protects the in-flight count, the completion flags
+ * and acknowledged counters of the sources, the stats and the stopping flag.
+ * Each source has an ioMutex serializing the reads of a refill with the bulk
+ * removals of acknowledgements, so that the number of elements to skip when
+ * refilling always matches the head of the queue. It is taken before
+ * runner->mutex when both are needed. Each deque has its own mutex which is
+ * never held while taking another lock.
+ */
+
+/** Most bytes of elements a refill reads at once, see TaskRunner_readSource. */
+#define TaskRunner_REFILL_BYTES (64 << 10)
+
+/** An element read from a queue. */
+typedef struct {
+  /** Index of the source the element was read from. */
+  uint32_t source;
+  /** Number of elements read from the source before this one. */
+  uint64_t sequence;
+  uint32_t length;
+  /** Points right behind the task, allocated along with it. */
+  byte* data;
+  /** Earliest time to retry the task after it failed, see nowMillis. */
+  uint64_t notBefore;
+} TaskRunner_Task;
+
+/** Fixed size ring of tasks, owner takes from the head, thieves from the tail. */
+typedef struct {
+  pthread_mutex_t mutex;
+  TaskRunner_Task** tasks;
+  uint32_t head;
+  uint32_t count;
+} TaskRunner_Deque;
+
+typedef struct {
+  QueueFile* queue;
+  pthread_mutex_t ioMutex;
+  /** Sequence of the element at the head of the queue. */
+  uint64_t acknowledged;
+  /** Sequence of the next element to read. */
+  uint64_t dispatched;
+  /** Completion flags, indexed by sequence modulo maxInFlight. */
+  bool* done;
+  /** Set while a worker removes completed elements from this queue. */
+  bool acking;
+} TaskRunner_Source;
+
+typedef struct {
+  TaskRunner* runner;
+  uint32_t index;
+  pthread_t thread;
+  bool started;
+  TaskRunner_Deque deque;
+  /** Tasks which failed on this worker, in the order their retries are due. */
+  TaskRunner_Deque retries;
+  /** Batch the refills of this worker read into. */
+  byte* refillBuffer;
+  QueueFile_Segment* refillElements;
+} TaskRunner_Worker;
+
+struct _TaskRunner {
+  TaskRunner_Options options;
+  TaskRunner_TaskFunc task;
+  void* context;
+
+  uint32_t sourceCount;
+  TaskRunner_Source* sources;
+  /** Source the next refill starts reading from. */
+  uint32_t nextSource;
+
+  TaskRunner_Worker* workers;
+
+  pthread_mutex_t mutex;
+  /** Signalled on stop, notify and when a refill made tasks available. */
+  pthread_cond_t condition;
+  bool stopping;
+  bool ackFailed;
+  TaskRunner_Stats stats;
+};
+
+// see description in taskrunner.h.
+void TaskRunner_initOptions(TaskRunner_Options* options) {
+  if (NULLARG(options)) return;
+  options->workerCount = 4;
+  options->maxInFlight = 64;
+  options->refillBatch = 16;
+  options->idleWaitMillis = 100;
+  options->retryDelayMillis = 1000;
+}
+
+/** Allocates a task holding a copy of data. */
+static TaskRunner_Task* TaskRunner_newTask(uint32_t source, uint64_t sequence,
+                                           const byte* data, uint32_t length) {
+  TaskRunner_Task* task = malloc(sizeof(TaskRunner_Task) + length);
+  if (CHECKOOM(task)) return NULL;
+  task->source = source;
+  task->sequence = sequence;
+  task->length = length;
+  task->data = (byte*) (task + 1);
+  task->notBefore = 0;
+  memcpy(task->data, data, (size_t) length);
+  return task;
+}
+
+static void TaskRunner_freeTask(TaskRunner_Task* task) {
+  free(task);
+}
+
+static void TaskRunner_push(TaskRunner* runner, TaskRunner_Deque* deque,
+                            TaskRunner_Task* task) {
+  pthread_mutex_lock(&deque->mutex);
+  // Can't overflow, there are never more than maxInFlight tasks in total.
+  uint32_t capacity = runner->options.maxInFlight;
+  deque->tasks[(deque->head + deque->count) % capacity] = task;
+  deque->count++;
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+/** Takes the eldest task, or the most recent one if stealing. */
+static TaskRunner_Task* TaskRunner_take(TaskRunner* runner,
+                                        TaskRunner_Deque* deque, bool steal) {
+  TaskRunner_Task* task = NULL;
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count > 0) {
+    uint32_t capacity = runner->options.maxInFlight;
+    if (steal) {
+      task = deque->tasks[(deque->head + deque->count - 1) % capacity];
+    } else {
+      task = deque->tasks[deque->head];
+      deque->head = (deque->head + 1) % capacity;
+    }
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+/** Returns the monotonic time in milliseconds. */
+static uint64_t TaskRunner_nowMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+/**
+ * Takes the eldest task of a deque of retries if it is due.
+ * @param nextDue if not NULL, lowered to when the eldest task is due if it
+ *        isn't yet.
+ */
+static TaskRunner_Task* TaskRunner_takeDue(TaskRunner* runner,
+                                           TaskRunner_Deque* deque,
+                                           uint64_t now, uint64_t* nextDue) {
+  TaskRunner_Task* task = NULL;
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count > 0) {
+    TaskRunner_Task* eldest = deque->tasks[deque->head];
+    if (eldest->notBefore <= now) {
+      task = eldest;
+      deque->head = (deque->head + 1) % runner->options.maxInFlight;
+      deque->count--;
+    } else if (nextDue != NULL && eldest->notBefore < *nextDue) {
+      *nextDue = eldest->notBefore;
+    }
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+/** Takes a task from another worker, or a retry of theirs which is due. */
+static TaskRunner_Task* TaskRunner_steal(TaskRunner_Worker* worker,
+                                         uint64_t now) {
+  TaskRunner* runner = worker->runner;
+  uint32_t workerCount = runner->options.workerCount;
+  uint32_t i;
+  for (i = 1; i < workerCount; i++) {
+    TaskRunner_Worker* victim = &runner->workers[(worker->index + i) %
+                                                 workerCount];
+    TaskRunner_Task* task = TaskRunner_take(runner, &victim->deque, true);
+    if (task == NULL) {
+      task = TaskRunner_takeDue(runner, &victim->retries, now, NULL);
+    }
+    if (task != NULL) {
+      pthread_mutex_lock(&runner->mutex);
+      runner->stats.stolen++;
+      pthread_mutex_unlock(&runner->mutex);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Reads up to count elements following the ones already dispatched from a
+ * source into the worker's deque, with one batched read. Must hold
+ * source->ioMutex.
+ * @return number of tasks added.
+ */
+static uint32_t TaskRunner_readSource(TaskRunner* runner, uint32_t index,
+                                      uint32_t count,
+                                      TaskRunner_Worker* worker) {
+  TaskRunner_Source* source = &runner->sources[index];
+  // The queue starts at the eldest unacknowledged element.
+  uint32_t skip = (uint32_t) (source->dispatched - source->acknowledged);
+  QueueFile_Batch batch = { worker->refillBuffer, worker->refillElements, 0,
+                            0 };
+  if (!QueueFile_peekBatchAt(source->queue, skip, count,
+                             TaskRunner_REFILL_BYTES, &batch)) {
+    LOG(LWARN, "Error reading tasks from queue %d", index);
+    return 0;
+  }
+
+  uint32_t read;
+  for (read = 0; read < batch.count; read++) {
+    TaskRunner_Task* task = TaskRunner_newTask(index, source->dispatched,
+                                               batch.elements[read].data,
+                                               batch.elements[read].length);
+    if (task == NULL) break;
+    source->dispatched++;
+    TaskRunner_push(runner, &worker->deque, task);
+  }
+
+  if (batch.count == 0 && QueueFile_size(source->queue) > skip) {
+    // Larger than the refill buffer, read on its own.
+    uint32_t length;
+    byte* data = QueueFile_get(source->queue, skip, &length);
+    if (data == NULL) {
+      LOG(LWARN, "Error reading task from queue %d", index);
+      return 0;
+    }
+    TaskRunner_Task* task = TaskRunner_newTask(index, source->dispatched,
+                                               data, length);
+    QueueFile_freeBuffer(source->queue, data);
+    if (task == NULL) return 0;
+    source->dispatched++;
+    TaskRunner_push(runner, &worker->deque, task);
+    read = 1;
+  }
+  return read;
+}
+
+/**
+ * Reads a batch of elements into the worker's deque, bounded by the free
+ * in-flight slots.
+ * @return number of tasks added.
+ */
+static uint32_t TaskRunner_refill(TaskRunner_Worker* worker) {
+  TaskRunner* runner = worker->runner;
+  pthread_mutex_lock(&runner->mutex);
+  uint32_t room = runner->options.maxInFlight - runner->stats.inFlight;
+  uint32_t wanted = room < runner->options.refillBatch ?
+                    room : runner->options.refillBatch;
+  // Reserve the slots so concurrent refills don't exceed maxInFlight.
+  runner->stats.inFlight += wanted;
+  uint32_t start = runner->nextSource;
+  runner->nextSource = (start + 1) % runner->sourceCount;
+  pthread_mutex_unlock(&runner->mutex);
+  if (wanted == 0) return 0;
+
+  uint32_t read = 0;
+  uint32_t i;
+  for (i = 0; i < runner->sourceCount && read < wanted; i++) {
+    uint32_t index = (start + i) % runner->sourceCount;
+    TaskRunner_Source* source = &runner->sources[index];
+    pthread_mutex_lock(&source->ioMutex);
+    read += TaskRunner_readSource(runner, index, wanted - read, worker);
+    pthread_mutex_unlock(&source->ioMutex);
+  }
+
+  pthread_mutex_lock(&runner->mutex);
+  runner->stats.inFlight -= wanted - read;
+  if (read > 1) pthread_cond_broadcast(&runner->condition);
+  pthread_mutex_unlock(&runner->mutex);
+  return read;
+}
+
+/**
+ * Removes the completed elements at the head of a source. Must hold
+ * runner->mutex, which is released while the queue is written.
+ */
+static void TaskRunner_acknowledge(TaskRunner* runner,
+                                   TaskRunner_Source* source) {
+  uint32_t capacity = runner->options.maxInFlight;
+  while (!source->acking) {
+    uint32_t count = 0;
+    while (count < capacity &&
+           source->done[(source->acknowledged + count) % capacity]) {
+      count++;
+    }
+    if (count == 0) return;
+
+    source->acking = true;
+    pthread_mutex_unlock(&runner->mutex);
+    pthread_mutex_lock(&source->ioMutex);
+    bool removed = QueueFile_removeN(source->queue, count);
+    pthread_mutex_lock(&runner->mutex);
+    if (removed) {
+      uint32_t i;
+      for (i = 0; i < count; i++) {
+        source->done[(source->acknowledged + i) % capacity] = false;
+      }
+      source->acknowledged += count;
+      runner->stats.inFlight -= count;
+      runner->stats.acknowledged += count;
+    } else {
+      // Left for the next completion on this queue to retry.
+      LOG(LWARN, "Error removing %d completed tasks", count);
+      runner->ackFailed = true;
+    }
+    pthread_mutex_unlock(&source->ioMutex);
+    source->acking = false;
+    if (!removed) return;
+  }
+}
+
+/**
+ * Waits until the runner is notified or stopped, or the timeout expired. Must
+ * hold runner->mutex.
+ */
+static void TaskRunner_wait(TaskRunner* runner, uint64_t millis) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t) (millis / 1000);
+  deadline.tv_nsec += (long) (millis % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  if (!runner->stopping) {
+    pthread_cond_timedwait(&runner->condition, &runner->mutex, &deadline);
+  }
+}
+
+/**
+ * Runs a task. Frees it once it succeeded, else puts it on the worker's
+ * retries so that the worker goes on with other tasks meanwhile.
+ */
+static void TaskRunner_execute(TaskRunner_Worker* worker,
+                               TaskRunner_Task* task) {
+  TaskRunner* runner = worker->runner;
+  if (!runner->task(runner->context, task->data, task->length)) {
+    pthread_mutex_lock(&runner->mutex);
+    runner->stats.failed++;
+    pthread_mutex_unlock(&runner->mutex);
+    task->notBefore = TaskRunner_nowMillis() +
+                      runner->options.retryDelayMillis;
+    TaskRunner_push(runner, &worker->retries, task);
+    return;
+  }
+
+  TaskRunner_Source* source = &runner->sources[task->source];
+  pthread_mutex_lock(&runner->mutex);
+  runner->stats.completed++;
+  source->done[task->sequence % runner->options.maxInFlight] = true;
+  TaskRunner_acknowledge(runner, source);
+  pthread_mutex_unlock(&runner->mutex);
+  TaskRunner_freeTask(task);
+}
+
+static void* TaskRunner_workerMain(void* arg) {
+  TaskRunner_Worker* worker = arg;
+  TaskRunner* runner = worker->runner;
+  while (true) {
+    pthread_mutex_lock(&runner->mutex);
+    bool stopping = runner->stopping;
+    pthread_mutex_unlock(&runner->mutex);
+    if (stopping) break;
+
+    uint64_t now = TaskRunner_nowMillis();
+    uint64_t nextDue = now + runner->options.idleWaitMillis;
+    TaskRunner_Task* task = TaskRunner_takeDue(runner, &worker->retries, now,
+                                               &nextDue);
+    if (task == NULL) task = TaskRunner_take(runner, &worker->deque, false);
+    if (task == NULL) task = TaskRunner_steal(worker, now);
+    if (task == NULL) {
+      if (TaskRunner_refill(worker) == 0) {
+        // Until the next retry is due at the latest.
+        pthread_mutex_lock(&runner->mutex);
+        TaskRunner_wait(runner, nextDue - now);
+        pthread_mutex_unlock(&runner->mutex);
+      }
+      continue;
+    }
+    TaskRunner_execute(worker, task);
+  }
+  return NULL;
+}
+
+/** Joins the started workers and frees everything. */
+static bool TaskRunner_free(TaskRunner* runner) {
+  uint32_t i;
+  if (runner->workers != NULL) {
+    pthread_mutex_lock(&runner->mutex);
+    runner->stopping = true;
+    pthread_cond_broadcast(&runner->condition);
+    pthread_mutex_unlock(&runner->mutex);
+
+    for (i = 0; i < runner->options.workerCount; i++) {
+      TaskRunner_Worker* worker = &runner->workers[i];
+      if (worker->started) pthread_join(worker->thread, NULL);
+    }
+    for (i = 0; i < runner->options.workerCount; i++) {
+      TaskRunner_Worker* worker = &runner->workers[i];
+      if (worker->deque.tasks == NULL) continue;
+      // Not acknowledged, they run again next time the queue is processed.
+      TaskRunner_Task* task;
+      while ((task = TaskRunner_take(runner, &worker->deque, false)) != NULL) {
+        TaskRunner_freeTask(task);
+      }
+      while ((task = TaskRunner_take(runner, &worker->retries, false)) !=
+             NULL) {
+        TaskRunner_freeTask(task);
+      }
+      free(worker->deque.tasks);
+      free(worker->retries.tasks);
+      free(worker->refillBuffer);
+      free(worker->refillElements);
+      pthread_mutex_destroy(&worker->deque.mutex);
+      pthread_mutex_destroy(&worker->retries.mutex);
+    }
+    free(runner->workers);
+  }
+  if (runner->sources != NULL) {
+    for (i = 0; i < runner->sourceCount; i++) {
+      if (runner->sources[i].done == NULL) continue;
+      free(runner->sources[i].done);
+      pthread_mutex_destroy(&runner->sources[i].ioMutex);
+    }
+    free(runner->sources);
+  }
+  bool success = !runner->ackFailed;
+  pthread_cond_destroy(&runner->condition);
+  pthread_mutex_destroy(&runner->mutex);
+  free(runner);
+  return success;
+}
+
+// see description in taskrunner.h.
+TaskRunner* TaskRunner_new(QueueFile** queues, uint32_t queueCount,
+                           TaskRunner_TaskFunc task, void* context,
+                           const TaskRunner_Options* options) {
+  if (NULLARG(queues) || NULLARG(task)) return NULL;
+  TaskRunner_Options defaults;
+  if (options == NULL) {
+    TaskRunner_initOptions(&defaults);
+    options = &defaults;
+  }
+  if (queueCount == 0 || options->workerCount == 0 ||
+      options->maxInFlight == 0 || options->refillBatch == 0) {
+    LOG(LWARN, "Task runner needs at least one queue, worker and task");
+    return NULL;
+  }
+  uint32_t i;
+  for (i = 0; i < queueCount; i++) {
+    if (NULLARG(queues[i])) return NULL;
+  }
+
+  TaskRunner* runner = malloc(sizeof(TaskRunner));
+  if (CHECKOOM(runner)) return NULL;
+  memset(runner, 0, sizeof(TaskRunner));
+  runner->options = *options;
+  runner->task = task;
+  runner->context = context;
+  runner->sourceCount = queueCount;
+  pthread_mutex_init(&runner->mutex, NULL);
+  pthread_cond_init(&runner->condition, NULL);
+
+  runner->sources = calloc((size_t) queueCount, sizeof(TaskRunner_Source));
+  if (CHECKOOM(runner->sources)) {
+    TaskRunner_free(runner);
+    return NULL;
+  }
+  for (i = 0; i < queueCount; i++) {
+    TaskRunner_Source* source = &runner->sources[i];
+    source->done = calloc((size_t) options->maxInFlight, sizeof(bool));
+    if (CHECKOOM(source->done)) {
+      TaskRunner_free(runner);
+      return NULL;
+    }
+    source->queue = queues[i];
+    pthread_mutex_init(&source->ioMutex, NULL);
+  }
+
+  runner->workers = calloc((size_t) options->workerCount,
+                           sizeof(TaskRunner_Worker));
+  if (CHECKOOM(runner->workers)) {
+    TaskRunner_free(runner);
+    return NULL;
+  }
+  for (i = 0; i < options->workerCount; i++) {
+    TaskRunner_Worker* worker = &runner->workers[i];
+    worker->deque.tasks = calloc((size_t) options->maxInFlight,
+                                 sizeof(TaskRunner_Task*));
+    worker->retries.tasks = calloc((size_t) options->maxInFlight,
+                                   sizeof(TaskRunner_Task*));
+    worker->refillBuffer = malloc(TaskRunner_REFILL_BYTES);
+    worker->refillElements = calloc((size_t) options->refillBatch,
+                                    sizeof(QueueFile_Segment));
+    if (CHECKOOM(worker->deque.tasks) || CHECKOOM(worker->retries.tasks) ||
+        CHECKOOM(worker->refillBuffer) || CHECKOOM(worker->refillElements)) {
+      free(worker->deque.tasks);
+      free(worker->retries.tasks);
+      free(worker->refillBuffer);
+      free(worker->refillElements);
+      worker->deque.tasks = NULL;
+      TaskRunner_free(runner);
+      return NULL;
+    }
+    worker->runner = runner;
+    worker->index = i;
+    pthread_mutex_init(&worker->deque.mutex, NULL);
+    pthread_mutex_init(&worker->retries.mutex, NULL);
+  }
+  // Only start once all deques exist, workers steal from each other.
+  for (i = 0; i < options->workerCount; i++) {
+    TaskRunner_Worker* worker = &runner->workers[i];
+    if (pthread_create(&worker->thread, NULL, TaskRunner_workerMain,
+                       worker) != 0) {
+      LOG(LWARN, "Could not start task runner worker %d", i);
+      TaskRunner_free(runner);
+      return NULL;
+    }
+    worker->started = true;
+  }
+  return runner;
+}
+
+// see description in taskrunner.h.
+void TaskRunner_notify(TaskRunner* runner) {
+  if (NULLARG(runner)) return;
+  pthread_mutex_lock(&runner->mutex);
+  pthread_cond_broadcast(&runner->condition);
+  pthread_mutex_unlock(&runner->mutex);
+}
+
+// see description in taskrunner.h.
+bool TaskRunner_getStats(TaskRunner* runner, TaskRunner_Stats* stats) {
+  if (NULLARG(runner) || NULLARG(stats)) return false;
+  pthread_mutex_lock(&runner->mutex);
+  *stats = runner->stats;
+  pthread_mutex_unlock(&runner->mutex);
+  return true;
+}
+
+// see description in taskrunner.h.
+bool TaskRunner_stop(TaskRunner* runner) {
+  if (NULLARG(runner)) return false;
+  return TaskRunner_free(runner);
+}
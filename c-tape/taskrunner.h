@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Executes the elements of one or more QueueFiles as tasks on a pool of
+ * worker threads, the C counterpart of the Java TaskQueue.
+ *
+ * Every worker owns a deque of tasks. When its deque runs dry it steals from
+ * the other workers, and when there is nothing to steal it refills its deque
+ * with a batch of elements read from the queues (round-robin over the
+ * queues) with one QueueFile_peekBatchAt per queue. Elements stay in their
+ * QueueFile while they are executed; once a contiguous run of the eldest
+ * elements of a queue has completed it is removed with a single
+ * QueueFile_removeN, so delivery is at-least-once: on a crash or
+ * TaskRunner_stop, tasks that have not been acknowledged run again the next
+ * time the queue is processed.
+ *
+ * At most maxInFlight elements are read ahead of the acknowledged head of the
+ * queues. When that many tasks are buffered or running, refilling stops until
+ * tasks complete, so a slow consumer doesn't pull the whole queue into memory.
+ *
+ * A task which fails goes on its worker's deque of retries and runs again,
+ * on that worker or a thief, once retryDelayMillis passed; meanwhile the
+ * workers go on with other tasks. As acknowledgement is strictly in queue
+ * order, a failing task holds back the removal of all elements behind it in
+ * the same queue, and those keep their in-flight slots until it succeeds.
+ *
+ * The runner must be the only consumer of its queues (producers may keep
+ * adding), and the queues must stay open until TaskRunner_stop returned.
+ * Queues holding compressed elements can't be used, as batches can't be read
+ * from them.
+ */
+
+#ifndef TASKRUNNER_H_
+#define TASKRUNNER_H_
+
+#include"types.h"
+#include"queuefile.h"
+
+struct _TaskRunner;
+typedef struct _TaskRunner TaskRunner;
+
+/**
+ * Executes one task. Called concurrently from all workers.
+ * @param context as passed to TaskRunner_new.
+ * @param data element bytes, only valid during the call.
+ * @param length number of bytes in data.
+ * @return true if the task completed and its element may be removed, false
+ *         to retry it later.
+ */
+typedef bool (*TaskRunner_TaskFunc)(void* context, const byte* data,
+                                    uint32_t length);
+
+typedef struct {
+  /** Number of worker threads, default 4. */
+  uint32_t workerCount;
+  /**
+   * Maximum number of elements read from the queues but not yet acknowledged,
+   * default 64. Bounds the memory held by the runner.
+   */
+  uint32_t maxInFlight;
+  /** Maximum number of elements read per refill, default 16. */
+  uint32_t refillBatch;
+  /** How long idle workers sleep before polling the queues again, default 100. */
+  uint32_t idleWaitMillis;
+  /** Delay before a failed task is retried, default 1000. */
+  uint32_t retryDelayMillis;
+} TaskRunner_Options;
+
+/** Statistics since the runner was started, see TaskRunner_getStats. */
+typedef struct {
+  /** Tasks which completed successfully. */
+  uint64_t completed;
+  /** Task executions which returned false. */
+  uint64_t failed;
+  /** Tasks taken from another worker's deque. */
+  uint64_t stolen;
+  /** Elements removed from the queues. */
+  uint64_t acknowledged;
+  /** Elements currently read but not acknowledged. */
+  uint32_t inFlight;
+} TaskRunner_Stats;
+
+/** Fills in the default options. */
+void TaskRunner_initOptions(TaskRunner_Options* options);
+
+/**
+ * Starts executing the elements of the given queues.
+ * @param queues queues to consume, the runner doesn't take ownership.
+ * @param queueCount number of queues, must be > 0.
+ * @param task function executing an element.
+ * @param context passed to task.
+ * @param options options, NULL for defaults.
+ * @return new runner or NULL on error.
+ */
+TaskRunner* TaskRunner_new(QueueFile** queues, uint32_t queueCount,
+                           TaskRunner_TaskFunc task, void* context,
+                           const TaskRunner_Options* options);
+
+/**
+ * Wakes idle workers, e.g. after adding elements to one of the queues, so
+ * they don't wait for idleWaitMillis.
+ */
+void TaskRunner_notify(TaskRunner* runner);
+
+/**
+ * Copies the statistics of the runner.
+ * @return false if NULL is passed.
+ */
+bool TaskRunner_getStats(TaskRunner* runner, TaskRunner_Stats* stats);
+
+/**
+ * Stops the workers once their current task returned, and frees all memory
+ * including the pointer passed. Tasks not executed yet stay in their queues.
+ * @param runner runner.
+ * @return false if an error occurred acknowledging tasks.
+ */
+bool TaskRunner_stop(TaskRunner* runner);
+
+#endif //taskrunner_h
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks that the hot paths don't touch the heap. malloc, calloc and realloc
+ * are interposed for the whole process (libc included, so stdio buffers are
+ * counted too) and forward to glibc's implementation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minunit.h"
+
+#include "../logutil.h"
+#include "../queuefile.h"
+#include "../types.h"
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+static uint32_t allocations;
+
+void* malloc(size_t size) {
+  __sync_fetch_and_add(&allocations, 1);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  __sync_fetch_and_add(&allocations, 1);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+  __sync_fetch_and_add(&allocations, 1);
+  return __libc_realloc(pointer, size);
+}
+
+#define TEST_QUEUE_FILENAME "test-alloc.queue"
+#define ROUNDS 1000
+static QueueFile* queue;
+int tests_run = 0;
+
+static void mu_setup() {
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+}
+
+static void mu_teardown() {
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+}
+
+static bool readElement(QueueFile_ElementStream* stream, uint32_t length) {
+  byte buffer[64];
+  uint32_t remaining;
+  mu_assert(length <= sizeof(buffer));
+  mu_assert(QueueFile_readElementStream(stream, buffer, length, &remaining));
+  return true;
+}
+
+static bool readBatch(void* context, const QueueFile_Segment* elements,
+                      uint32_t count) {
+  (void) elements;
+  *(uint32_t*) context += count;
+  return true;
+}
+
+static uint32_t countAllocations() {
+  return __sync_fetch_and_add(&allocations, 0);
+}
+
+static void testAddAndRemoveDontAllocate() {
+  byte data[32];
+  memset(data, 7, sizeof(data));
+  // First I/O sets up the stdio buffer.
+  mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+
+  uint32_t before = countAllocations();
+  int i;
+  for (i = 0; i < ROUNDS; i++) {
+    mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+    mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+    mu_assert(QueueFile_remove(queue));
+    mu_assert(QueueFile_removeN(queue, 1));
+  }
+  mu_assertm(countAllocations() == before, "heap allocation on hot path");
+}
+
+static void testReadersDontAllocate() {
+  byte data[32];
+  memset(data, 7, sizeof(data));
+  int i;
+  for (i = 0; i < 10; i++) {
+    mu_assert(QueueFile_add(queue, data, 0, (uint32_t) i));
+  }
+
+  byte buffer[64];
+  uint32_t length;
+  byte batchBuffer[1024];
+  QueueFile_Segment elements[10];
+  QueueFile_Batch batch = { batchBuffer, elements, 0, 0 };
+  // The first forEach allocates the window it scans the queue with.
+  mu_assert(QueueFile_forEach(queue, readElement));
+  uint32_t before = countAllocations();
+  for (i = 0; i < ROUNDS; i++) {
+    mu_assert(QueueFile_peekSize(queue) == 0);
+    mu_assert(QueueFile_peekInto(queue, buffer, sizeof(buffer), &length) ==
+              QueueFile_PEEK_OK);
+    mu_assert(QueueFile_peekBatch(queue, 10, sizeof(batchBuffer), &batch));
+    mu_assert(batch.count == 10);
+    mu_assert(QueueFile_peekWithElementReader(queue, readElement));
+    mu_assert(QueueFile_forEach(queue, readElement));
+    uint32_t batched = 0;
+    mu_assert(QueueFile_forEachBatch(queue, elements, 10, readBatch,
+                                     &batched));
+    mu_assert(batched == 10);
+  }
+  mu_assertm(countAllocations() == before, "heap allocation on hot path");
+}
+
+int main() {
+  LOG_SETDEBUGFAILLEVEL_WARN;
+  mu_run_test(testAddAndRemoveDontAllocate);
+  mu_run_test(testReadersDontAllocate);
+
+  printf("%d tests passed.\n", tests_run);
+  return 0;
+}
@@ -14,11 +14,16 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
+#include <dirent.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/queue.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "minunit.h"
 
@@ -454,6 +459,1380 @@ static void testFailedRemoval() {
   _assertPeekCompareRemove(queue, values[99], 99);
 }
 
+static void testRemoveN() {
+  int i;
+  for (i = 1; i <= 10; i++) mu_assert(QueueFile_add(queue, values[i], 0, (uint32_t) i));
+  mu_assert(QueueFile_removeN(queue, 0));
+  mu_assert(!QueueFile_removeN(queue, 11));
+  mu_assert(QueueFile_size(queue) == 10);
+  mu_assert(QueueFile_removeN(queue, 4));
+  mu_assert(QueueFile_size(queue) == 6);
+  _assertPeekCompare(queue, values[5], 5);
+
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert(QueueFile_size(queue) == 6);
+  _assertPeekCompare(queue, values[5], 5);
+  mu_assert(QueueFile_removeN(queue, 6));
+  mu_assert(QueueFile_isEmpty(queue));
+}
+
+static void testPeekInto() {
+  byte buffer[N];
+  uint32_t length = 99;
+  mu_assert(QueueFile_peekInto(queue, buffer, sizeof(buffer), &length) ==
+            QueueFile_PEEK_EMPTY);
+  mu_assert(length == 0);
+  mu_assert(QueueFile_peekSize(queue) == 0);
+
+  mu_assert(QueueFile_add(queue, values[100], 0, 100));
+  mu_assert(QueueFile_add(queue, values[0], 0, 0));
+  mu_assert(QueueFile_peekSize(queue) == 100);
+  mu_assert(QueueFile_peekInto(queue, NULL, 0, &length) ==
+            QueueFile_PEEK_TOO_SMALL);
+  mu_assert(length == 100);
+  mu_assert(QueueFile_peekInto(queue, buffer, 99, &length) ==
+            QueueFile_PEEK_TOO_SMALL);
+  mu_assert(QueueFile_peekInto(queue, buffer, sizeof(buffer), &length) ==
+            QueueFile_PEEK_OK);
+  mu_assert(length == 100);
+  mu_assert_memcmp(buffer, values[100], 100);
+
+  mu_assert(QueueFile_remove(queue));
+  mu_assert(QueueFile_peekInto(queue, NULL, 0, &length) == QueueFile_PEEK_OK);
+  mu_assert(length == 0);
+}
+
+static void _assertViewEquals(QueueFile_View* view, const byte* data,
+                              uint32_t length) {
+  mu_assert(view->length == length);
+  mu_assert(view->segments[0].length + view->segments[1].length == length);
+  mu_assert_memcmp(view->segments[0].data, data, view->segments[0].length);
+  if (view->segmentCount == 2) {
+    mu_assert_memcmp(view->segments[1].data, data + view->segments[0].length,
+                     view->segments[1].length);
+  }
+}
+
+static void testPeekViewOfWrappedElementSurvivesExpansion() {
+  QueueFile_View view;
+  mu_assert(!QueueFile_peekView(queue, &view));
+
+  byte blocks[20][1000];
+  int i;
+  for (i = 0; i < 20; i++) memset(blocks[i], i + 1, sizeof(blocks[i]));
+  // 4 blocks fill the initial 4096 bytes up to 4032, the 5th wraps.
+  for (i = 0; i < 4; i++) mu_assert(QueueFile_add(queue, blocks[i], 0, 1000));
+  mu_assert(QueueFile_removeN(queue, 3));
+  mu_assert(QueueFile_add(queue, blocks[4], 0, 1000));
+  mu_assert(QueueFile_peekView(queue, &view));
+  mu_assert(view.segmentCount == 1);
+  _assertViewEquals(&view, blocks[3], 1000);
+  mu_assert(QueueFile_remove(queue));
+
+  mu_assert(QueueFile_peekView(queue, &view));
+  mu_assert(view.segmentCount == 2);
+  _assertViewEquals(&view, blocks[4], 1000);
+
+  // Expands and moves the front of the ring, the view still reads the old copy.
+  for (i = 5; i < 20; i++) mu_assert(QueueFile_add(queue, blocks[i], 0, 1000));
+  _assertViewEquals(&view, blocks[4], 1000);
+  _assertPeekCompare(queue, blocks[4], 1000);
+  mu_assert(QueueFile_remove(queue));
+
+  for (i = 5; i < 20; i++) {
+    mu_assert(QueueFile_peekView(queue, &view));
+    _assertViewEquals(&view, blocks[i], 1000);
+    mu_assert(QueueFile_remove(queue));
+  }
+  mu_assert(QueueFile_isEmpty(queue));
+}
+
+static void testPeekBatch() {
+  byte buffer[4096];
+  QueueFile_Segment elements[8];
+  QueueFile_Batch batch = { buffer, elements, 0, 0 };
+  mu_assert(QueueFile_peekBatch(queue, 8, sizeof(buffer), &batch));
+  mu_assert(batch.count == 0);
+
+  int i;
+  for (i = 1; i <= 20; i++) {
+    mu_assert(QueueFile_add(queue, values[i], 0, (uint32_t) i));
+  }
+  // Limited by count.
+  mu_assert(QueueFile_peekBatch(queue, 8, sizeof(buffer), &batch));
+  mu_assert(batch.count == 8);
+  for (i = 0; i < 8; i++) {
+    mu_assert(elements[i].length == (uint32_t) i + 1);
+    mu_assert_memcmp(elements[i].data, values[i + 1], i + 1);
+  }
+  mu_assert(batch.bytes == 8 * 4 + 36);
+  mu_assert(QueueFile_removeN(queue, batch.count));
+
+  // Limited by bytes: 9 + 10 + 4 * 2 fit into 30, 11 doesn't.
+  mu_assert(QueueFile_peekBatch(queue, 8, 30, &batch));
+  mu_assert(batch.count == 2);
+  mu_assert_memcmp(elements[1].data, values[10], 10);
+  mu_assert(QueueFile_removeN(queue, batch.count));
+
+  // The eldest element doesn't fit at all.
+  mu_assert(QueueFile_peekBatch(queue, 8, 10, &batch));
+  mu_assert(batch.count == 0);
+
+  // Starting at the 4th of 11..20, limited by the elements left.
+  mu_assert(QueueFile_peekBatchAt(queue, 3, 8, sizeof(buffer), &batch));
+  mu_assert(batch.count == 7);
+  for (i = 0; i < 7; i++) {
+    mu_assert(elements[i].length == (uint32_t) i + 14);
+    mu_assert_memcmp(elements[i].data, values[i + 14], i + 14);
+  }
+  mu_assert(QueueFile_peekBatchAt(queue, 10, 8, sizeof(buffer), &batch));
+  mu_assert(batch.count == 0);
+}
+
+static void testPeekBatchOfWrappedRing() {
+  byte blocks[6][1000];
+  int i;
+  for (i = 0; i < 6; i++) memset(blocks[i], i + 1, sizeof(blocks[i]));
+  // The 5th block wraps at the end of the initial 4096 bytes.
+  for (i = 0; i < 4; i++) mu_assert(QueueFile_add(queue, blocks[i], 0, 1000));
+  mu_assert(QueueFile_removeN(queue, 3));
+  mu_assert(QueueFile_add(queue, blocks[4], 0, 1000));
+  mu_assert(QueueFile_add(queue, blocks[5], 0, 1000));
+
+  static byte buffer[4 * 1004];
+  QueueFile_Segment elements[4];
+  QueueFile_Batch batch = { buffer, elements, 0, 0 };
+  mu_assert(QueueFile_peekBatch(queue, 4, sizeof(buffer), &batch));
+  mu_assert(batch.count == 3);
+  for (i = 0; i < 3; i++) {
+    mu_assert(elements[i].length == 1000);
+    mu_assert_memcmp(elements[i].data, blocks[i + 3], 1000);
+  }
+  mu_assert(QueueFile_removeN(queue, 3));
+  mu_assert(QueueFile_isEmpty(queue));
+}
+
+static void _assertPeekAt(QueueFile* queue, uint32_t n, const byte* data,
+                          uint32_t length) {
+  static byte buffer[8192];
+  uint32_t actual;
+  mu_assert(QueueFile_peekAt(queue, n, buffer, sizeof(buffer), &actual) ==
+            QueueFile_PEEK_OK);
+  mu_assert(actual == length);
+  mu_assert_memcmp(buffer, data, length);
+}
+
+static void _reopenIndexed(uint32_t indexMaxElements) {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.indexed = true;
+  options.indexMaxElements = indexMaxElements;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+}
+
+static void testPeekAtAndSizeInBytes() {
+  uint32_t length;
+  mu_assert(QueueFile_peekAt(queue, 0, NULL, 0, &length) ==
+            QueueFile_PEEK_EMPTY);
+  mu_assert(QueueFile_sizeInBytes(queue) == 0);
+  QueueFile_IndexStats stats;
+  mu_assert(!QueueFile_getIndexStats(queue, &stats));
+
+  uint32_t i;
+  uint64_t size = 0;
+  for (i = 0; i < N; i++) {
+    mu_assert(QueueFile_add(queue, values[i], 0, i));
+    size += i;
+  }
+  mu_assert(QueueFile_sizeInBytes(queue) == size);
+  for (i = 0; i < N; i += 50) _assertPeekAt(queue, i, values[i], i);
+  mu_assert(QueueFile_peekAt(queue, N, NULL, 0, &length) ==
+            QueueFile_PEEK_EMPTY);
+  mu_assert(QueueFile_peekAt(queue, 5, NULL, 4, &length) ==
+            QueueFile_PEEK_TOO_SMALL);
+  mu_assert(length == 5);
+  mu_assert(QueueFile_removeN(queue, 100));
+  mu_assert(QueueFile_sizeInBytes(queue) == size - 99 * 100 / 2);
+  _assertPeekAt(queue, 0, values[100], 100);
+}
+
+static void testIndexedQueue() {
+  _reopenIndexed(0);
+  QueueFile_IndexStats stats;
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == 0);
+
+  // Wrap the ring, then expand it so that the wrapped elements are moved.
+  byte blocks[6][1000];
+  uint32_t i;
+  for (i = 0; i < 6; i++) memset(blocks[i], (int) i + 1, sizeof(blocks[i]));
+  for (i = 0; i < 4; i++) mu_assert(QueueFile_add(queue, blocks[i], 0, 1000));
+  mu_assert(QueueFile_removeN(queue, 3));
+  mu_assert(QueueFile_add(queue, blocks[4], 0, 1000));
+  mu_assert(QueueFile_add(queue, blocks[5], 0, 1000));
+  for (i = 0; i < N; i++) mu_assert(QueueFile_add(queue, values[i], 0, i));
+
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == N + 3);
+  mu_assert(stats.memoryBytes == (uint64_t) stats.capacity * 12);
+  for (i = 0; i < 3; i++) _assertPeekAt(queue, i, blocks[i + 3], 1000);
+  for (i = 0; i < N; i++) _assertPeekAt(queue, i + 3, values[i], i);
+  mu_assert(QueueFile_sizeInBytes(queue) == 3000 + N * (N - 1) / 2);
+
+  // Rebuilt from the file.
+  _reopenIndexed(0);
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == N + 3);
+  mu_assert(QueueFile_removeN(queue, 103));
+  mu_assert(QueueFile_remove(queue));
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == N - 101);
+  _assertPeekCompare(queue, values[101], 101);
+  for (i = 101; i < N; i++) _assertPeekAt(queue, i - 101, values[i], i);
+
+  mu_assert(QueueFile_clear(queue));
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == 0);
+  mu_assert(QueueFile_add(queue, values[7], 0, 7));
+  _assertPeekAt(queue, 0, values[7], 7);
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+}
+
+static void testIndexIsBounded() {
+  _reopenIndexed(100);
+  uint32_t i;
+  for (i = 0; i < N; i++) mu_assert(QueueFile_add(queue, values[i], 0, i));
+  QueueFile_IndexStats stats;
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == 100);
+  mu_assert(stats.capacity == 128);
+
+  // Past the index the element headers are read, and indexed again as the
+  // eldest elements are removed.
+  _assertPeekAt(queue, 200, values[200], 200);
+  mu_assert(QueueFile_removeN(queue, 150));
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == 0);
+  for (i = 150; i < N; i++) _assertPeekAt(queue, i - 150, values[i], i);
+  mu_assert(QueueFile_getIndexStats(queue, &stats));
+  mu_assert(stats.entries == 100);
+  for (i = 150; i < N; i++) _assertPeekCompareRemove(queue, values[i], i);
+  mu_assert(QueueFile_isEmpty(queue));
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+}
+
+static void testTailCache() {
+  QueueFile_CacheStats stats;
+  mu_assert(!QueueFile_getCacheStats(queue, &stats));
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.tailCacheBytes = 1500;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  // Wrap the ring, then expand it so that the wrapped elements are moved.
+  byte blocks[6][1000];
+  uint32_t i;
+  for (i = 0; i < 6; i++) memset(blocks[i], (int) i + 1, sizeof(blocks[i]));
+  for (i = 0; i < 4; i++) mu_assert(QueueFile_add(queue, blocks[i], 0, 1000));
+  mu_assert(QueueFile_removeN(queue, 3));
+  mu_assert(QueueFile_add(queue, blocks[4], 0, 1000));
+
+  // Only the newer of the two elements is still cached.
+  mu_assert(QueueFile_getCacheStats(queue, &stats));
+  mu_assert(stats.capacity == 1500);
+  mu_assert(stats.cachedBytes == 1500);
+  uint64_t misses = stats.misses;
+  _assertPeekAt(queue, 1, blocks[4], 1000);
+  mu_assert(QueueFile_getCacheStats(queue, &stats));
+  mu_assert(stats.misses == misses);
+  mu_assert(stats.hits > 0);
+  _assertPeekCompare(queue, blocks[3], 1000);
+  mu_assert(QueueFile_getCacheStats(queue, &stats));
+  mu_assert(stats.misses > misses);
+
+  mu_assert(QueueFile_add(queue, blocks[5], 0, 1000));
+  for (i = 0; i < N; i++) mu_assert(QueueFile_add(queue, values[i], 0, i));
+  for (i = 3; i < 6; i++) _assertPeekCompareRemove(queue, blocks[i], 1000);
+  for (i = 0; i < N; i++) _assertPeekCompareRemove(queue, values[i], i);
+
+  // Cleared queues start over at the beginning of the ring.
+  mu_assert(QueueFile_add(queue, values[5], 0, 5));
+  mu_assert(QueueFile_clear(queue));
+  mu_assert(QueueFile_add(queue, values[9], 0, 9));
+  mu_assert(QueueFile_getCacheStats(queue, &stats));
+  mu_assert(stats.cachedBytes == 13);
+  misses = stats.misses;
+  _assertPeekCompare(queue, values[9], 9);
+  mu_assert(QueueFile_getCacheStats(queue, &stats));
+  mu_assert(stats.misses == misses);
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+}
+
+#define STREAM_ELEMENT_LENGTH 10000
+static byte streamElement[STREAM_ELEMENT_LENGTH];
+static uint32_t streamElementsRead;
+
+/** Reads bytewise, in small chunks and with one large read, in turns. */
+static bool streamReader(QueueFile_ElementStream* stream, uint32_t length) {
+  const byte* expected = streamElement + (streamElementsRead + 1) * 7;
+  static byte buffer[STREAM_ELEMENT_LENGTH];
+  uint32_t offset = 0;
+  uint32_t remaining = length;
+  while (offset < 5000 && offset < length) {
+    int value = QueueFile_readElementStreamNextByte(stream);
+    mu_assert(value == expected[offset]);
+    offset++;
+  }
+  while (offset < 6000 && offset < length) {
+    uint32_t chunk = length - offset < 3 ? length - offset : 3;
+    mu_assert(QueueFile_readElementStream(stream, buffer + offset, chunk,
+                                          &remaining));
+    offset += chunk;
+    mu_assert(remaining == length - offset);
+  }
+  mu_assert(QueueFile_readElementStream(stream, buffer + offset,
+                                        length - offset, NULL));
+  mu_assert_memcmp(buffer + 5000, expected + 5000, length - 5000);
+  mu_assert(QueueFile_readElementStreamNextByte(stream) == -1);
+  streamElementsRead++;
+  return true;
+}
+
+static void testBufferedElementStreams() {
+  uint32_t i;
+  for (i = 0; i < STREAM_ELEMENT_LENGTH; i++) streamElement[i] = (byte) (i % 251);
+  // The file grows to 16384 bytes, the third element wraps around its end.
+  mu_assert(QueueFile_add(queue, streamElement, 0, 6000));
+  mu_assert(QueueFile_add(queue, streamElement, 7, 6000));
+  mu_assert(QueueFile_remove(queue));
+  mu_assert(QueueFile_add(queue, streamElement, 14, 9000));
+  mu_assert(16384 == FileIo_getLength(_for_testing_QueueFile_getFhandle(queue)));
+  streamElementsRead = 0;
+  mu_assert(QueueFile_forEach(queue, streamReader));
+  mu_assert(streamElementsRead == 2);
+}
+
+#define SCAN_ELEMENTS 3000
+static uint32_t scanElementsRead;
+static uint32_t nestedElementsRead;
+
+static bool nestedScanReader(QueueFile_ElementStream* stream, uint32_t length) {
+  (void) stream;
+  mu_assert(length == (nestedElementsRead + N - 1) % N);
+  nestedElementsRead++;
+  return true;
+}
+
+static bool scanReader(QueueFile_ElementStream* stream, uint32_t length) {
+  uint32_t expected = (scanElementsRead + N - 1) % N;
+  byte buffer[N];
+  mu_assert(length == expected);
+  mu_assert(QueueFile_readElementStream(stream, buffer, length, NULL));
+  mu_assert_memcmp(buffer, values[expected], expected);
+  if (scanElementsRead++ == 0) {
+    // Nested iterations can't use the scan window.
+    mu_assert(QueueFile_forEach(queue, nestedScanReader));
+    mu_assert(nestedElementsRead == SCAN_ELEMENTS);
+  }
+  return true;
+}
+
+static void testForEachAcrossScanWindows() {
+  uint32_t i;
+  // Let the elements wrap around the end of the ring before it grows.
+  for (i = 0; i < N; i++) mu_assert(QueueFile_add(queue, values[i], 0, i));
+  mu_assert(QueueFile_removeN(queue, N - 1));
+  for (i = 1; i < SCAN_ELEMENTS; i++) {
+    uint32_t length = (i + N - 1) % N;
+    mu_assert(QueueFile_add(queue, values[length], 0, length));
+  }
+  scanElementsRead = nestedElementsRead = 0;
+  mu_assert(QueueFile_forEach(queue, scanReader));
+  mu_assert(scanElementsRead == SCAN_ELEMENTS);
+}
+
+typedef struct {
+  /** Number of elements seen so far. */
+  uint32_t elements;
+  uint32_t calls;
+  /** Element at which to stop, or 0. */
+  uint32_t stopAt;
+} BatchScan;
+
+static byte largeElement[100000];
+
+/** Expects values[i % N] for element i, and largeElement for element 1000. */
+static bool batchReader(void* context, const QueueFile_Segment* elements,
+                        uint32_t count) {
+  BatchScan* scan = context;
+  mu_assert(count > 0 && count <= 16);
+  uint32_t i;
+  for (i = 0; i < count; i++, scan->elements++) {
+    if (scan->elements == 1000) {
+      mu_assert(count == 1);
+      mu_assert(elements[i].length == sizeof(largeElement));
+      mu_assert_memcmp(elements[i].data, largeElement, sizeof(largeElement));
+    } else {
+      uint32_t length = scan->elements % N;
+      mu_assert(elements[i].length == length);
+      mu_assert_memcmp(elements[i].data, values[length], length);
+    }
+  }
+  scan->calls++;
+  return scan->stopAt == 0 || scan->elements < scan->stopAt;
+}
+
+static void testForEachBatch() {
+  QueueFile_Segment elements[16];
+  BatchScan scan = { 0, 0, 0 };
+  mu_assert(QueueFile_forEachBatch(queue, elements, 16, batchReader, &scan));
+  mu_assert(scan.calls == 0);
+
+  uint32_t i;
+  for (i = 0; i < sizeof(largeElement); i++) largeElement[i] = (byte) (i % 13);
+  for (i = 0; i < 2000; i++) {
+    if (i == 1000) {
+      mu_assert(QueueFile_add(queue, largeElement, 0, sizeof(largeElement)));
+    } else {
+      mu_assert(QueueFile_add(queue, values[i % N], 0, i % N));
+    }
+  }
+  mu_assert(QueueFile_forEachBatch(queue, elements, 16, batchReader, &scan));
+  mu_assert(scan.elements == 2000);
+  // Batches are full except where the window moves on.
+  mu_assert(scan.calls < 2000 / 16 + 20);
+
+  BatchScan stopped = { 0, 0, 20 };
+  mu_assert(QueueFile_forEachBatch(queue, elements, 16, batchReader,
+                                   &stopped));
+  mu_assert(stopped.elements == 32);
+}
+
+#define V1_FILE_LENGTH 4096
+#define V1_HEADER_LENGTH 16
+
+/** Fills buffer with the data of the i-th element of a version 1 file. */
+static void _v1ElementData(byte* buffer, uint32_t i, uint32_t length) {
+  uint32_t j;
+  for (j = 0; j < length; j++) buffer[j] = (byte) (i * 31 + j);
+}
+
+/** Copies bytes into the ring of a version 1 file, wrapping at its end. */
+static uint32_t _v1RingWrite(byte* file, uint32_t position, const byte* data,
+                             uint32_t length) {
+  uint32_t j;
+  for (j = 0; j < length; j++) {
+    file[position] = data[j];
+    position = position + 1 == V1_FILE_LENGTH ? V1_HEADER_LENGTH : position + 1;
+  }
+  return position;
+}
+
+static void _writeBigEndian(byte* buffer, uint32_t value) {
+  buffer[0] = (byte) (value >> 24);
+  buffer[1] = (byte) (value >> 16);
+  buffer[2] = (byte) (value >> 8);
+  buffer[3] = (byte) value;
+}
+
+/**
+ * Writes a version 1 queue file holding elements of the given lengths, the
+ * first one at position first, then opens it as queue.
+ */
+static void _openV1File(uint32_t first, const uint32_t* lengths,
+                        uint32_t count) {
+  static byte file[V1_FILE_LENGTH];
+  static byte data[V1_FILE_LENGTH];
+  memset(file, 0, sizeof(file));
+  uint32_t position = first;
+  uint32_t last = 0;
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    last = position;
+    byte length[4];
+    _writeBigEndian(length, lengths[i]);
+    _v1ElementData(data, i, lengths[i]);
+    position = _v1RingWrite(file, position, length, 4);
+    position = _v1RingWrite(file, position, data, lengths[i]);
+  }
+  _writeBigEndian(file, V1_FILE_LENGTH);
+  _writeBigEndian(file + 4, count);
+  _writeBigEndian(file + 8, count > 0 ? first : 0);
+  _writeBigEndian(file + 12, last);
+
+  QueueFile_closeAndFree(queue);
+  FILE* out = fopen(TEST_QUEUE_FILENAME, "w");
+  mu_assert_notnull(out);
+  mu_assert(fwrite(file, 1, sizeof(file), out) == sizeof(file));
+  fclose(out);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+}
+
+/** Checks the queue holds the elements _openV1File wrote and drains it. */
+static void _assertV1Elements(const uint32_t* lengths, uint32_t count) {
+  static byte data[V1_FILE_LENGTH];
+  mu_assert(QueueFile_size(queue) == count);
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    _assertPeekCompareRemove(queue, data, lengths[i]);
+  }
+  mu_assert(QueueFile_isEmpty(queue));
+}
+
+static void _assertVersion2(uint64_t fileLength) {
+  FILE* in = fopen(TEST_QUEUE_FILENAME, "r");
+  mu_assert_notnull(in);
+  byte magic[4];
+  mu_assert(fread(magic, 1, sizeof(magic), in) == sizeof(magic));
+  mu_assert(memcmp(magic, "QFv2", sizeof(magic)) == 0);
+  mu_assert(FileIo_getLength(in) == (int64_t) fileLength);
+  fclose(in);
+}
+
+static void testMigratesVersion1Files() {
+  // Wrapped, the first element straddles the end of the ring.
+  const uint32_t wrapped[] = { 100, 200, 0, 50 };
+  _openV1File(4000, wrapped, 4);
+  _assertVersion2(V1_FILE_LENGTH);
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+  _assertV1Elements(wrapped, 4);
+
+  // Too full for the longer header, the file doubles.
+  const uint32_t full[] = { 3000, 1040 };
+  _openV1File(V1_HEADER_LENGTH, full, 2);
+  _assertVersion2(2 * V1_FILE_LENGTH);
+  _assertV1Elements(full, 2);
+  mu_assert(QueueFile_add(queue, values[10], 0, 10));
+  _assertPeekCompareRemove(queue, values[10], 10);
+
+  const uint32_t empty[] = { 0 };
+  _openV1File(0, empty, 0);
+  _assertVersion2(V1_FILE_LENGTH);
+  mu_assert(QueueFile_isEmpty(queue));
+}
+
+static int64_t _queueFileLength() {
+  return FileIo_getLength(_for_testing_QueueFile_getFhandle(queue));
+}
+
+static void testExpansionMovesSmallerSideOfWrappedRing() {
+  // Element lengths, A is removed before the ring wraps.
+  const uint32_t lengths[] = { 3000, 500, 400, 1000, 1500, 1000 };
+  static byte data[3000];
+  uint32_t i;
+  for (i = 0; i < 5; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    mu_assert(QueueFile_add(queue, data, 0, lengths[i]));
+    if (i == 1) mu_assert(QueueFile_remove(queue));
+  }
+  // B..E now run from 3068 to the end of the file (1028 bytes) and wrap,
+  // filling the front up to 2452 (2388 bytes); F makes the file double and
+  // the shorter back part is moved to the new end.
+  _v1ElementData(data, 5, lengths[5]);
+  mu_assert(QueueFile_add(queue, data, 0, lengths[5]));
+  mu_assert(_queueFileLength() == 8192);
+
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+  mu_assert(QueueFile_size(queue) == 5);
+  for (i = 1; i < 6; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    _assertPeekCompareRemove(queue, data, lengths[i]);
+  }
+}
+
+/** Reads count bytes of the header of the test queue at offset. */
+static void _readHeaderBytes(long offset, byte* bytes, size_t count) {
+  FILE* in = fopen(TEST_QUEUE_FILENAME, "r");
+  mu_assert_notnull(in);
+  mu_assert(fseek(in, offset, SEEK_SET) == 0);
+  mu_assert(fread(bytes, 1, count, in) == count);
+  fclose(in);
+}
+
+/** Returns the low byte of the header flags of the test queue. */
+static byte _headerFlags() {
+  byte flags[4];
+  _readHeaderBytes(4, flags, sizeof(flags));
+  return flags[3];
+}
+
+/**
+ * Returns the file length committed in the header of the test queue, the file
+ * may be longer while an expansion is under way.
+ */
+static uint64_t _headerFileLength() {
+  byte bytes[8];
+  _readHeaderBytes(8, bytes, sizeof(bytes));
+  uint64_t length = 0;
+  uint32_t i;
+  for (i = 0; i < sizeof(bytes); i++) length = length << 8 | bytes[i];
+  return length;
+}
+
+/** Returns the bit of the header flags telling a relocation is pending. */
+static bool _isRelocating() {
+  return (_headerFlags() & 2) != 0;
+}
+
+static void testIncrementalExpansion() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.expansionStepBytes = 512;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  // Same ring as in testExpansionMovesSmallerSideOfWrappedRing: both sides
+  // are longer than a step, so F only copies the first 512 bytes of the
+  // 2388 byte front and is readable right away.
+  const uint32_t lengths[] = { 3000, 500, 400, 1000, 1500, 1000 };
+  static byte data[3000];
+  uint32_t i;
+  for (i = 0; i < 6; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    mu_assert(QueueFile_add(queue, data, 0, lengths[i]));
+    if (i == 1) mu_assert(QueueFile_remove(queue));
+  }
+  mu_assert(_queueFileLength() == 8192);
+  mu_assert(_isRelocating());
+  for (i = 1; i < 6; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    _assertPeekAt(queue, i - 1, data, lengths[i]);
+  }
+
+  // The progress survives reopening, as after a crash.
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  mu_assert(_isRelocating());
+
+  // Each removal copies another step, four of them finish the front.
+  for (i = 1; i < 5; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    _assertPeekCompareRemove(queue, data, lengths[i]);
+  }
+  mu_assert(!_isRelocating());
+  _v1ElementData(data, 5, lengths[5]);
+  _assertPeekCompare(queue, data, lengths[5]);
+
+  // Without the option a pending relocation is finished when opening.
+  mu_assert(QueueFile_clear(queue));
+  for (i = 0; i < 6; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    mu_assert(QueueFile_add(queue, data, 0, lengths[i]));
+    if (i == 1) mu_assert(QueueFile_remove(queue));
+  }
+  mu_assert(_isRelocating());
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+  mu_assert(!_isRelocating());
+  for (i = 1; i < 6; i++) {
+    _v1ElementData(data, i, lengths[i]);
+    _assertPeekCompareRemove(queue, data, lengths[i]);
+  }
+
+  // Grown by half, from 8192 to 12288 bytes, the front goes to 8192 instead
+  // of half the file; the header keeps where.
+  options.initialLength = 8192;
+  options.growthPercent = 50;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  for (i = 0; i < 12; i++) {
+    _v1ElementData(data, i, 1000);
+    mu_assert(QueueFile_add(queue, data, 0, 1000));
+    if (i == 7) {
+      mu_assert(QueueFile_removeN(queue, 3));
+    }
+  }
+  mu_assert(_queueFileLength() == 12288);
+  mu_assert(_isRelocating());
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  mu_assert(_isRelocating());
+  for (i = 3; i < 12; i++) {
+    _v1ElementData(data, i, 1000);
+    _assertPeekCompareRemove(queue, data, 1000);
+  }
+  mu_assert(!_isRelocating());
+}
+
+static void testExpandsAheadInBackground() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.expandAtPercent = 90;
+  options.expansionStepBytes = 256;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  // E wraps and fills 4080 of the 4096 bytes, more than 90%.
+  static byte data[1000];
+  uint32_t i;
+  for (i = 0; i < 5; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+    if (i == 1) mu_assert(QueueFile_remove(queue));
+  }
+
+  // The I/O thread doubles the file and copies the front in steps.
+  for (i = 0; i < 5000 && (_headerFileLength() != 8192 || _isRelocating());
+       i++) {
+    usleep(1000);
+  }
+  mu_assert(_queueFileLength() == 8192);
+  mu_assert(!_isRelocating());
+  for (i = 1; i < 5; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    _assertPeekAt(queue, i - 1, data, sizeof(data));
+  }
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+  for (i = 1; i < 5; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    _assertPeekCompareRemove(queue, data, sizeof(data));
+  }
+
+  // Grown by half, not doubled. K wraps and fills 8096 of the 8192 bytes.
+  options.initialLength = 8192;
+  options.growthPercent = 50;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  for (i = 0; i < 11; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+    if (i == 4) mu_assert(QueueFile_removeN(queue, 3));
+  }
+  for (i = 0; i < 5000 && (_headerFileLength() != 12288 || _isRelocating());
+       i++) {
+    usleep(1000);
+  }
+  mu_assert(_queueFileLength() == 12288);
+  mu_assert(!_isRelocating());
+  for (i = 3; i < 11; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    _assertPeekCompareRemove(queue, data, sizeof(data));
+  }
+}
+
+static bool nestedAddSucceeded;
+
+static bool _addFromReader(QueueFile_ElementStream* stream, uint32_t length) {
+  (void) stream;
+  static byte data[1000];
+  mu_assert(length == sizeof(data));
+  nestedAddSucceeded = QueueFile_add(queue, data, 0, sizeof(data));
+  return true;
+}
+
+static void* _removeLater(void* arg) {
+  usleep(20000);
+  mu_assert(QueueFile_remove(arg));
+  return NULL;
+}
+
+static void testGrowthAndCapacityPolicies() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.initialLength = 8192;
+  options.growthIncrement = 4096;
+  options.maxFileLength = 16384;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  mu_assert(_queueFileLength() == 8192);
+
+  // 16 elements of 1004 bytes fit, growing the file by 4096 bytes at a time.
+  static byte data[1000];
+  uint32_t i;
+  for (i = 0; i < 16; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+    if (i == 8) mu_assert(_queueFileLength() == 12288);
+  }
+  mu_assert(_queueFileLength() == 16384);
+  _v1ElementData(data, 16, sizeof(data));
+  mu_assert(!QueueFile_add(queue, data, 0, sizeof(data)));
+  mu_assert(QueueFile_size(queue) == 16);
+
+  // Blocking waits for a removal, or fails after the timeout.
+  options.fullPolicy = QueueFile_FULL_BLOCK;
+  options.fullTimeoutMillis = 50;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  mu_assert(!QueueFile_add(queue, data, 0, sizeof(data)));
+  options.fullTimeoutMillis = 10000;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  pthread_t remover;
+  mu_assert(pthread_create(&remover, NULL, _removeLater, queue) == 0);
+  mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+  pthread_join(remover, NULL);
+  mu_assert(QueueFile_size(queue) == 16);
+
+  // Under the queue's lock no removal can make room, adds fail at once.
+  time_t start = time(NULL);
+  nestedAddSucceeded = true;
+  mu_assert(QueueFile_forEach(queue, _addFromReader));
+  mu_assert(!nestedAddSucceeded);
+  mu_assert(difftime(time(NULL), start) < 5);
+  mu_assert(QueueFile_size(queue) == 16);
+
+  // Dropping removes the eldest.
+  options.fullPolicy = QueueFile_FULL_DROP_OLDEST;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  _v1ElementData(data, 17, sizeof(data));
+  mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+  mu_assert(QueueFile_size(queue) == 16);
+  mu_assert(_queueFileLength() == 16384);
+  for (i = 2; i < 18; i++) {
+    _v1ElementData(data, i, sizeof(data));
+    _assertPeekCompareRemove(queue, data, sizeof(data));
+  }
+
+  // Clearing goes back to the initial length.
+  mu_assert(QueueFile_clear(queue));
+  mu_assert(_queueFileLength() == 8192);
+
+  // Grown by half, 12192 bytes rounded up to whole blocks.
+  QueueFile_initOptions(&options);
+  options.initialLength = 8192;
+  options.growthPercent = 50;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  for (i = 0; i < 9; i++) {
+    mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+  }
+  mu_assert(_queueFileLength() == 12288);
+}
+
+static bool _skipElement(QueueFile_ElementStream* stream, uint32_t length) {
+  (void) stream;
+  (void) length;
+  return true;
+}
+
+static void testFlightRecorder() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.initialLength = 8192;
+  options.maxFileLength = 8192;
+  options.fullPolicy = QueueFile_FULL_DROP_OLDEST;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  static byte data[6000];
+  uint32_t i;
+  uint64_t addedBytes = 0;
+  for (i = 0; i < 100; i++) {
+    uint32_t length = 500 + i * 7;
+    _v1ElementData(data, i, length);
+    mu_assert(QueueFile_add(queue, data, 0, length));
+    addedBytes += length;
+  }
+  mu_assert(_queueFileLength() == 8192);
+
+  // What was dropped and what is left add up to what was added.
+  QueueFile_DropStats stats;
+  mu_assert(QueueFile_getDropStats(queue, &stats));
+  uint32_t size = QueueFile_size(queue);
+  mu_assert(stats.elements == 100 - size);
+  mu_assert(stats.bytes + QueueFile_sizeInBytes(queue) == addedBytes);
+
+  // A big element drops several at once.
+  _v1ElementData(data, 100, sizeof(data));
+  mu_assert(QueueFile_add(queue, data, 0, sizeof(data)));
+  mu_assert(_queueFileLength() == 8192);
+  mu_assert(QueueFile_size(queue) == 2);
+  mu_assert(QueueFile_getDropStats(queue, &stats));
+  mu_assert(stats.elements == 99);
+
+  // The newest elements survive reopening.
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  _v1ElementData(data, 99, 500 + 99 * 7);
+  _assertPeekCompareRemove(queue, data, 500 + 99 * 7);
+  _v1ElementData(data, 100, sizeof(data));
+  _assertPeekCompareRemove(queue, data, sizeof(data));
+  mu_assert(QueueFile_getDropStats(queue, &stats));
+  mu_assert(stats.elements == 0);
+
+  // 8 elements of 1004 bytes fill the file.
+  for (i = 0; i < 8; i++) {
+    _v1ElementData(data, i, 1000);
+    mu_assert(QueueFile_add(queue, data, 0, 1000));
+  }
+  mu_assert(QueueFile_getDropStats(queue, &stats));
+  mu_assert(stats.elements == 0);
+
+  // Elements a snapshot reads can't be dropped, the add fails instead.
+  QueueFile_Snapshot* snapshot = QueueFile_snapshot(queue);
+  mu_assert_notnull(snapshot);
+  _v1ElementData(data, 8, 1000);
+  mu_assert(!QueueFile_add(queue, data, 0, 1000));
+  mu_assert(QueueFile_size(queue) == 8);
+
+  // Those it has read can.
+  mu_assert(QueueFile_snapshotNext(snapshot, _skipElement));
+  mu_assert(QueueFile_add(queue, data, 0, 1000));
+  mu_assert(QueueFile_size(queue) == 8);
+  _v1ElementData(data, 9, 1000);
+  mu_assert(!QueueFile_add(queue, data, 0, 1000));
+  mu_assert(QueueFile_getDropStats(queue, &stats));
+  mu_assert(stats.elements == 1);
+
+  mu_assert(QueueFile_snapshotRelease(snapshot));
+  mu_assert(QueueFile_add(queue, data, 0, 1000));
+  mu_assert(QueueFile_size(queue) == 8);
+  for (i = 2; i < 10; i++) {
+    _v1ElementData(data, i, 1000);
+    _assertPeekCompareRemove(queue, data, 1000);
+  }
+}
+
+#define JSON_ELEMENTS 20
+static char jsonElements[JSON_ELEMENTS][4096];
+static uint32_t jsonElementsRead;
+
+/** Fills jsonElements[i] with records like those of a JSON API. */
+static uint32_t _jsonElement(uint32_t i) {
+  char* json = jsonElements[i];
+  int length = sprintf(json, "[");
+  uint32_t record;
+  for (record = 0; record < 30; record++) {
+    length += sprintf(json + length, "%s{\"id\":%u,\"sensor\":\"probe-%u\","
+                      "\"value\":%u,\"unit\":\"celsius\",\"ok\":true}",
+                      record == 0 ? "" : ",", i * 100 + record, record % 7,
+                      (i * 31 + record * 17) % 1000);
+  }
+  length += sprintf(json + length, "]");
+  return (uint32_t) length;
+}
+
+/** Checks that streams serve the decompressed JSON elements in order. */
+static bool jsonReader(QueueFile_ElementStream* stream, uint32_t length) {
+  const char* expected = jsonElements[jsonElementsRead];
+  static byte buffer[4096];
+  mu_assert(length == strlen(expected));
+  mu_assert(QueueFile_readElementStreamNextByte(stream) == '[');
+  uint32_t remaining;
+  mu_assert(QueueFile_readElementStream(stream, buffer, length - 1,
+                                        &remaining));
+  mu_assert(remaining == 0);
+  mu_assert_memcmp(buffer, expected + 1, length - 1);
+  jsonElementsRead++;
+  return true;
+}
+
+static void testCompressesElements() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.codec = &QueueFile_CODEC_LZ;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  uint32_t i;
+  uint64_t jsonBytes = 0;
+  for (i = 0; i < JSON_ELEMENTS; i++) {
+    uint32_t length = _jsonElement(i);
+    mu_assert(QueueFile_add(queue, (byte*) jsonElements[i], 0, length));
+    jsonBytes += length;
+  }
+  mu_assert((_headerFlags() & 4) != 0);
+  // Stored sizes count, the records shrink to less than a third.
+  mu_assert(QueueFile_sizeInBytes(queue) * 3 < jsonBytes);
+
+  // Peeks see the data as it was added.
+  uint32_t length = (uint32_t) strlen(jsonElements[0]);
+  mu_assert(QueueFile_peekSize(queue) == length);
+  byte buffer[4096];
+  uint32_t peeked;
+  mu_assert(QueueFile_peekInto(queue, buffer, 10, &peeked) ==
+            QueueFile_PEEK_TOO_SMALL);
+  mu_assert(peeked == length);
+  mu_assert(QueueFile_peekAt(queue, 3, buffer, sizeof(buffer), &peeked) ==
+            QueueFile_PEEK_OK);
+  mu_assert(peeked == strlen(jsonElements[3]));
+  mu_assert_memcmp(buffer, jsonElements[3], peeked);
+  jsonElementsRead = 0;
+  mu_assert(QueueFile_forEach(queue, jsonReader));
+  mu_assert(jsonElementsRead == JSON_ELEMENTS);
+  jsonElementsRead = 0;
+  mu_assert(QueueFile_forEachSnapshot(queue, jsonReader));
+  mu_assert(jsonElementsRead == JSON_ELEMENTS);
+
+  // Incompressible and short elements are stored as they are.
+  static byte noise[3000];
+  srand(49);
+  for (i = 0; i < sizeof(noise); i++) noise[i] = (byte) rand();
+  uint64_t stored = QueueFile_sizeInBytes(queue);
+  mu_assert(QueueFile_add(queue, noise, 0, sizeof(noise)));
+  mu_assert(QueueFile_add(queue, values[20], 0, 20));
+  mu_assert(QueueFile_sizeInBytes(queue) == stored + sizeof(noise) + 20);
+  // Compressed before they are queued for the I/O thread.
+  mu_assert(QueueFile_addAsync(queue, (byte*) jsonElements[0], 0,
+                               (uint32_t) strlen(jsonElements[0]), NULL,
+                               NULL));
+
+  // The built-in codec is read without being configured.
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+  mu_assert(QueueFile_size(queue) == JSON_ELEMENTS + 3);
+  for (i = 0; i < JSON_ELEMENTS; i++) {
+    _assertPeekCompareRemove(queue, (byte*) jsonElements[i],
+                             (uint32_t) strlen(jsonElements[i]));
+  }
+  _assertPeekCompareRemove(queue, noise, sizeof(noise));
+  _assertPeekCompareRemove(queue, values[20], 20);
+  _assertPeekCompareRemove(queue, (byte*) jsonElements[0],
+                           (uint32_t) strlen(jsonElements[0]));
+
+  // Clearing forgets the queue held compressed elements.
+  mu_assert(QueueFile_clear(queue));
+  mu_assert((_headerFlags() & 4) == 0);
+}
+
+static uint32_t trailingZeroCalls;
+
+/** Stores data without its trailing zeros. */
+static uint32_t trailingZeroCompress(void* context, const byte* data,
+                                     uint32_t length, byte* out,
+                                     uint32_t capacity) {
+  *(uint32_t*) context += 1;
+  while (length > 0 && data[length - 1] == 0) length--;
+  if (length == 0 || length > capacity) return 0;
+  memcpy(out, data, length);
+  return length;
+}
+
+static bool trailingZeroDecompress(void* context, const byte* data,
+                                   uint32_t length, byte* out,
+                                   uint32_t outLength) {
+  *(uint32_t*) context += 1;
+  if (length > outLength) return false;
+  memcpy(out, data, length);
+  memset(out + length, 0, outLength - length);
+  return true;
+}
+
+static void testCustomCodec() {
+  QueueFile_Codec codec = {
+    7, trailingZeroCompress, trailingZeroDecompress, &trailingZeroCalls
+  };
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.codec = &codec;
+  options.compressMinBytes = 100;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  byte padded[1000];
+  memset(padded, 0, sizeof(padded));
+  memcpy(padded, values[50], 50);
+  trailingZeroCalls = 0;
+  // Below compressMinBytes the codec isn't asked.
+  mu_assert(QueueFile_add(queue, padded, 0, 99));
+  mu_assert(trailingZeroCalls == 0);
+  mu_assert(QueueFile_add(queue, padded, 0, sizeof(padded)));
+  mu_assert(trailingZeroCalls == 1);
+  mu_assert(QueueFile_sizeInBytes(queue) == 99 + 5 + 50);
+
+  _assertPeekCompareRemove(queue, padded, 99);
+  _assertPeekCompareRemove(queue, padded, sizeof(padded));
+  mu_assert(trailingZeroCalls == 2);
+}
+
+#define SPARSE_INDEX_FILENAME TEST_QUEUE_FILENAME ".idx"
+
+/** Opens the test queue with a sparse index, and a small index if indexed. */
+static void _reopenSparse(uint32_t interval, bool indexed) {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.sparseIndexInterval = interval;
+  options.indexed = indexed;
+  options.indexMaxElements = 4;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+}
+
+/** Checks QueueFile_get for every element, element n is values[first + n]. */
+static void _assertGetAll(uint32_t first) {
+  uint32_t size = QueueFile_size(queue);
+  uint32_t n;
+  for (n = 0; n < size; n++) {
+    uint32_t length;
+    byte* data = QueueFile_get(queue, n, &length);
+    mu_assert_notnull(data);
+    mu_assert(length == first + n);
+    mu_assert_memcmp(data, values[first + n], length);
+    free(data);
+  }
+  uint32_t length;
+  mu_assert(QueueFile_get(queue, size, &length) == NULL);
+  mu_assert(length == 0);
+}
+
+static void testSparseIndex() {
+  remove(SPARSE_INDEX_FILENAME);
+  _reopenSparse(8, false);
+  uint32_t i;
+  // Expands several times, the ring wraps after the removal.
+  for (i = 0; i < 150; i++) mu_assert(QueueFile_add(queue, values[i], 0, i));
+  _assertGetAll(0);
+  mu_assert(QueueFile_removeN(queue, 13));
+  _assertGetAll(13);
+  mu_assert(QueueFile_remove(queue));
+  for (i = 150; i < 200; i++) mu_assert(QueueFile_add(queue, values[i], 0, i));
+  _assertGetAll(14);
+
+  // Closing saves the index and marks the header, reopening loads it.
+  _reopenSparse(8, false);
+  mu_assert((_headerFlags() & 8) != 0);
+  _assertGetAll(14);
+  mu_assert(QueueFile_removeN(queue, 20));
+  // The first change clears the mark.
+  mu_assert((_headerFlags() & 8) == 0);
+  _assertGetAll(34);
+
+  // A queue changed without the index rebuilds it, so does another interval.
+  _reopenSparse(0, false);
+  mu_assert(QueueFile_remove(queue));
+  _reopenSparse(8, false);
+  _assertGetAll(35);
+  _reopenSparse(5, true);
+  _assertGetAll(35);
+  mu_assert(QueueFile_removeN(queue, 100));
+  _assertGetAll(135);
+
+  // Drained queues have nothing to save.
+  mu_assert(QueueFile_clear(queue));
+  remove(SPARSE_INDEX_FILENAME);
+  _reopenSparse(5, true);
+  mu_assert((_headerFlags() & 8) == 0);
+  mu_assert(fopen(SPARSE_INDEX_FILENAME, "r") == NULL);
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+}
+
+#define SEGMENTED_QUEUE_DIRECTORY "test-segmented.queue"
+#define SEGMENT_LENGTH 1024
+
+/** Returns the number of segment files of the segmented test queue. */
+static uint32_t _countSegments() {
+  DIR* directory = opendir(SEGMENTED_QUEUE_DIRECTORY);
+  mu_assert_notnull(directory);
+  uint32_t count = 0;
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (strstr(entry->d_name, ".seg") != NULL) count++;
+  }
+  closedir(directory);
+  return count;
+}
+
+/** Deletes the segmented test queue with all its files. */
+static void _removeSegmentedQueue() {
+  DIR* directory = opendir(SEGMENTED_QUEUE_DIRECTORY);
+  if (directory == NULL) return;
+  char path[512];
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", SEGMENTED_QUEUE_DIRECTORY,
+             entry->d_name);
+    remove(path);
+  }
+  closedir(directory);
+  rmdir(SEGMENTED_QUEUE_DIRECTORY);
+}
+
+static void _reopenSegmented() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.segmentLength = SEGMENT_LENGTH;
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(SEGMENTED_QUEUE_DIRECTORY, &options);
+  mu_assert_notnull(queue);
+}
+
+static void testSegmentedQueue() {
+  _removeSegmentedQueue();
+  _reopenSegmented();
+  mu_assert(_countSegments() == 0);
+
+  // Elements span segments, the large one many of them.
+  byte large[5000];
+  uint32_t i;
+  for (i = 0; i < sizeof(large); i++) large[i] = (byte) (i % 11);
+  for (i = 0; i < 200; i++) {
+    mu_assert(QueueFile_add(queue, values[i % N], 0, i % N));
+    if (i == 100) mu_assert(QueueFile_add(queue, large, 0, sizeof(large)));
+  }
+  // 200 headers, 0 + ... + 199 bytes of data and the large element.
+  uint32_t total = 200 * 4 + 199 * 100 + 4 + sizeof(large);
+  mu_assert(_countSegments() == (64 + total - 1) / SEGMENT_LENGTH + 1);
+
+  _reopenSegmented();
+  mu_assert(QueueFile_size(queue) == 201);
+  _assertPeekAt(queue, 101, large, sizeof(large));
+  _assertPeekAt(queue, 200, values[199], 199);
+
+  // Fully consumed head segments are deleted.
+  mu_assert(QueueFile_removeN(queue, 101));
+  uint32_t left = total - (101 * 4 + 100 * 99 / 2);
+  mu_assert(_countSegments() <= left / SEGMENT_LENGTH + 2);
+  _assertPeekCompareRemove(queue, large, sizeof(large));
+  for (i = 101; i < 200; i++) {
+    _assertPeekCompareRemove(queue, values[i], i);
+  }
+  mu_assert(QueueFile_isEmpty(queue));
+  mu_assert(_countSegments() == 0);
+
+  // Segments left behind by a crash are deleted when the queue is opened.
+  mu_assert(QueueFile_add(queue, values[100], 0, 100));
+  FILE* stale = fopen(SEGMENTED_QUEUE_DIRECTORY "/00000000000000ff.seg", "w");
+  mu_assert_notnull(stale);
+  fclose(stale);
+  mu_assert(_countSegments() == 2);
+  _reopenSegmented();
+  mu_assert(_countSegments() == 1);
+  _assertPeekCompare(queue, values[100], 100);
+
+  mu_assert(QueueFile_clear(queue));
+  mu_assert(_countSegments() == 0);
+  mu_assert(QueueFile_add(queue, values[7], 0, 7));
+  _assertPeekCompareRemove(queue, values[7], 7);
+
+  QueueFile_closeAndFree(queue);
+  _removeSegmentedQueue();
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert_notnull(queue);
+}
+
+#define SHRINK_ELEMENT_LENGTH 1000
+
+static void _shrinkElement(byte* buffer, uint32_t i) {
+  uint32_t j;
+  for (j = 0; j < SHRINK_ELEMENT_LENGTH; j++) buffer[j] = (byte) (i * 7 + j);
+}
+
+static void testShrinksOnline() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.shrinkPercent = 25;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+
+  byte element[SHRINK_ELEMENT_LENGTH];
+  uint32_t i;
+  for (i = 0; i < 100; i++) {
+    _shrinkElement(element, i);
+    mu_assert(QueueFile_add(queue, element, 0, sizeof(element)));
+  }
+  mu_assert(_queueFileLength() == 131072);
+
+  // Halves as the backlog drains, moving the elements or leaving them.
+  for (i = 0; i < 95; i++) {
+    _shrinkElement(element, i);
+    _assertPeekCompareRemove(queue, element, sizeof(element));
+    if (i == 60) mu_assert(_queueFileLength() == 131072);
+  }
+  mu_assert(_queueFileLength() <= 16384);
+
+  // Still a valid queue, also after reopening.
+  _shrinkElement(element, 100);
+  mu_assert(QueueFile_add(queue, element, 0, sizeof(element)));
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  mu_assert(QueueFile_size(queue) == 6);
+  for (i = 95; i <= 100; i++) {
+    _shrinkElement(element, i);
+    _assertPeekCompareRemove(queue, element, sizeof(element));
+  }
+  mu_assert(QueueFile_isEmpty(queue));
+}
+
+/** Counts the allocations made through it, context points at the counter. */
+static void* countingAlloc(void* context, size_t size) {
+  __sync_fetch_and_add((int*) context, 1);
+  return malloc(size);
+}
+
+static void countingFree(void* context, void* pointer) {
+  __sync_fetch_and_sub((int*) context, 1);
+  free(pointer);
+}
+
+static void testCustomAllocator() {
+  int outstanding = 0;
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.allocator.alloc = countingAlloc;
+  options.allocator.free = countingFree;
+  options.allocator.context = &outstanding;
+  QueueFile_closeAndFree(queue);
+  remove(TEST_QUEUE_FILENAME);
+  // Creating the file allocates the temporary filename too.
+  queue = QueueFile_newWithOptions(TEST_QUEUE_FILENAME, &options);
+  mu_assert_notnull(queue);
+  mu_assert(outstanding == 1);
+
+  mu_assert(QueueFile_add(queue, values[10], 0, 10));
+  uint32_t length;
+  byte* data = QueueFile_peek(queue, &length);
+  mu_assert(outstanding == 2);
+  mu_assert_memcmp(data, values[10], 10);
+  QueueFile_freeBuffer(queue, data);
+  QueueFile_Snapshot* snapshot = QueueFile_snapshot(queue);
+  mu_assert(outstanding == 2);
+  mu_assert(QueueFile_snapshotRelease(snapshot));
+
+  QueueFile_closeAndFree(queue);
+  mu_assert(outstanding == 0);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+}
+
 static void testFailedExpansion() {
   mu_assert(QueueFile_add(queue, values[253], 0, 253));
   _for_testing_FileIo_failAllWrites(true);
@@ -479,6 +1858,285 @@ static void testTransferToWithSmallBuffer() {
   _for_testing_setTransferToCopyBufferSize(oldBufferSize);
 }
 
+static int snapshotIterationCount = 0;
+
+static void* addAndRemoveOnOtherThread(void* arg) {
+  (void) arg;
+  mu_assert(QueueFile_add(queue, values[40], 0, 40));
+  mu_assert(QueueFile_remove(queue));
+  return NULL;
+}
+
+static bool snapshotReader(QueueFile_ElementStream* stream, uint32_t length) {
+  uint32_t expectedLength = (uint32_t) (10 * (snapshotIterationCount + 1));
+  mu_assert(length == expectedLength);
+  byte actual[length];
+  uint32_t remaining;
+  mu_assert(QueueFile_readElementStream(stream, actual, length, &remaining));
+  mu_assert_memcmp(actual, values[length], length);
+
+  if (snapshotIterationCount == 0) {
+    // Would deadlock if the scan held the queue lock.
+    pthread_t thread;
+    mu_assert(pthread_create(&thread, NULL, addAndRemoveOnOtherThread, NULL) == 0);
+    mu_assert(pthread_join(thread, NULL) == 0);
+  }
+  snapshotIterationCount++;
+  return true;
+}
+
+static void testForEachSnapshotDoesntHoldLock() {
+  snapshotIterationCount = 0;
+  mu_assert(QueueFile_add(queue, values[10], 0, 10));
+  mu_assert(QueueFile_add(queue, values[20], 0, 20));
+  mu_assert(QueueFile_add(queue, values[30], 0, 30));
+
+  mu_assert(QueueFile_forEachSnapshot(queue, snapshotReader));
+
+  // The element added during the scan is not part of the snapshot.
+  mu_assert(snapshotIterationCount == 3);
+  mu_assert(QueueFile_size(queue) == 3);
+  _assertPeekCompareRemove(queue, values[20], 20);
+}
+
+#define SNAPSHOT_BLOCK_LENGTH 1000
+#define SNAPSHOT_BLOCKS 7
+static byte* snapshotBlocks[SNAPSHOT_BLOCKS];
+static byte snapshotExpectedBlock;
+
+static bool snapshotBlockReader(QueueFile_ElementStream* stream,
+                                uint32_t length) {
+  mu_assert(length == SNAPSHOT_BLOCK_LENGTH);
+  byte actual[SNAPSHOT_BLOCK_LENGTH];
+  uint32_t remaining;
+  mu_assert(QueueFile_readElementStream(stream, actual, length, &remaining));
+  mu_assert_memcmp(actual, snapshotBlocks[snapshotExpectedBlock], length);
+  return true;
+}
+
+static void _assertSnapshotNext(QueueFile_Snapshot* snapshot, byte block) {
+  snapshotExpectedBlock = block;
+  mu_assert(QueueFile_snapshotNext(snapshot, snapshotBlockReader));
+}
+
+/**
+ * Removed elements stay readable through a snapshot, adds don't overwrite
+ * them and expansion relocates what the snapshot still has to read.
+ */
+static void testSnapshotPinsRemovedElements() {
+  byte b;
+  for (b = 0; b < SNAPSHOT_BLOCKS; b++) {
+    snapshotBlocks[b] = malloc(SNAPSHOT_BLOCK_LENGTH);
+    memset(snapshotBlocks[b], 'A' + b, SNAPSHOT_BLOCK_LENGTH);
+  }
+
+  // Leaves C, D, E, F in the ring with E wrapping at EOF and F at the front.
+  for (b = 0; b < 3; b++) {
+    mu_assert(QueueFile_add(queue, snapshotBlocks[b], 0, SNAPSHOT_BLOCK_LENGTH));
+  }
+  mu_assert(QueueFile_remove(queue));
+  mu_assert(QueueFile_remove(queue));
+  for (b = 3; b < 6; b++) {
+    mu_assert(QueueFile_add(queue, snapshotBlocks[b], 0, SNAPSHOT_BLOCK_LENGTH));
+  }
+  FILE* file = _for_testing_QueueFile_getFhandle(queue);
+  mu_assert(FileIo_getLength(file) == 4096);
+
+  QueueFile_Snapshot* snapshot = QueueFile_snapshot(queue);
+  mu_assert_notnull(snapshot);
+  mu_assert(QueueFile_snapshotRemaining(snapshot) == 4);
+  _assertSnapshotNext(snapshot, 2);
+  _assertSnapshotNext(snapshot, 3);
+  _assertSnapshotNext(snapshot, 4);
+
+  // Expansion moves F, which the snapshot reads next, to after the old EOF.
+  mu_assert(QueueFile_add(queue, snapshotBlocks[6], 0, SNAPSHOT_BLOCK_LENGTH));
+  mu_assert(FileIo_getLength(file) == 8192);
+
+  // Drain the queue and add again; F is still pinned and must survive.
+  uint32_t i;
+  for (i = 0; i < 5; i++) mu_assert(QueueFile_remove(queue));
+  mu_assert(QueueFile_isEmpty(queue));
+  for (b = 0; b < 3; b++) {
+    mu_assert(QueueFile_add(queue, snapshotBlocks[b], 0, SNAPSHOT_BLOCK_LENGTH));
+  }
+
+  _assertSnapshotNext(snapshot, 5);
+  mu_assert(QueueFile_snapshotRemaining(snapshot) == 0);
+  mu_assert(!QueueFile_snapshotNext(snapshot, snapshotBlockReader));
+  mu_assert(QueueFile_snapshotRelease(snapshot));
+
+  _assertPeekCompareRemove(queue, snapshotBlocks[0], SNAPSHOT_BLOCK_LENGTH);
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  _assertPeekCompareRemove(queue, snapshotBlocks[1], SNAPSHOT_BLOCK_LENGTH);
+  _assertPeekCompareRemove(queue, snapshotBlocks[2], SNAPSHOT_BLOCK_LENGTH);
+  mu_assert(QueueFile_isEmpty(queue));
+
+  // Once released, draining resets the file as usual.
+  mu_assert(FileIo_getLength(_for_testing_QueueFile_getFhandle(queue)) == 4096);
+
+  for (b = 0; b < SNAPSHOT_BLOCKS; b++) free(snapshotBlocks[b]);
+}
+
+#define SHARED_QUEUE_FILENAME "test-shared.queue"
+#define SHARED_ELEMENTS 200
+
+static QueueFile* _openShared() {
+  QueueFile_Options options;
+  QueueFile_initOptions(&options);
+  options.shared = true;
+  QueueFile* shared = QueueFile_newWithOptions(SHARED_QUEUE_FILENAME, &options);
+  mu_assert_notnull(shared);
+  return shared;
+}
+
+static void _waitForChild(pid_t child) {
+  int status;
+  mu_assert(waitpid(child, &status, 0) == child);
+  mu_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/** A producer process and a consumer process working on the same file. */
+static void testSharedBetweenProcesses() {
+  remove(SHARED_QUEUE_FILENAME);
+  QueueFile* consumer = _openShared();
+
+  pid_t child = fork();
+  mu_assert(child >= 0);
+  if (child == 0) {
+    QueueFile* producer = _openShared();
+    int i;
+    for (i = 0; i < SHARED_ELEMENTS; i++) {
+      if (!QueueFile_add(producer, values[i % N], 0, (uint32_t) (i % N))) {
+        _exit(1);
+      }
+    }
+    QueueFile_closeAndFree(producer);
+    _exit(0);
+  }
+
+  int i;
+  for (i = 0; i < SHARED_ELEMENTS; i++) {
+    mu_assert(QueueFile_await(consumer, 10000));
+    _assertPeekCompareRemove(consumer, values[i % N], (uint32_t) (i % N));
+  }
+  _waitForChild(child);
+  mu_assert(QueueFile_isEmpty(consumer));
+  QueueFile_closeAndFree(consumer);
+  remove(SHARED_QUEUE_FILENAME);
+  remove(SHARED_QUEUE_FILENAME ".shm");
+}
+
+/** A process dying while holding the lock doesn't block or corrupt others. */
+static void testSharedRecoversFromDeadLockHolder() {
+  remove(SHARED_QUEUE_FILENAME);
+  QueueFile* survivor = _openShared();
+  mu_assert(QueueFile_add(survivor, values[10], 0, 10));
+
+  pid_t child = fork();
+  mu_assert(child >= 0);
+  if (child == 0) {
+    QueueFile* dying = _openShared();
+    if (!QueueFile_add(dying, values[20], 0, 20)) _exit(1);
+    _for_testing_QueueFile_lockAndAbandon(dying);
+    _exit(0);
+  }
+  _waitForChild(child);
+
+  mu_assert(QueueFile_size(survivor) == 2);
+  mu_assert(QueueFile_add(survivor, values[30], 0, 30));
+  _assertPeekCompareRemove(survivor, values[10], 10);
+  _assertPeekCompareRemove(survivor, values[20], 20);
+  _assertPeekCompareRemove(survivor, values[30], 30);
+  mu_assert(!QueueFile_await(survivor, 10));
+  QueueFile_closeAndFree(survivor);
+  remove(SHARED_QUEUE_FILENAME);
+  remove(SHARED_QUEUE_FILENAME ".shm");
+}
+
+#define ASYNC_ELEMENTS 100
+static pthread_mutex_t asyncResultsMutex = PTHREAD_MUTEX_INITIALIZER;
+static int asyncCallbacks;
+static int asyncFailures;
+static uint64_t asyncSequences[ASYNC_ELEMENTS];
+
+static void asyncCallback(void* context, bool success, uint64_t sequence) {
+  int index = (int) (intptr_t) context;
+  pthread_mutex_lock(&asyncResultsMutex);
+  if (!success) asyncFailures++;
+  asyncSequences[index] = sequence;
+  asyncCallbacks++;
+  pthread_mutex_unlock(&asyncResultsMutex);
+}
+
+static void _awaitAsyncCallbacks(int expected) {
+  int waited;
+  for (waited = 0; waited < 10000; waited++) {
+    pthread_mutex_lock(&asyncResultsMutex);
+    int callbacks = asyncCallbacks;
+    pthread_mutex_unlock(&asyncResultsMutex);
+    if (callbacks >= expected) return;
+    usleep(1000);
+  }
+  mu_assertm(false, "timed out waiting for async callbacks");
+}
+
+static void testAddAsync() {
+  asyncCallbacks = asyncFailures = 0;
+  mu_assert(QueueFile_add(queue, values[1], 0, 1));
+  int i;
+  for (i = 0; i < ASYNC_ELEMENTS; i++) {
+    mu_assert(QueueFile_addAsync(queue, values[i], 0, (uint32_t) i,
+                                 asyncCallback, (void*) (intptr_t) i));
+  }
+  _awaitAsyncCallbacks(ASYNC_ELEMENTS);
+  mu_assert(asyncFailures == 0);
+  // Sequence numbers follow the order of the calls, after the sync add.
+  for (i = 0; i < ASYNC_ELEMENTS; i++) {
+    mu_assert(asyncSequences[i] == (uint64_t) i + 2);
+  }
+
+  QueueFile_closeAndFree(queue);
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert(QueueFile_size(queue) == ASYNC_ELEMENTS + 1);
+  _assertPeekCompareRemove(queue, values[1], 1);
+  for (i = 0; i < ASYNC_ELEMENTS; i++) {
+    _assertPeekCompareRemove(queue, values[i], (uint32_t) i);
+  }
+}
+
+static void testAddAsyncCloseCompletesPendingAdds() {
+  asyncCallbacks = asyncFailures = 0;
+  int i;
+  for (i = 0; i < ASYNC_ELEMENTS; i++) {
+    mu_assert(QueueFile_addAsync(queue, values[N - 1], 0, N - 1,
+                                 asyncCallback, (void*) (intptr_t) i));
+  }
+  QueueFile_closeAndFree(queue);
+  mu_assert(asyncCallbacks == ASYNC_ELEMENTS && asyncFailures == 0);
+
+  queue = QueueFile_new(TEST_QUEUE_FILENAME);
+  mu_assert(QueueFile_size(queue) == ASYNC_ELEMENTS);
+}
+
+static void testFailedAddAsync() {
+  asyncCallbacks = asyncFailures = 0;
+  _for_testing_FileIo_failAllWrites(true);
+  mu_assert(QueueFile_addAsync(queue, values[10], 0, 10, asyncCallback,
+                               (void*) 0));
+  _awaitAsyncCallbacks(1);
+  _for_testing_FileIo_failAllWrites(false);
+  mu_assert(asyncFailures == 1 && asyncSequences[0] == 0);
+  mu_assert(QueueFile_isEmpty(queue));
+
+  mu_assert(QueueFile_addAsync(queue, values[10], 0, 10, asyncCallback,
+                               (void*) 0));
+  _awaitAsyncCallbacks(2);
+  mu_assert(asyncFailures == 1 && asyncSequences[0] == 1);
+  _assertPeekCompareRemove(queue, values[10], 10);
+}
+
 int main() {
   LOG_SETDEBUGFAILLEVEL_WARN;
   mu_run_test(testSimpleAddOneElement);
@@ -490,9 +2148,40 @@ int main() {
   mu_run_test(testFailedAdd);
   mu_run_test(testFailedRemoval);
   mu_run_test(testFailedExpansion);
+  mu_run_test(testRemoveN);
+  mu_run_test(testPeekInto);
+  mu_run_test(testPeekViewOfWrappedElementSurvivesExpansion);
+  mu_run_test(testCustomAllocator);
+  mu_run_test(testPeekAtAndSizeInBytes);
+  mu_run_test(testIndexedQueue);
+  mu_run_test(testIndexIsBounded);
+  mu_run_test(testTailCache);
+  mu_run_test(testBufferedElementStreams);
+  mu_run_test(testForEachAcrossScanWindows);
+  mu_run_test(testForEachBatch);
+  mu_run_test(testPeekBatch);
+  mu_run_test(testPeekBatchOfWrappedRing);
+  mu_run_test(testMigratesVersion1Files);
+  mu_run_test(testExpansionMovesSmallerSideOfWrappedRing);
+  mu_run_test(testIncrementalExpansion);
+  mu_run_test(testExpandsAheadInBackground);
+  mu_run_test(testGrowthAndCapacityPolicies);
+  mu_run_test(testFlightRecorder);
+  mu_run_test(testCompressesElements);
+  mu_run_test(testCustomCodec);
+  mu_run_test(testSparseIndex);
+  mu_run_test(testSegmentedQueue);
+  mu_run_test(testShrinksOnline);
   mu_run_test(testForEach);
   mu_run_test(testPeekWithElementReader);
   mu_run_test(testTransferToWithSmallBuffer);
+  mu_run_test(testForEachSnapshotDoesntHoldLock);
+  mu_run_test(testSnapshotPinsRemovedElements);
+  mu_run_test(testSharedBetweenProcesses);
+  mu_run_test(testSharedRecoversFromDeadLockHolder);
+  mu_run_test(testAddAsync);
+  mu_run_test(testAddAsyncCloseCompletesPendingAdds);
+  mu_run_test(testFailedAddAsync);
 
   printf("%d tests passed.\n", tests_run);
   return 0;
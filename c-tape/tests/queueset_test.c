@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minunit.h"
+
+#include "../logutil.h"
+#include "../queueset.h"
+#include "../types.h"
+
+#define SHARDS 3
+static char* filenames[SHARDS] = {
+  "test-shard0.queue", "test-shard1.queue", "test-shard2.queue"
+};
+static QueueSet* set;
+int tests_run = 0;
+
+static void mu_setup() {
+  int i;
+  for (i = 0; i < SHARDS; i++) remove(filenames[i]);
+  set = QueueSet_new(filenames, SHARDS);
+  mu_assert_notnull(set);
+}
+
+static void mu_teardown() {
+  QueueSet_closeAndFree(set);
+  int i;
+  for (i = 0; i < SHARDS; i++) remove(filenames[i]);
+}
+
+static void testRoundRobinPlacement() {
+  byte value;
+  uint32_t shard;
+  for (value = 0; value < 2 * SHARDS; value++) {
+    mu_assert(QueueSet_add(set, &value, 0, 1, &shard));
+    mu_assert(shard == value % SHARDS);
+  }
+  mu_assert(QueueSet_size(set) == 2 * SHARDS);
+  uint32_t i;
+  for (i = 0; i < SHARDS; i++) {
+    mu_assert(QueueFile_size(QueueSet_getShard(set, i)) == 2);
+  }
+}
+
+static void testKeyedAddKeepsOrderWithinShard() {
+  const byte key[] = "customer-42";
+  uint32_t keyShard = QueueSet_shardForKey(set, key, sizeof(key));
+  byte value;
+  for (value = 0; value < 10; value++) {
+    mu_assert(QueueSet_addWithKey(set, key, sizeof(key), &value, 0, 1));
+  }
+  mu_assert(QueueFile_size(QueueSet_getShard(set, keyShard)) == 10);
+
+  for (value = 0; value < 10; value++) {
+    uint32_t length;
+    byte* data = QueueSet_peekShard(set, keyShard, &length);
+    mu_assert(length == 1);
+    mu_assert(data[0] == value);
+    free(data);
+    mu_assert(QueueSet_remove(set, keyShard));
+  }
+  mu_assert(QueueSet_isEmpty(set));
+}
+
+static void testFairPeekRotatesOverShards() {
+  // Shard 0 gets 3 elements, shard 2 gets 1, shard 1 stays empty.
+  byte values[] = {10, 11, 12, 20};
+  QueueFile_add(QueueSet_getShard(set, 0), values, 0, 1);
+  QueueFile_add(QueueSet_getShard(set, 0), values, 1, 1);
+  QueueFile_add(QueueSet_getShard(set, 0), values, 2, 1);
+  QueueFile_add(QueueSet_getShard(set, 2), values, 3, 1);
+
+  byte expected[] = {10, 20, 11, 12};
+  uint32_t expectedShard[] = {0, 2, 0, 0};
+  int i;
+  for (i = 0; i < 4; i++) {
+    uint32_t length, shard;
+    byte* data = QueueSet_peek(set, &length, &shard);
+    mu_assert_notnull(data);
+    mu_assert(length == 1);
+    mu_assert(data[0] == expected[i]);
+    mu_assert(shard == expectedShard[i]);
+    free(data);
+    mu_assert(QueueSet_remove(set, shard));
+  }
+  uint32_t length, shard;
+  mu_assert(QueueSet_peek(set, &length, &shard) == NULL);
+}
+
+static void testReleaseLeavesElementToNextPeek() {
+  byte value = 5;
+  QueueFile_add(QueueSet_getShard(set, 1), &value, 0, 1);
+
+  uint32_t length, shard;
+  byte* data = QueueSet_peek(set, &length, &shard);
+  mu_assert_notnull(data);
+  free(data);
+  // Claimed by the first peek.
+  mu_assert(QueueSet_peek(set, &length, &shard) == NULL);
+  mu_assert(QueueSet_release(set, shard));
+  data = QueueSet_peek(set, &length, &shard);
+  mu_assert_notnull(data);
+  mu_assert(shard == 1 && data[0] == value);
+  free(data);
+  mu_assert(QueueSet_remove(set, shard));
+  mu_assert(QueueSet_isEmpty(set));
+}
+
+#define CONSUMERS 4
+#define CONSUMED_ELEMENTS 3000
+static uint32_t deliveries[CONSUMED_ELEMENTS];
+
+static void* _consume(void* arg) {
+  (void) arg;
+  while (!QueueSet_isEmpty(set)) {
+    uint32_t length, shard;
+    byte* data = QueueSet_peek(set, &length, &shard);
+    if (data == NULL) {
+      // Every non-empty shard is claimed by another consumer.
+      sched_yield();
+      continue;
+    }
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    free(data);
+    __sync_fetch_and_add(&deliveries[value], 1);
+    mu_assert(QueueSet_remove(set, shard));
+  }
+  return NULL;
+}
+
+static void testFairConsumersGetEachElementOnce() {
+  uint32_t i;
+  for (i = 0; i < CONSUMED_ELEMENTS; i++) {
+    mu_assert(QueueSet_add(set, (byte*) &i, 0, sizeof(i), NULL));
+  }
+  memset(deliveries, 0, sizeof(deliveries));
+  pthread_t consumers[CONSUMERS];
+  for (i = 0; i < CONSUMERS; i++) {
+    mu_assert(pthread_create(&consumers[i], NULL, _consume, NULL) == 0);
+  }
+  for (i = 0; i < CONSUMERS; i++) pthread_join(consumers[i], NULL);
+  for (i = 0; i < CONSUMED_ELEMENTS; i++) mu_assert(deliveries[i] == 1);
+  mu_assert(QueueSet_isEmpty(set));
+}
+
+static void testStatsAndReopen() {
+  byte value = 7;
+  mu_assert(QueueSet_add(set, &value, 0, 1, NULL));
+  mu_assert(QueueSet_add(set, &value, 0, 1, NULL));
+  mu_assert(QueueSet_remove(set, 0));
+  mu_assert(!QueueSet_remove(set, 0));
+
+  QueueSet_ShardStats stats;
+  mu_assert(QueueSet_getShardStats(set, 0, &stats));
+  mu_assert(stats.size == 0 && stats.added == 1 && stats.removed == 1);
+  mu_assert(QueueSet_getShardStats(set, 1, &stats));
+  mu_assert(stats.size == 1 && stats.added == 1 && stats.removed == 0);
+  mu_assert(!QueueSet_getShardStats(set, SHARDS, &stats));
+
+  QueueSet_closeAndFree(set);
+  set = QueueSet_new(filenames, SHARDS);
+  mu_assert(QueueSet_size(set) == 1);
+  mu_assert(QueueFile_size(QueueSet_getShard(set, 1)) == 1);
+}
+
+int main() {
+  LOG_SETDEBUGFAILLEVEL_WARN;
+  mu_run_test(testRoundRobinPlacement);
+  mu_run_test(testKeyedAddKeepsOrderWithinShard);
+  mu_run_test(testFairPeekRotatesOverShards);
+  mu_run_test(testReleaseLeavesElementToNextPeek);
+  mu_run_test(testFairConsumersGetEachElementOnce);
+  mu_run_test(testStatsAndReopen);
+
+  printf("%d tests passed.\n", tests_run);
+  return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2012 Square, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "minunit.h"
+
+#include "../logutil.h"
+#include "../taskrunner.h"
+#include "../types.h"
+
+#define QUEUES 2
+#define TASKS_PER_QUEUE 200
+static char* filenames[QUEUES] = {
+  "test-tasks0.queue", "test-tasks1.queue"
+};
+static QueueFile* queues[QUEUES];
+int tests_run = 0;
+
+/** Executions per task, tasks are identified by queue * 1000 + index. */
+static uint32_t executions[QUEUES * 1000];
+/** Task which fails its first attempt. */
+static uint32_t failOnce;
+
+static void mu_setup() {
+  int i;
+  for (i = 0; i < QUEUES; i++) {
+    remove(filenames[i]);
+    queues[i] = QueueFile_new(filenames[i]);
+    mu_assert_notnull(queues[i]);
+  }
+  memset(executions, 0, sizeof(executions));
+  failOnce = 0xFFFFFFFF;
+}
+
+static void mu_teardown() {
+  int i;
+  for (i = 0; i < QUEUES; i++) {
+    QueueFile_closeAndFree(queues[i]);
+    remove(filenames[i]);
+  }
+}
+
+static void addTasks() {
+  uint32_t q, i;
+  for (q = 0; q < QUEUES; q++) {
+    for (i = 0; i < TASKS_PER_QUEUE; i++) {
+      uint32_t id = q * 1000 + i;
+      mu_assert(QueueFile_add(queues[q], (byte*) &id, 0, sizeof(id)));
+    }
+  }
+}
+
+static bool countTask(void* context, const byte* data, uint32_t length) {
+  mu_assert(context == executions);
+  mu_assert(length == sizeof(uint32_t));
+  uint32_t id;
+  memcpy(&id, data, sizeof(id));
+  uint32_t attempt = __sync_fetch_and_add(&executions[id], 1);
+  return !(id == failOnce && attempt == 0);
+}
+
+static void awaitAcknowledged(TaskRunner* runner, uint64_t count) {
+  TaskRunner_Stats stats;
+  int i;
+  for (i = 0; i < 1000; i++) {
+    mu_assert(TaskRunner_getStats(runner, &stats));
+    if (stats.acknowledged == count) return;
+    usleep(10000);
+  }
+  mu_assertm(false, "tasks not acknowledged in time");
+}
+
+static void testExecutesAndRemovesAllTasks() {
+  addTasks();
+  TaskRunner_Options options;
+  TaskRunner_initOptions(&options);
+  options.maxInFlight = 16;
+  options.refillBatch = 8;
+  TaskRunner* runner = TaskRunner_new(queues, QUEUES, countTask, executions,
+                                      &options);
+  mu_assert_notnull(runner);
+  awaitAcknowledged(runner, QUEUES * TASKS_PER_QUEUE);
+
+  TaskRunner_Stats stats;
+  mu_assert(TaskRunner_getStats(runner, &stats));
+  mu_assert(stats.completed == QUEUES * TASKS_PER_QUEUE);
+  mu_assert(stats.failed == 0);
+  mu_assert(stats.inFlight == 0);
+  mu_assert(TaskRunner_stop(runner));
+
+  uint32_t q, i;
+  for (q = 0; q < QUEUES; q++) {
+    mu_assert(QueueFile_isEmpty(queues[q]));
+    for (i = 0; i < TASKS_PER_QUEUE; i++) mu_assert(executions[q * 1000 + i] == 1);
+  }
+}
+
+static void testPicksUpTasksAddedLater() {
+  TaskRunner_Options options;
+  TaskRunner_initOptions(&options);
+  options.workerCount = 2;
+  TaskRunner* runner = TaskRunner_new(queues, QUEUES, countTask, executions,
+                                      &options);
+  mu_assert_notnull(runner);
+  addTasks();
+  TaskRunner_notify(runner);
+  awaitAcknowledged(runner, QUEUES * TASKS_PER_QUEUE);
+  mu_assert(TaskRunner_stop(runner));
+  mu_assert(QueueFile_isEmpty(queues[0]) && QueueFile_isEmpty(queues[1]));
+}
+
+static void testRetriesFailedTask() {
+  addTasks();
+  failOnce = 1000 + 5;
+  TaskRunner_Options options;
+  TaskRunner_initOptions(&options);
+  options.retryDelayMillis = 10;
+  TaskRunner* runner = TaskRunner_new(queues, QUEUES, countTask, executions,
+                                      &options);
+  mu_assert_notnull(runner);
+  awaitAcknowledged(runner, QUEUES * TASKS_PER_QUEUE);
+
+  TaskRunner_Stats stats;
+  mu_assert(TaskRunner_getStats(runner, &stats));
+  mu_assert(stats.failed == 1);
+  mu_assert(TaskRunner_stop(runner));
+  mu_assert(executions[failOnce] == 2);
+  mu_assert(QueueFile_isEmpty(queues[1]));
+}
+
+/** Fails the tasks of the first queue forever. */
+static bool failFirstQueueTask(void* context, const byte* data,
+                               uint32_t length) {
+  uint32_t id;
+  memcpy(&id, data, sizeof(id));
+  return countTask(context, data, length) && id >= 1000;
+}
+
+static void testFailingTasksDontHoldUpOtherQueues() {
+  // As many failing tasks as there are workers.
+  uint32_t id;
+  for (id = 0; id < 2; id++) {
+    mu_assert(QueueFile_add(queues[0], (byte*) &id, 0, sizeof(id)));
+  }
+  for (id = 1000; id < 1000 + TASKS_PER_QUEUE; id++) {
+    mu_assert(QueueFile_add(queues[1], (byte*) &id, 0, sizeof(id)));
+  }
+  TaskRunner_Options options;
+  TaskRunner_initOptions(&options);
+  options.workerCount = 2;
+  options.retryDelayMillis = 10;
+  TaskRunner* runner = TaskRunner_new(queues, QUEUES, failFirstQueueTask,
+                                      executions, &options);
+  mu_assert_notnull(runner);
+  awaitAcknowledged(runner, TASKS_PER_QUEUE);
+
+  TaskRunner_Stats stats;
+  mu_assert(TaskRunner_getStats(runner, &stats));
+  mu_assert(stats.failed >= 2);
+  mu_assert(TaskRunner_stop(runner));
+  mu_assert(QueueFile_size(queues[0]) == 2);
+  mu_assert(QueueFile_isEmpty(queues[1]));
+}
+
+static uint64_t executedBytes;
+
+static bool sumBytesTask(void* context, const byte* data, uint32_t length) {
+  (void) context;
+  mu_assert(data[length - 1] == (byte) length);
+  __sync_fetch_and_add(&executedBytes, length);
+  return true;
+}
+
+static void testReadsTasksLargerThanRefillBuffer() {
+  // Refills read at most 64KB at once, larger elements on their own.
+  const uint32_t lengths[] = { 10, 100000, 20, 70000, 30 };
+  static byte data[100000];
+  uint64_t total = 0;
+  uint32_t i;
+  for (i = 0; i < 5; i++) {
+    data[lengths[i] - 1] = (byte) lengths[i];
+    mu_assert(QueueFile_add(queues[0], data, 0, lengths[i]));
+    total += lengths[i];
+  }
+  executedBytes = 0;
+  TaskRunner* runner = TaskRunner_new(queues, QUEUES, sumBytesTask, NULL,
+                                      NULL);
+  mu_assert_notnull(runner);
+  awaitAcknowledged(runner, 5);
+  mu_assert(TaskRunner_stop(runner));
+  mu_assert(executedBytes == total);
+  mu_assert(QueueFile_isEmpty(queues[0]));
+}
+
+static void testStopLeavesUnfinishedTasksQueued() {
+  addTasks();
+  // The retry of the failing head is only due after stopping, so nothing of
+  // the second queue can be acknowledged.
+  failOnce = 1000;
+  TaskRunner_Options options;
+  TaskRunner_initOptions(&options);
+  options.retryDelayMillis = 100000;
+  options.maxInFlight = 2 * QUEUES * TASKS_PER_QUEUE;
+  TaskRunner* runner = TaskRunner_new(queues, QUEUES, countTask, executions,
+                                      &options);
+  mu_assert_notnull(runner);
+  awaitAcknowledged(runner, TASKS_PER_QUEUE);
+  mu_assert(TaskRunner_stop(runner));
+  mu_assert(QueueFile_isEmpty(queues[0]));
+  mu_assert(QueueFile_size(queues[1]) == TASKS_PER_QUEUE);
+}
+
+int main() {
+  LOG_SETDEBUGFAILLEVEL_WARN;
+  mu_run_test(testExecutesAndRemovesAllTasks);
+  mu_run_test(testPicksUpTasksAddedLater);
+  mu_run_test(testRetriesFailedTask);
+  mu_run_test(testFailingTasksDontHoldUpOtherQueues);
+  mu_run_test(testReadsTasksLargerThanRefillBuffer);
+  mu_run_test(testStopLeavesUnfinishedTasksQueued);
+
+  printf("%d tests passed.\n", tests_run);
+  return 0;
+}